@@ -0,0 +1,54 @@
+/**
+ * \file heap/include/heaplib/config.h
+ *
+ * \brief Compile-time configuration of heaplib.
+ *
+ * Each option is set through DEFS, for example
+ * `make DEFS="-DHEAPLIB_REGIONS=1 -DHEAPLIB_LOCK=HEAPLIB_LOCK_NONE"`, or as
+ * part of a build profile chosen with PROFILE. Options left unset give the
+ * full build. Machinery a build leaves out is compiled away rather than
+ * skipped at run time.
+ */
+#ifndef HEAPLIB_CONFIG_H
+#define HEAPLIB_CONFIG_H
+
+/* Lock models */
+#define HEAPLIB_LOCK_NONE 0	/* One thread; nothing is locked */
+#define HEAPLIB_LOCK_UP 1	/* One core; locks mask interrupts */
+#define HEAPLIB_LOCK_SMP 2	/* The platform's mutexes */
+
+#ifndef HEAPLIB_LOCK
+# define HEAPLIB_LOCK HEAPLIB_LOCK_SMP
+#endif
+
+/* Regions that can be added at once; 0 leaves it to the platform */
+#ifndef HEAPLIB_REGIONS
+# define HEAPLIB_REGIONS 0
+#endif
+
+/* Allocation granularity in bytes: a power of two of at least 8, and a
+ * divisor of a node's metadata. 0 is the larger of a word and 8 bytes.
+ */
+#ifndef HEAPLIB_CHUNK
+# define HEAPLIB_CHUNK 0
+#endif
+
+#if HEAPLIB_CHUNK && (HEAPLIB_CHUNK < 8 || (HEAPLIB_CHUNK & (HEAPLIB_CHUNK - 1)))
+# error "HEAPLIB_CHUNK must be a power of two of at least 8"
+#endif
+
+/* Support for heaplib_flags_natural */
+#ifndef HEAPLIB_NATURAL
+# define HEAPLIB_NATURAL 1
+#endif
+
+/* heaplib_walk, which debug builds have by default */
+#ifndef HEAPLIB_WALK
+# ifdef DEBUG
+#  define HEAPLIB_WALK 1
+# else
+#  define HEAPLIB_WALK 0
+# endif
+#endif
+
+#endif
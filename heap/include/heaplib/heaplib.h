@@ -10,13 +10,49 @@
 
 #define HEAPLIB_MAGIC 0xDEADF417ULL
 
-/* Minimum conceptual object for alignment */
-#define HEAPLIB_CHUNKSZ (sizeof(size_t))
+/* Minimum conceptual object for alignment. Nodes keep three flag bits in
+ * the low bits of their size word, so a chunk is never less than 8 bytes.
+ */
+#if HEAPLIB_CHUNK
+# define HEAPLIB_CHUNKSZ ((size_t)HEAPLIB_CHUNK)
+#else
+# define HEAPLIB_CHUNKSZ (sizeof(size_t) > 8 ? sizeof(size_t) : (size_t)8)
+#endif
 /* Convert chunks to bytes */
 #define HEAPLIB_C2B(x) ((x) * HEAPLIB_CHUNKSZ)
 /* Convert bytes to chunks (always rounded up) */
 #define HEAPLIB_B2C(x) ((x)/HEAPLIB_CHUNKSZ)+((((x)%HEAPLIB_CHUNKSZ)>0)?1:0)
 
+/* Reserved Regions commit at least this many bytes each time they grow */
+#define HEAPLIB_EXTEND_STEP (64 * 1024)
+
+/* The idle pass trims a Region once this many bytes were freed into it */
+#define HEAPLIB_TRIM_THRESHOLD (256 * 1024)
+
+/* The idle pass clears about this many free bytes per Region at a time */
+#define HEAPLIB_PREZERO_BUDGET (256 * 1024)
+
+/* The idle pass checks this many nodes per Region at a time */
+#define HEAPLIB_SCRUB_BUDGET 1024
+
+/* Allocations waiting for memory; a waiter that could be served by more than
+ * one Region sleeps on one of them and rescans the rest every slice.
+ */
+#define HEAPLIB_WAIT_FOREVER ((unsigned int)~0)
+#define HEAPLIB_WAIT_SLICE 10
+
+/* Asynchronous allocations that may be queued at once */
+#define HEAPLIB_ASYNC_MAX 32
+
+/* Holders one allocation may have; the count is kept in a byte */
+#define HEAPLIB_REFS_MAX 255
+
+/* Distinct tasks whose memory is accounted; a task without a quota has
+ * HEAPLIB_QUOTA_NONE.
+ */
+#define HEAPLIB_TASKS 64
+#define HEAPLIB_QUOTA_NONE ((size_t)0)
+
 /* We require a minimum of 4 chunks per node */
 #define HEAPLIB_MIN_CHUNKS 	8
 /* The minimum node size includes the minimum chunks required and the metadata
@@ -26,12 +62,22 @@
 				sizeof(heaplib_node_t) +		\
 				sizeof(heaplib_footer_t))
 
+/* Metadata layout. Node metadata is packed, which keeps it small. It still
+ * starts on a word boundary, as every node does, so the words in it that are
+ * updated atomically stay naturally aligned. Region descriptors are never
+ * packed, as they hold locks, condition variables and atomics that must be
+ * naturally aligned.
+ */
+#define HEAPLIB_PACKED __attribute__((packed, aligned(sizeof(size_t))))
+
 typedef size_t heaplib_magic_t;
 
 typedef struct heaplib_node_t heaplib_node_t;
 typedef struct heaplib_footer_t heaplib_footer_t;
 typedef struct heaplib_region_t heaplib_region_t;
 typedef struct heaplib_subregion_t heaplib_subregion_t;
+typedef struct heaplib_index_t heaplib_index_t;
+typedef struct heaplib_scrub_t heaplib_scrub_t;
 
 enum
 heaplib_flags_t
@@ -47,11 +93,28 @@ heaplib_flags_t
 	heaplib_flags_wiped =		(1 << 8), /**< Zero on free */
 	heaplib_flags_subregions =	(1 << 9), /**< Contains subregions */
 
-	heaplib_flags_smallreq =	(1 << 10), /**< Small requests only */
-	heaplib_flags_largereq =	(1 << 11), /**< Large requests only */
+	heaplib_flags_smallreq =	(1 << 10), /**< Below 1/16 of the Region */
+	heaplib_flags_largereq =	(1 << 11), /**< From 1/16 of the Region */
 
 	heaplib_flags_natural =		(1 << 12), /**< Natural alignment */
 
+	heaplib_flags_reserved =	(1 << 13), /**< Backed by page provider */
+	heaplib_flags_trim =		(1 << 14), /**< Trim when idle */
+	heaplib_flags_hugepage =	(1 << 15), /**< Back with huge pages */
+	heaplib_flags_pinned =		(1 << 16), /**< Pages can't be released */
+	heaplib_flags_zeroed =		(1 << 17), /**< Added memory is clear */
+	heaplib_flags_prezero =		(1 << 18), /**< Clear free memory when idle */
+	heaplib_flags_waitmem =		(1 << 19), /**< Sleep until memory is free */
+
+	/* Placement policies of a Region; first fit if none is given */
+	heaplib_flags_nextfit =		(1 << 20), /**< Resume after last fit */
+	heaplib_flags_bestfit =		(1 << 21), /**< Smallest node that fits */
+	heaplib_flags_exactfit =	(1 << 22), /**< Unsplit node, else first */
+
+	heaplib_flags_scrub =		(1 << 23), /**< Check integrity when idle */
+	heaplib_flags_anonymous =	(1 << 24), /**< Added memory is anonymous */
+	heaplib_flags_direct =		(1 << 25), /**< Free without walking */
+
 	/* Flags for defining a Region */
 	heaplib_flags_regionmask =	(heaplib_flags_wiped |
 						heaplib_flags_internal |
@@ -68,6 +131,11 @@ heaplib_flags_t
 						heaplib_flags_internal |
 						heaplib_flags_encrypted),
 
+	/* Placement policy flags */
+	heaplib_flags_placemask =	(heaplib_flags_nextfit |
+						heaplib_flags_bestfit |
+						heaplib_flags_exactfit),
+
 	/* "Don't use" flags */
 	heaplib_flags_dontusemask =	(heaplib_flags_restrict |
 						heaplib_flags_busy),
@@ -75,35 +143,144 @@ heaplib_flags_t
 
 typedef enum heaplib_flags_t heaplib_flags_t;
 
+/* Node sizes kept in a free node index saturate here; a larger request
+ * can't be searched for and walks the free list.
+ */
+#define HEAPLIB_INDEX_SIZE_MAX (INT32_MAX - 1)
+
+/**
+ * \brief The free nodes of a Region as dense arrays, for vector searches.
+ *
+ * Entries are sorted by offset from the Region base. A node taken off the
+ * free list leaves a hole of size 0, which no search matches, until enough
+ * holes build up to be worth compacting. An index that overflows is marked
+ * invalid and rebuilt from the free list once it would fit again.
+ */
+struct
+heaplib_index_t
+{
+	int32_t size[PLATFORM_INDEX_MAX];
+	uint32_t off[PLATFORM_INDEX_MAX];
+	uint32_t n;			/**< Entries in use, holes included */
+	uint32_t holes;
+	boolean_t valid;
+};
+
+/**
+ * \brief Progress of the integrity scrub through a Region.
+ *
+ * Nodes are checked a few at a time, and the Region's counters are compared
+ * with the tallies once a whole pass is made without the Region changing.
+ */
+struct
+heaplib_scrub_t
+{
+	heaplib_node_t * next;		/**< Next node to check; nil starts over */
+	size_t changes;			/**< Region changes when the pass began */
+	size_t free;			/**< Tallies since the pass began */
+	size_t nodes_free;
+	size_t nodes_active;
+	size_t passes;			/**< Whole passes checked */
+	size_t corrupt;			/**< Corruption found */
+};
+
 struct
 heaplib_region_t
 {
-	size_t free;
+	/* Read-mostly; scanned by every thread searching for a Region */
 	size_t size;
+	size_t reserved;
 	vbaddr_t addr;
+	heaplib_flags_t flags;
+	size_t route_min;		/**< Smallest request routed here */
+	size_t route_max;		/**< Past the largest; 0 is no limit */
+
+	/* Written by the lock holder on every allocation and free */
+	heaplib_lock_t lock;
+	size_t free;
 	size_t nodes_free;
 	size_t nodes_active;
-	heaplib_lock_t lock;
-	heaplib_flags_t flags;
+	size_t untrimmed;
 	heaplib_node_t * free_list;
+	heaplib_node_t * rover;		/**< Next fit resumes here */
+	heaplib_node_t * pending;	/**< Frees left for the lock holder */
+	heaplib_index_t * index;	/**< Free nodes for vector searches */
+	size_t changes;			/**< Nodes split, joined, taken or freed */
 
-} __attribute__((packed));
+	/* Allocations sleeping until enough memory is freed here */
+	heaplib_cond_t cond;
+	size_t waiters;
+	size_t wait_min;
+
+	/* Background integrity checks */
+	heaplib_scrub_t scrub;
+
+};
 
+#ifdef HEAPLIB_COMPACT
+/* Compact nodes: a 32-bit size word holding the active bit, a 16-bit magic,
+ * the node flags and a refcount. Free nodes keep their list links as 32-bit
+ * Region-relative offsets in the first payload word. Regions must be smaller
+ * than 4 GiB.
+ */
 struct
 heaplib_node_t
 {
-	union {
-		size_t active:1;
-		size_t size;
+	uint32_t size;
+	uint16_t magic;
+	uint8_t flags;
+	uint8_t refs;
+
+	uint8_t payload[];
+
+} HEAPLIB_PACKED;
+
+struct
+heaplib_footer_t
+{
+	uint32_t magic;
+	uint32_t size;
+
+} HEAPLIB_PACKED;
+
+struct
+heaplib_link_t
+{
+	uint32_t next;
+	uint32_t prev;
+
+} HEAPLIB_PACKED;
+
+typedef struct heaplib_link_t heaplib_link_t;
+
+#define HEAPLIB_NODE_MAGIC ((uint16_t)(HEAPLIB_MAGIC & 0xffff))
+#define HEAPLIB_LINK_NIL ((uint32_t)~0)
+#define HEAPLIB_REGION_MAX ((size_t)0xffffffff & ~(HEAPLIB_CHUNKSZ - 1))
+#else
+/* The flags and reference count of an active node share a word, so the
+ * count can be updated atomically without disturbing the flags.
+ */
+union
+heaplib_attr_t
+{
+	struct {
+		size_t flags:(sizeof(size_t) * 8 - 8);
+		size_t refs:8;
 	};
+	size_t word;
+};
+
+typedef union heaplib_attr_t heaplib_attr_t;
+
+struct
+heaplib_node_t
+{
+	size_t size;
 
 	union {
 		struct {
 			task_t task;
-			union {
-				size_t refs:8;
-				size_t flags;
-			};
+			heaplib_attr_t attr;
 		} pc_t;
 	// };
 
@@ -118,7 +295,7 @@ heaplib_node_t
 
 	uint8_t payload[];
 
-} __attribute__((packed));
+} HEAPLIB_PACKED;
 
 struct
 heaplib_footer_t
@@ -126,7 +303,10 @@ heaplib_footer_t
 	heaplib_magic_t magic;
 	size_t size;
 
-} __attribute__((packed));
+} HEAPLIB_PACKED;
+
+#define HEAPLIB_NODE_MAGIC HEAPLIB_MAGIC
+#endif
 
 struct
 heaplib_subregion_t
@@ -147,30 +327,460 @@ heaplib_error_t
 
 typedef enum heaplib_error_t heaplib_error_t;
 
-#define heaplib_node_size(x) (((x)->size) & ~1)
+/**
+ * \brief Completion of an asynchronous allocation.
+ *
+ * Called with the new, zeroed memory and the caller's context. No heaplib
+ * lock is held, so the callback may allocate and free.
+ */
+typedef void (*heaplib_async_fn_t)(vaddr_t, void * );
+
+/**
+ * \brief A queued asynchronous allocation.
+ */
+struct
+heaplib_async_t
+{
+	struct heaplib_async_t * next;
+	size_t size;
+	heaplib_flags_t flags;
+	unsigned int priority;
+	heaplib_async_fn_t fn;
+	void * ctx;
+};
+
+typedef struct heaplib_async_t heaplib_async_t;
+
+/**
+ * \brief A bump allocator carved out of a single node.
+ *
+ * The arena lives at the start of its own node. Objects are handed out in
+ * address order, chunk aligned and already zero, and are only given back
+ * all at once by rewinding or destroying the arena. An arena belongs to one
+ * task at a time; nothing in it is locked.
+ */
+struct
+heaplib_arena_t
+{
+	vbaddr_t next;		/**< Next byte to hand out */
+	vbaddr_t end;
+	vbaddr_t base;		/**< First byte that can be handed out */
+};
+
+typedef struct heaplib_arena_t heaplib_arena_t;
+
+/**
+ * \brief What an allocation that takes a task over its quota does.
+ */
+enum
+heaplib_quota_t
+{
+	heaplib_quota_fail,		/**< Return heaplib_error_again */
+	heaplib_quota_throttle,		/**< Wait for the task to free memory */
+};
+
+typedef enum heaplib_quota_t heaplib_quota_t;
+
+/**
+ * \brief Memory held by one task, in usable bytes.
+ */
+struct
+heaplib_task_usage_t
+{
+	size_t bytes;
+	size_t objects;
+	size_t peak;		/**< Most bytes held at once */
+	size_t quota;		/**< HEAPLIB_QUOTA_NONE if unlimited */
+	size_t used;		/**< Bytes counted against the quota */
+	size_t regions[NREGIONS + 1];	/**< By Region; large objects last */
+};
+
+typedef struct heaplib_task_usage_t heaplib_task_usage_t;
+
+/**
+ * \brief Operations with latency statistics.
+ */
+enum
+heaplib_stat_op_t
+{
+	heaplib_stat_calloc,
+	heaplib_stat_free,
+	heaplib_stat_coalesce,
+	heaplib_stat_lock,
+
+	heaplib_stat_nops,
+};
+
+typedef enum heaplib_stat_op_t heaplib_stat_op_t;
+
+/**
+ * \brief Latency summary of one operation, in nanoseconds.
+ *
+ * Percentiles are the upper bound of the bucket they fall in, so they
+ * overstate the true value by at most an eighth.
+ */
+struct
+heaplib_stats_t
+{
+	uint64_t count;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+typedef struct heaplib_stats_t heaplib_stats_t;
+
+/* Latency statistics are kept in log-linear buckets: eight per power of two,
+ * so every bucket is within 12.5% of its value. Statistics by Region have one
+ * extra slot for work outside any Region, such as the Master lock and large
+ * objects. Requests are split into size classes of powers of four from 32
+ * bytes up.
+ */
+#define HEAPLIB_STATS_SUB 8
+#define HEAPLIB_STATS_BUCKETS 304
+#define HEAPLIB_STATS_REGIONS (NREGIONS + 1)
+#define HEAPLIB_STATS_CLASSES 8
+
+/* Convert platform clock ticks to nanoseconds */
+#define HEAPLIB_TICKS_NS(t) (PLATFORM_CLOCK_HZ == 1000000000ULL ? (t) : \
+	(t) * 1000000000ULL / PLATFORM_CLOCK_HZ)
+
+#ifdef HEAPLIB_STATS
+# define heaplib_stat_start() platform_clock()
+# define heaplib_stat_stop(op, r, z, t) \
+	__heaplib_stat_record((op), (r), (z), platform_clock() - (t))
+#else
+# define heaplib_stat_start() ((uint64_t)0)
+# define heaplib_stat_stop(op, r, z, t) ((void)(t))
+#endif
+
+/* Snapshots are a header, then each active Region followed by its nodes in
+ * address order. All fields are in host byte order; the magic reads
+ * "HLSN" on little-endian hosts.
+ */
+#define HEAPLIB_SNAPSHOT_MAGIC 0x4e534c48UL
+#define HEAPLIB_SNAPSHOT_VERSION 1
+
+struct
+heaplib_snapshot_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nregions;
+	uint64_t time;		/**< platform_time_ms when taken */
+	uint64_t length;	/**< Bytes in this snapshot, header included */
+
+} __attribute__((packed));
+
+struct
+heaplib_snapshot_region_t
+{
+	uint64_t addr;
+	uint64_t size;		/**< Bytes committed */
+	uint64_t reserved;	/**< Bytes the Region may grow to */
+	uint64_t free;
+	uint32_t flags;
+	uint16_t index;
+	uint8_t header;		/**< Bytes of metadata before each payload */
+	uint8_t footer;		/**< Bytes of metadata after each payload */
+	uint64_t nnodes;
+
+} __attribute__((packed));
+
+struct
+heaplib_snapshot_node_t
+{
+	uint64_t offset;	/**< From the Region base */
+	uint64_t size;		/**< Payload bytes; low bits are HEAPLIB_NODE_* */
+	uint64_t task;		/**< Owner of an active node */
+	uint32_t flags;		/**< Node flags of an active node */
+
+} __attribute__((packed));
+
+typedef struct heaplib_snapshot_t heaplib_snapshot_t;
+typedef struct heaplib_snapshot_region_t heaplib_snapshot_region_t;
+typedef struct heaplib_snapshot_node_t heaplib_snapshot_node_t;
+
+/* Event tracing. Built with HEAPLIB_TRACE, the sites that print debug text
+ * also record a binary event in a ring owned by the calling thread, without
+ * locking or formatting anything. heaplib_trace_read copies the rings out
+ * for tools/heaptrace to decode.
+ */
+#ifndef HEAPLIB_TRACE_EVENTS
+# define HEAPLIB_TRACE_EVENTS 4096	/* Per thread; a power of two */
+#endif
+
+enum
+heaplib_trace_op_t
+{
+	heaplib_trace_calloc,		/**< 'node' is the pointer, nil if none */
+	heaplib_trace_free,		/**< 'node' is the pointer */
+	heaplib_trace_defer,		/**< A free left for the lock holder */
+	heaplib_trace_drain,		/**< 'size' deferred frees finished */
+	heaplib_trace_coalesce,		/**< 'node' grew to 'size' */
+	heaplib_trace_split,		/**< 'node' of 'size' was split */
+	heaplib_trace_expand,		/**< 'node' of 'size' was used whole */
+	heaplib_trace_natural,		/**< 'node' of 'size' was aligned */
+	heaplib_trace_extend,		/**< The Region grew to 'size' */
+	heaplib_trace_add,		/**< A Region of 'size' bytes at 'node' */
+	heaplib_trace_bad_pointer,	/**< 'node' isn't a live allocation */
+	heaplib_trace_bad_magic,	/**< 'node' is corrupt */
+	heaplib_trace_bad_list,		/**< The free list or index is corrupt */
+	heaplib_trace_shared,		/**< Free of a pointer with 'size' refs */
+	heaplib_trace_double_free,
+	heaplib_trace_lock_failed,
+	heaplib_trace_region_failed,	/**< A Region of 'size' can't be used */
+	heaplib_trace_queue_full,
+
+	heaplib_trace_nops,
+};
+
+typedef enum heaplib_trace_op_t heaplib_trace_op_t;
+
+/* Traces are a header, then each thread followed by its events, oldest
+ * first. All fields are in host byte order; the magic reads "HLTR" on
+ * little-endian hosts.
+ */
+#define HEAPLIB_TRACE_MAGIC 0x52544c48UL
+#define HEAPLIB_TRACE_VERSION 1
+
+struct
+heaplib_trace_t
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nthreads;
+	uint64_t hz;		/**< Event timestamp ticks per second */
+	uint64_t length;	/**< Bytes in this trace, header included */
+
+} __attribute__((packed));
+
+struct
+heaplib_trace_thread_t
+{
+	uint64_t task;
+	uint64_t nevents;
+	uint64_t lost;		/**< Overwritten before they were read */
+
+} __attribute__((packed));
+
+/* Laid out without padding, so the rings can be copied out as they are */
+struct
+heaplib_trace_event_t
+{
+	uint64_t time;		/**< platform_clock */
+	uint64_t size;
+	uint64_t node;
+	uint32_t seq;		/**< Position in the ring plus one, or zero */
+	uint16_t op;
+	uint16_t region;	/**< NREGIONS for work outside any Region */
+};
+
+typedef struct heaplib_trace_t heaplib_trace_t;
+typedef struct heaplib_trace_thread_t heaplib_trace_thread_t;
+typedef struct heaplib_trace_event_t heaplib_trace_event_t;
+
+#ifdef HEAPLIB_TRACE
+# define heaplib_trace(op, h, z, n) \
+	__heaplib_trace_record((op), (h), (uint64_t)(z), (uint64_t)(uintptr_t)(n))
+#else
+# define heaplib_trace(op, h, z, n)
+#endif
+
+/* Lock profiling. HEAPLIB_LOCKPROF records, for the Master and each Region
+ * lock, how often and how long it was waited for and held, attributed to the
+ * function that took it. Call sites up to this many per lock are kept apart.
+ */
+#define HEAPLIB_LOCKPROF_SITES 16
+
+#ifdef HEAPLIB_LOCKPROF
+# define heaplib_lockprof_acquired(x, s, c, t) \
+	__heaplib_lockprof_acquired((x), (s), (c), (t))
+# define heaplib_lockprof_released(x) __heaplib_lockprof_released((x))
+#else
+# define heaplib_lockprof_acquired(x, s, c, t) ((void)(s), (void)(c))
+# define heaplib_lockprof_released(x)
+#endif
+
+#if defined(HEAPLIB_STATS) || defined(HEAPLIB_LOCKPROF)
+# define heaplib_lock_clock() platform_clock()
+#else
+# define heaplib_lock_clock() ((uint64_t)0)
+#endif
+
+/* Flag bits kept in the low bits of every node's size word. PREVFREE is set
+ * when the node physically before this one is free, and is the only way to
+ * know that its footer is present. ZERO is only set on free nodes whose
+ * payload is known to be clear, apart from any free list links within it.
+ */
+#define HEAPLIB_NODE_ACTIVE ((size_t)1 << 0)
+#define HEAPLIB_NODE_PREVFREE ((size_t)1 << 1)
+#define HEAPLIB_NODE_ZERO ((size_t)1 << 2)
+#define HEAPLIB_NODE_BITS (HEAPLIB_NODE_ACTIVE | \
+				HEAPLIB_NODE_PREVFREE | \
+				HEAPLIB_NODE_ZERO)
+
+#define heaplib_node_size(x) (((size_t)(x)->size) & ~HEAPLIB_NODE_BITS)
+#define heaplib_node_set_size(x, z) \
+	((x)->size = ((x)->size & HEAPLIB_NODE_BITS) | (z))
+
+#define heaplib_node_active(x) (((x)->size & HEAPLIB_NODE_ACTIVE) != 0)
+#define heaplib_node_set_active(x) ((x)->size |= HEAPLIB_NODE_ACTIVE)
+#define heaplib_node_clear_active(x) ((x)->size &= ~HEAPLIB_NODE_ACTIVE)
+
+#define heaplib_node_prev_free(x) (((x)->size & HEAPLIB_NODE_PREVFREE) != 0)
+#define heaplib_node_set_prev_free(x) ((x)->size |= HEAPLIB_NODE_PREVFREE)
+#define heaplib_node_clear_prev_free(x) ((x)->size &= ~HEAPLIB_NODE_PREVFREE)
+
+#define heaplib_node_zero(x) (((x)->size & HEAPLIB_NODE_ZERO) != 0)
+#define heaplib_node_set_zero(x) ((x)->size |= HEAPLIB_NODE_ZERO)
+#define heaplib_node_clear_zero(x) ((x)->size &= ~HEAPLIB_NODE_ZERO)
+
+/* With HEAPLIB_FOOTERLESS only free nodes carry a footer. An active node
+ * lends its footer bytes to the payload, and the next node's PREVFREE bit
+ * says whether a footer is there to be read.
+ */
+#ifdef HEAPLIB_FOOTERLESS
+# define HEAPLIB_FOOTER_SLACK (sizeof(heaplib_footer_t))
+#else
+# define HEAPLIB_FOOTER_SLACK ((size_t)0)
+#endif
+
+/* Bytes a caller may use in an active node */
+#define heaplib_node_usable(x) (heaplib_node_size((x)) + HEAPLIB_FOOTER_SLACK)
+
+/* Node size needed to hold a request of 'z' payload bytes */
+#define heaplib_node_request(z) (((z) > HEAPLIB_FOOTER_SLACK + HEAPLIB_CHUNKSZ) ? \
+	((z) - HEAPLIB_FOOTER_SLACK) : HEAPLIB_CHUNKSZ)
+
+/* Node sizes and payloads stay in whole chunks only if the metadata does */
+_Static_assert(sizeof(heaplib_node_t) % HEAPLIB_CHUNKSZ == 0 &&
+	sizeof(heaplib_footer_t) % HEAPLIB_CHUNKSZ == 0,
+	"HEAPLIB_CHUNK must divide the node header and footer");
+
+#ifdef HEAPLIB_COMPACT
+/* Only the node flags are kept, shifted down so they fit in a byte */
+#define heaplib_node_flags(x) ((heaplib_flags_t)((x)->flags << 1))
+#define heaplib_node_set_flags(x, f) \
+	((x)->flags = (uint8_t)(((f) & heaplib_flags_nodemask) >> 1))
+#define heaplib_node_task(x) ((task_t)nil)
+#define heaplib_node_set_task(x, t) ((void)(t))
+#define heaplib_node_refs(x) ((x)->refs)
+#define heaplib_node_set_refs(x, r) ((x)->refs = (r))
+
+/* Payload bytes a free node spends on its links */
+#define HEAPLIB_LINK_BYTES (sizeof(heaplib_link_t))
 
-#define heaplib_free_next(x) ((x)->free_t.next)
-#define heaplib_free_prev(x) ((x)->free_t.prev)
+#define __heaplib_link(x) ((heaplib_link_t * )&(x)->payload[0])
+#define __heaplib_off2node(h, o) ((o) == HEAPLIB_LINK_NIL ? nil : \
+	(heaplib_node_t * )((h)->addr + (o)))
+#define __heaplib_node2off(h, n) ((n) == nil ? HEAPLIB_LINK_NIL : \
+	(uint32_t)((vbaddr_t)(n) - (h)->addr))
+
+#define heaplib_free_next(h, x) __heaplib_off2node((h), __heaplib_link((x))->next)
+#define heaplib_free_prev(h, x) __heaplib_off2node((h), __heaplib_link((x))->prev)
+#define heaplib_free_set_next(h, x, y) \
+	(__heaplib_link((x))->next = __heaplib_node2off((h), (y)))
+#define heaplib_free_set_prev(h, x, y) \
+	(__heaplib_link((x))->prev = __heaplib_node2off((h), (y)))
+#else
+#define heaplib_node_flags(x) ((heaplib_flags_t)(x)->pc_t.attr.flags)
+#define heaplib_node_set_flags(x, f) ((x)->pc_t.attr.flags = (f))
+#define heaplib_node_task(x) ((x)->pc_t.task)
+#define heaplib_node_set_task(x, t) ((x)->pc_t.task = (t))
+#define heaplib_node_refs(x) ((x)->pc_t.attr.refs)
+#define heaplib_node_set_refs(x, r) ((x)->pc_t.attr.refs = (r))
+
+#define HEAPLIB_LINK_BYTES ((size_t)0)
+
+#define heaplib_free_next(h, x) ((x)->free_t.next)
+#define heaplib_free_prev(h, x) ((x)->free_t.prev)
+#define heaplib_free_set_next(h, x, y) ((x)->free_t.next = (y))
+#define heaplib_free_set_prev(h, x, y) ((x)->free_t.prev = (y))
+#endif
 
 /**
  * \brief Lock a Region or Master according to flags
  *
+ * A lock that is already held is waited for unless heaplib_flags_nowait is
+ * given. A failed first attempt counts as contention.
+ *
  * \param x A heaplib Region or Master lock
  * \param f Flags for locking.
  *
  * \author Don A. Bailey <donb@labmou.se>
  * \date December 31, 2019
  */
-#define heaplib_region_lock_flags(x, f) ({				\
+#define heaplib_region_lock_flags(x, f) \
+	heaplib_region_lock_site((x), (f), __func__)
+
+/**
+ * \brief Lock a Region or Master on behalf of call site 's'.
+ *
+ * Helpers that lock for their callers pass the caller's name on, so the
+ * lock profile shows who the lock was really taken for.
+ */
+#define heaplib_region_lock_site(x, f, s) ({				\
 	boolean_t __x;							\
+	boolean_t __c;							\
+	uint64_t __t;							\
+	__t = heaplib_lock_clock();					\
         /* Attempt to lock the Region or Master. Yield to flags */	\
-        do {    							\
-                __x = heaplib_lock_trylock((x)) == 0;			\
-        }								\
-        while(!__x && ((f) & heaplib_flags_wait));			\
+	__x = heaplib_lock_trylock((x)) == 0;				\
+	__c = !__x;							\
+	if(!__x && ((f) & heaplib_flags_nowait) == 0)			\
+	{								\
+		heaplib_lock_lock((x));					\
+		__x = True;						\
+	}								\
+	heaplib_stat_stop(heaplib_stat_lock, __heaplib_lock_index((x)),	\
+		0, __t);						\
+	if(__x)								\
+		heaplib_lockprof_acquired((x), (s), __c, __t);		\
         (__x == False) ? heaplib_error_again : heaplib_error_none;	\
 })
 
+/**
+ * \brief Unlock a Region or Master taken with heaplib_region_lock_flags.
+ *
+ * \param x A heaplib Region or Master lock
+ */
+#define heaplib_region_unlock(x) ({					\
+	heaplib_lockprof_released((x));					\
+	heaplib_lock_unlock((x));					\
+})
+
+/**
+ * \brief Sleep on a Region's condition, releasing its lock meanwhile.
+ *
+ * The sleep isn't counted as time the lock was held.
+ *
+ * \param c A heaplib condition
+ * \param x The heaplib Region lock held by the caller
+ * \param ms Longest time to sleep
+ */
+#define heaplib_region_cond_wait(c, x, ms) ({				\
+	int __r;							\
+	heaplib_lockprof_released((x));					\
+	__r = platform_cond_wait((c), (x), (ms));			\
+	heaplib_lockprof_acquired((x), __func__, False,			\
+		heaplib_lock_clock());					\
+	__r;								\
+})
+
+/**
+ * \brief The granularity a Region commits and releases memory in.
+ *
+ * Huge page Regions work in whole huge pages, so growth and trimming never
+ * split one back into small pages.
+ *
+ * \param x A heaplib Region
+ */
+#define heaplib_region_page(x) \
+	((((x)->flags & heaplib_flags_hugepage) && platform_hugepage_size()) ? \
+		platform_hugepage_size() : platform_page_size())
+
 /**
  * \brief Ensure a Node is within the boundaries of a Region
  *
@@ -212,6 +822,9 @@ typedef enum heaplib_error_t heaplib_error_t;
 /**
  * \brief Rewind through the previous heaplib list.
  *
+ * The footer of the previous node is only read when the PREVFREE bit says
+ * the previous node is free, otherwise nil is returned.
+ *
  * \param x A heaplib node or the end of the heaplib region.
  *
  * \author Don A. Bailey <donb@labmou.se>
@@ -220,9 +833,15 @@ typedef enum heaplib_error_t heaplib_error_t;
 #define heaplib_node_prev(x) ({						\
 	heaplib_footer_t * __f;						\
 	vbaddr_t __x;							\
-	__f = ((heaplib_footer_t * )(((vbaddr_t)(x)) - sizeof(*__f)));	\
-	__x = (((vbaddr_t)__f) - heaplib_node_size(__f));		\
-	(heaplib_node_t * )(__x - sizeof(heaplib_node_t));		\
+	__x = nil;							\
+	if(heaplib_node_prev_free((x)))					\
+	{								\
+		__f = ((heaplib_footer_t * )(((vbaddr_t)(x)) -		\
+			sizeof(*__f)));					\
+		__x = (((vbaddr_t)__f) - heaplib_node_size(__f));	\
+		__x -= sizeof(heaplib_node_t);				\
+	}								\
+	(heaplib_node_t * )__x;						\
 })
 
 /**
@@ -257,7 +876,7 @@ typedef enum heaplib_error_t heaplib_error_t;
 extern void heaplib_init(void);
 
 /* Auxiliary */
-#if DEBUG
+#if HEAPLIB_WALK
 extern void heaplib_walk(void);
 #else
 # define heaplib_walk()
@@ -278,32 +897,110 @@ heaplib_region_trylock(heaplib_region_t * h, boolean_t w)
 	return heaplib_error_again;
 }
 
-#define HEAPLIB_REQUEST_THRESHOLD(x) ((x)->size / 16)
-
-__attribute__((always_inline)) __inline__ boolean_t
-__validate_region_request(heaplib_region_t * h, size_t z)
-{
-	if((h->flags & (heaplib_flags_smallreq|heaplib_flags_largereq)) == 0)
-	{
-		return True;
-	}
-
-	if((h->flags & heaplib_flags_smallreq) &&
-	    z < HEAPLIB_REQUEST_THRESHOLD(h))
-	{
-		return True;
-	}
+/* Routing: requests are sorted by the power of two below their size and by
+ * the Region flags they ask for, and each pair has an ordered list of the
+ * Regions to try.
+ */
+#define HEAPLIB_ROUTE_BANDS ((int)sizeof(size_t) * 8)
+#define HEAPLIB_ROUTE_KEYS 8 /* Every combination of heaplib_flags_regionmask */
 
-	return ((h->flags & heaplib_flags_largereq) &&
-		 z >= HEAPLIB_REQUEST_THRESHOLD(h)) || 
-		((h->flags & heaplib_flags_largereq) && 
-		  z < HEAPLIB_REQUEST_THRESHOLD(h));
-}
+/**
+ * \brief Whether requests of 'z' bytes may be placed in Region 'h'.
+ */
+#define heaplib_region_routed(h, z) \
+	((z) >= (h)->route_min && ((h)->route_max == 0 || (z) < (h)->route_max))
 
 /* Region handling */
 extern void __heaplib_region_delete_internal(heaplib_region_t * );
 extern heaplib_error_t heaplib_region_delete(heaplib_region_t * );
 extern heaplib_error_t heaplib_region_add(vaddr_t, size_t, heaplib_flags_t);
+extern heaplib_error_t heaplib_region_reserve(heaplib_region_t **, size_t, size_t, heaplib_flags_t);
+extern heaplib_error_t __heaplib_region_extend(heaplib_region_t *, size_t);
+extern heaplib_error_t heaplib_region_extend(heaplib_region_t *, size_t);
+extern size_t __heaplib_region_trim(heaplib_region_t * );
+extern size_t heaplib_region_trim(heaplib_region_t * );
+extern size_t __heaplib_region_prezero(heaplib_region_t *, size_t);
+extern heaplib_error_t __heaplib_region_scrub(heaplib_region_t *, size_t);
+extern heaplib_error_t heaplib_region_scrub(heaplib_region_t *, size_t);
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+extern int __heaplib_region_drain(heaplib_region_t * );
+#else
+/* Every free takes the lock, so nothing is ever left pending */
+__attribute__((always_inline)) __inline__ int
+__heaplib_region_drain(heaplib_region_t * h)
+{
+	(void)h;
+	return 0;
+}
+#endif
+extern heaplib_error_t heaplib_region_route(heaplib_region_t *, size_t, size_t);
+extern int __heaplib_region_routes(uint8_t *, size_t, heaplib_flags_t);
+extern heaplib_error_t __heaplib_region_lock_routed(
+				heaplib_region_t **,
+				int,
+				heaplib_flags_t);
+
+/* Asynchronous allocation */
+extern void __heaplib_async_init(void);
+extern void __heaplib_async_kick(void);
+extern heaplib_error_t heaplib_calloc_async(
+				heaplib_async_t **,
+				size_t,
+				heaplib_flags_t,
+				unsigned int,
+				heaplib_async_fn_t,
+				void * );
+extern heaplib_error_t heaplib_calloc_async_cancel(heaplib_async_t * );
+
+/* Task accounting */
+extern void __heaplib_task_charge(int, size_t);
+extern void __heaplib_task_credit(task_t, int, size_t);
+extern boolean_t __heaplib_task_over(heaplib_quota_t * );
+extern heaplib_error_t heaplib_task_quota(
+				task_t,
+				size_t,
+				heaplib_flags_t,
+				heaplib_quota_t);
+extern heaplib_error_t heaplib_task_usage(task_t, heaplib_task_usage_t * );
+
+/* Latency statistics */
+extern int __heaplib_region_index(vaddr_t);
+extern int __heaplib_lock_index(heaplib_lock_t * );
+extern void __heaplib_stats_init(void);
+extern void __heaplib_stat_record(heaplib_stat_op_t, int, size_t, uint64_t);
+extern heaplib_error_t heaplib_stats_query(
+				heaplib_stats_t *,
+				heaplib_stat_op_t,
+				int,
+				int);
+extern void heaplib_stats_dump(void);
+
+/* Lock profiling */
+extern void __heaplib_lockprof_init(void);
+extern void __heaplib_lockprof_acquired(
+				heaplib_lock_t *,
+				const char *,
+				boolean_t,
+				uint64_t);
+extern void __heaplib_lockprof_released(heaplib_lock_t * );
+extern void heaplib_lockprof_dump(void);
+
+/* Snapshots */
+extern heaplib_region_t * __heaplib_region_at(int);
+extern heaplib_error_t heaplib_snapshot(void *, size_t, size_t * );
+
+/* Tracing */
+extern int __heaplib_region_slot(heaplib_region_t * );
+extern void __heaplib_trace_record(
+				heaplib_trace_op_t,
+				heaplib_region_t *,
+				uint64_t,
+				uint64_t);
+extern heaplib_error_t heaplib_trace_read(void *, size_t, size_t * );
+
+/* Maintenance */
+extern void heaplib_idle(void);
+extern heaplib_error_t heaplib_idle_start(unsigned int);
 extern heaplib_error_t heaplib_region_find_next(heaplib_region_t **, heaplib_flags_t);
 extern heaplib_error_t heaplib_region_find_first(heaplib_region_t **, heaplib_flags_t);
 extern heaplib_error_t heaplib_ptr2region(vaddr_t, heaplib_region_t **, heaplib_flags_t);
@@ -311,6 +1008,92 @@ extern heaplib_error_t heaplib_ptr2region(vaddr_t, heaplib_region_t **, heaplib_
 /* Allocation */
 extern heaplib_error_t heaplib_free(vaddr_t *, heaplib_flags_t);
 extern heaplib_error_t heaplib_calloc(vaddr_t *, size_t, size_t, heaplib_flags_t);
+extern heaplib_error_t heaplib_calloc_timeout(
+				vaddr_t *,
+				size_t,
+				size_t,
+				heaplib_flags_t,
+				unsigned int);
+extern heaplib_error_t heaplib_realloc(vaddr_t *, size_t, heaplib_flags_t);
+extern heaplib_error_t __heaplib_calloc_from(
+				heaplib_region_t *,
+				vaddr_t *,
+				size_t,
+				heaplib_flags_t);
+
+/* Arenas */
+extern heaplib_error_t heaplib_arena_create(
+				heaplib_arena_t **,
+				heaplib_region_t *,
+				size_t,
+				heaplib_flags_t);
+extern heaplib_error_t heaplib_arena_rewind(heaplib_arena_t *, size_t);
+extern heaplib_error_t heaplib_arena_destroy(heaplib_arena_t **, heaplib_flags_t);
+
+/**
+ * \brief Allocate 'x' * 'y' zeroed bytes from arena 'a'.
+ *
+ * \return heaplib_error_again if the arena is full, or heaplib_error_fatal
+ * if the size overflows.
+ */
+__attribute__((always_inline)) __inline__ heaplib_error_t
+heaplib_arena_calloc(heaplib_arena_t * a, vaddr_t * vp, size_t x, size_t y)
+{
+	size_t z;
+
+	if(__builtin_mul_overflow(x, y, &z))
+		return heaplib_error_fatal;
+
+	if(z == 0)
+		z = 1;
+
+	if(z > (size_t)(a->end - a->next))
+		return heaplib_error_again;
+
+	/* Keep every object chunk aligned. The end is aligned too, so this
+	 * still fits.
+	 */
+	z = (z + HEAPLIB_CHUNKSZ - 1) & ~(HEAPLIB_CHUNKSZ - 1);
+
+	*vp = (vaddr_t)a->next;
+	a->next += z;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief The current fill of arena 'a', to rewind to later.
+ */
+#define heaplib_arena_mark(a) ((size_t)((a)->next - (a)->base))
+
+/* Free node index */
+extern void __heaplib_index_init(heaplib_region_t *, int);
+extern void __heaplib_index_reset(heaplib_region_t * );
+extern void __heaplib_index_insert(heaplib_region_t *, heaplib_node_t * );
+extern void __heaplib_index_remove(heaplib_region_t *, heaplib_node_t * );
+extern void __heaplib_index_resize(heaplib_region_t *, heaplib_node_t * );
+extern boolean_t __heaplib_index_ready(heaplib_region_t *, size_t);
+extern heaplib_node_t * __heaplib_index_first(heaplib_region_t *, size_t, uint32_t * );
+extern heaplib_node_t * __heaplib_index_best(heaplib_region_t *, size_t);
+extern heaplib_node_t * __heaplib_index_below(heaplib_region_t *, heaplib_node_t * );
+extern boolean_t __heaplib_index_check(heaplib_region_t * );
+
+/* Shared allocations */
+extern heaplib_error_t heaplib_retain(vaddr_t);
+extern heaplib_error_t heaplib_release(vaddr_t *, heaplib_flags_t);
+extern int heaplib_refs(vaddr_t);
+extern int __heaplib_refs_take(heaplib_node_t * );
+
+/* Large objects */
+extern heaplib_error_t heaplib_large_init(size_t, size_t);
+extern boolean_t __heaplib_large_want(size_t, heaplib_flags_t);
+extern boolean_t __heaplib_large_within(vaddr_t);
+extern heaplib_error_t __heaplib_large_calloc(vaddr_t *, size_t);
+extern heaplib_error_t __heaplib_large_free(vaddr_t);
+extern heaplib_error_t __heaplib_large_resize(vaddr_t *, size_t);
+extern size_t __heaplib_large_size(vaddr_t);
+extern task_t __heaplib_large_task(vaddr_t);
+extern heaplib_error_t __heaplib_large_refs(vaddr_t, int, int * );
 
 /* Pointer to Node conversion */
 extern boolean_t heaplib_ptr2node(heaplib_region_t *, vaddr_t, heaplib_node_t ** );
@@ -0,0 +1,274 @@
+/**
+ * \file heap/src/account.c
+ *
+ * \brief Per-task memory accounting and quotas.
+ *
+ * Every task that allocates is given a record in a small open-addressed
+ * table, claimed without a lock the first time the task is seen. Records
+ * count the bytes a task holds in each Region, plus one slot for large
+ * objects, the objects it holds and the most bytes it has held at once. All
+ * counters are updated atomically, so allocations and frees in different
+ * Regions never serialise on the table.
+ *
+ * A task may be given a quota on the bytes it holds, either across the heap
+ * or only in Regions carrying certain flags, such as internal SRAM. An
+ * allocation that takes the task over its quota is undone and then either
+ * fails or waits for the task's memory to be freed.
+ *
+ * Records are never released, so at most HEAPLIB_TASKS distinct tasks are
+ * accounted over the life of the heap; later ones allocate unaccounted.
+ */
+#include "heaplib/heaplib.h"
+
+struct
+heaplib_account_t
+{
+	task_t task;
+	long total;
+	long objects;
+	long peak;
+	size_t quota;
+	heaplib_flags_t qflags;
+	heaplib_quota_t policy;
+	long bytes[NREGIONS + 1];
+
+} __attribute__((aligned(HEAPLIB_CACHELINE)));
+
+typedef struct heaplib_account_t heaplib_account_t;
+
+static heaplib_account_t accounts[HEAPLIB_TASKS];
+static PLATFORM_THREAD_LOCAL heaplib_account_t * account_self;
+
+/**
+ * \brief The record for task 't', claiming a free one if 'claim' is set.
+ *
+ * \return nil if the task has no record and none could be claimed.
+ */
+static heaplib_account_t *
+__account_find(task_t t, boolean_t claim)
+{
+	heaplib_account_t * a;
+	uintptr_t k;
+	task_t o;
+	int i;
+
+	if(t == (task_t)nil)
+		return nil;
+
+	/* Task handles are aligned, so mix out the low bits */
+	k = ((uintptr_t)t >> 4) * (uintptr_t)2654435761UL;
+
+	for(i = 0; i < HEAPLIB_TASKS; i++)
+	{
+		a = &accounts[(k + i) % HEAPLIB_TASKS];
+
+		o = __atomic_load_n(&a->task, __ATOMIC_ACQUIRE);
+		if(o == t)
+			return a;
+
+		if(o != (task_t)nil)
+			continue;
+
+		if(!claim)
+			return nil;
+
+		if(__atomic_compare_exchange_n(&a->task, &o, t, False,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || o == t)
+		{
+			return a;
+		}
+	}
+
+	return nil;
+}
+
+/**
+ * \brief The calling task's record, remembered between calls.
+ */
+static heaplib_account_t *
+__account_self(void)
+{
+	heaplib_account_t * a;
+	task_t t;
+
+	t = GET_PLATFORM_TASKID();
+
+	/* Records never change hands, so a cached one is still good if it
+	 * names this task. Without thread-local storage the cache is shared.
+	 */
+	a = account_self;
+	if(a && a->task == t)
+		return a;
+
+	a = __account_find(t, True);
+	if(a)
+		account_self = a;
+
+	return a;
+}
+
+/**
+ * \brief Add 'z' bytes in Region 'r' to the calling task.
+ *
+ * \param r [in] The Region index, or NREGIONS for large objects.
+ * \param z [in] Usable bytes of the new object.
+ */
+void
+__heaplib_task_charge(int r, size_t z)
+{
+	heaplib_account_t * a;
+	long p;
+	long n;
+
+	a = __account_self();
+	if(!a)
+		return;
+
+	__atomic_fetch_add(&a->bytes[r], (long)z, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&a->objects, 1, __ATOMIC_RELAXED);
+	n = __atomic_add_fetch(&a->total, (long)z, __ATOMIC_RELAXED);
+
+	p = __atomic_load_n(&a->peak, __ATOMIC_RELAXED);
+	while(n > p && !__atomic_compare_exchange_n(&a->peak, &p, n, True,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * \brief Take 'z' bytes in Region 'r' away from task 't'.
+ *
+ * Nodes that don't record their owner, such as compact nodes, pass nil and
+ * are credited to the calling task instead.
+ */
+void
+__heaplib_task_credit(task_t t, int r, size_t z)
+{
+	heaplib_account_t * a;
+
+	a = t == (task_t)nil ? __account_self() : __account_find(t, False);
+	if(!a)
+		return;
+
+	__atomic_fetch_sub(&a->bytes[r], (long)z, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&a->objects, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&a->total, (long)z, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Bytes held by 'a' that count against its quota.
+ *
+ * Region flags are read without locking; a Region changing underneath only
+ * skews a single check.
+ */
+static long
+__account_used(heaplib_account_t * a, heaplib_flags_t q)
+{
+	heaplib_region_t * h;
+	long n;
+	int i;
+
+	if(q == 0)
+		return __atomic_load_n(&a->total, __ATOMIC_RELAXED);
+
+	n = 0;
+	for(i = 0; (h = __heaplib_region_at(i)) != nil; i++)
+	{
+		if((h->flags & q) == q)
+			n += __atomic_load_n(&a->bytes[i], __ATOMIC_RELAXED);
+	}
+
+	return n;
+}
+
+/**
+ * \brief Is the calling task over its quota?
+ *
+ * \param pp [out] The task's quota policy, if it is over.
+ */
+boolean_t
+__heaplib_task_over(heaplib_quota_t * pp)
+{
+	heaplib_account_t * a;
+	size_t q;
+
+	a = __account_self();
+	if(!a)
+		return False;
+
+	q = __atomic_load_n(&a->quota, __ATOMIC_RELAXED);
+	if(q == HEAPLIB_QUOTA_NONE)
+		return False;
+
+	if(__account_used(a, a->qflags) <= (long)q)
+		return False;
+
+	*pp = a->policy;
+	return True;
+}
+
+/**
+ * \brief Limit the bytes task 't' may hold.
+ *
+ * \param t [in] The task. It need not have allocated yet.
+ * \param z [in] The most bytes it may hold, or HEAPLIB_QUOTA_NONE.
+ * \param f [in] Only count Regions with all of these flags; 0 for all
+ * memory, including large objects.
+ * \param p [in] Whether allocations over the quota fail or wait.
+ *
+ * \return heaplib_error_fatal if there is no room to account for 't'.
+ */
+heaplib_error_t
+heaplib_task_quota(task_t t, size_t z, heaplib_flags_t f, heaplib_quota_t p)
+{
+	heaplib_account_t * a;
+
+	a = __account_find(t, True);
+	if(!a)
+		return heaplib_error_fatal;
+
+	/* Lift the old quota first, so no check sees a mix of the two */
+	__atomic_store_n(&a->quota, HEAPLIB_QUOTA_NONE, __ATOMIC_RELEASE);
+	a->qflags = f & heaplib_flags_regionmask;
+	a->policy = p;
+	__atomic_store_n(&a->quota, z, __ATOMIC_RELEASE);
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Report what task 't' holds.
+ *
+ * \return heaplib_error_fatal if 't' has never been accounted.
+ */
+heaplib_error_t
+heaplib_task_usage(task_t t, heaplib_task_usage_t * u)
+{
+	heaplib_account_t * a;
+	long n;
+	int i;
+
+	a = __account_find(t, False);
+	if(!a)
+		return heaplib_error_fatal;
+
+	/* Owners that can't be recorded are credited to whoever frees, which
+	 * can take a task below zero.
+	 */
+	for(i = 0; i <= NREGIONS; i++)
+	{
+		n = __atomic_load_n(&a->bytes[i], __ATOMIC_RELAXED);
+		u->regions[i] = n > 0 ? (size_t)n : 0;
+	}
+
+	n = __atomic_load_n(&a->total, __ATOMIC_RELAXED);
+	u->bytes = n > 0 ? (size_t)n : 0;
+	n = __atomic_load_n(&a->objects, __ATOMIC_RELAXED);
+	u->objects = n > 0 ? (size_t)n : 0;
+	u->peak = (size_t)__atomic_load_n(&a->peak, __ATOMIC_RELAXED);
+
+	u->quota = __atomic_load_n(&a->quota, __ATOMIC_RELAXED);
+	n = __account_used(a, a->qflags);
+	u->used = n > 0 ? (size_t)n : 0;
+
+	return heaplib_error_none;
+}
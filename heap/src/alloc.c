@@ -18,11 +18,13 @@ static heaplib_error_t __heaplib_calloc_do_split(
 				heaplib_node_t **,
 				size_t);
 
+#if HEAPLIB_NATURAL
 static heaplib_error_t __heaplib_calloc_do_natural(
 				heaplib_region_t *,
 				heaplib_node_t *,
 				heaplib_node_t **,
 				size_t);
+#endif
 
 static heaplib_error_t __heaplib_calloc_try_natural(
 				heaplib_region_t *,
@@ -43,12 +45,397 @@ static heaplib_error_t __heaplib_calloc_within_region(
 				size_t,
 				heaplib_flags_t);
 
+static heaplib_node_t * __heaplib_calloc_place(heaplib_region_t *, size_t);
 static heaplib_error_t __heaplib_coalesce(heaplib_region_t *, int * );
 static heaplib_error_t __heaplib_calloc(vaddr_t *, size_t, heaplib_flags_t);
+static heaplib_error_t __heaplib_calloc_any(
+				vaddr_t *,
+				size_t,
+				heaplib_flags_t,
+				unsigned int);
+static heaplib_error_t __heaplib_calloc_quota(
+				vaddr_t *,
+				size_t,
+				heaplib_flags_t,
+				unsigned int);
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
+static heaplib_error_t __heaplib_calloc_wait(
+				vaddr_t *,
+				size_t,
+				heaplib_flags_t,
+				unsigned int);
+#endif
+static heaplib_error_t __heaplib_calloc_in(
+				heaplib_region_t *,
+				vaddr_t *,
+				size_t,
+				heaplib_flags_t,
+				int * );
+
+/* Deferred frees are chained through the first word of their payload */
+#define __heaplib_pending_next(x) (*(heaplib_node_t ** )&(x)->payload[0])
+
+/**
+ * \brief Return active node 'a' to the free list of Region 'h'.
+ *
+ * \param L [in] The closest free node below 'a', or nil.
+ *
+ * \return Whether 'a' is now between two free nodes.
+ *
+ * \warning This must be called with the Region locked.
+ */
+static boolean_t
+__heaplib_free_node(heaplib_region_t * h, heaplib_node_t * a, heaplib_node_t * L)
+{
+	heaplib_node_t * N;
+
+	__heaplib_task_credit(heaplib_node_task(a),
+		__heaplib_region_index((vaddr_t)a), heaplib_node_usable(a));
+
+	if(heaplib_node_flags(a) & heaplib_flags_wiped)
+	{
+		platform_zero((vaddr_t)&a->payload[0], heaplib_node_usable(a));
+		heaplib_node_set_zero(a);
+	}
+
+	heaplib_node_clear_active(a);
+	heaplib_footer_init(a);
+
+	N = heaplib_node_next(a);
+	if(heaplib_region_within(N, h))
+		heaplib_node_set_prev_free(N);
+
+	/* Place the node back in the list */
+	if(!L)
+	{
+		/* Found a node lower in memory than free_list
+		 * or free_list has not yet been set.
+		 */
+		heaplib_free_set_next(h, a, h->free_list);
+		heaplib_free_set_prev(h, a, nil);
+		if(h->free_list)
+			heaplib_free_set_prev(h, h->free_list, a);
+		h->free_list = a;
+	}
+	else
+	{
+		heaplib_free_set_next(h, a, heaplib_free_next(h, L));
+		heaplib_free_set_next(h, L, a);
+		heaplib_free_set_prev(h, a, L);
+		if(heaplib_free_next(h, a))
+			heaplib_free_set_prev(h, heaplib_free_next(h, a), a);
+	}
+
+	__heaplib_index_insert(h, a);
+
+	h->changes++;
+	h->free += heaplib_node_size(a);
+	h->untrimmed += heaplib_node_size(a);
+	h->nodes_active -= 1;
+	h->nodes_free += 1;
+
+	/* Wake sleepers once there are enough free bytes for the smallest of
+	 * their requests. They coalesce before giving up, so fragmentation
+	 * can't strand them.
+	 */
+	if(h->waiters && h->free >= h->wait_min)
+	{
+		h->wait_min = (size_t)~0;
+		heaplib_cond_broadcast(&h->cond);
+	}
+
+	/* Only force coalesce if we are surrounded, otherwise occurrence is
+	 * too high
+	 */
+	L = heaplib_node_prev(a);
+
+	return (heaplib_region_within(N, h) && !heaplib_node_active(N)) &&
+		(heaplib_region_within(L, h) && !heaplib_node_active(L));
+}
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+/**
+ * \brief Leave the node at 'v' on the pending stack of Region 'h', for
+ * whoever holds its lock to free.
+ *
+ * No lock is taken. The node's only reference is taken first, so it can't
+ * be freed twice or shared while it waits.
+ *
+ * \param zp [out] The usable size of the node.
+ */
+static heaplib_error_t
+__heaplib_free_defer(heaplib_region_t * h, vaddr_t v, size_t * zp)
+{
+	heaplib_node_t * n;
+	heaplib_node_t * o;
+	int c;
+
+	n = (heaplib_node_t * )((vbaddr_t)v - sizeof(heaplib_node_t));
+	if(!heaplib_region_within(n, h) || n->magic != HEAPLIB_NODE_MAGIC ||
+	   !heaplib_node_active(n))
+	{
+		PRINTF("error: deferred free of a bad pointer %p\n", v);
+		heaplib_trace(heaplib_trace_bad_pointer, h, 0, v);
+		return heaplib_error_fatal;
+	}
+
+	c = __heaplib_refs_take(n);
+	if(c != 1)
+	{
+		PRINTF("error: deferred free of node %p with %d refs\n", n, c);
+		heaplib_trace(heaplib_trace_shared, h, c, v);
+		return c > 1 ? heaplib_error_again : heaplib_error_fatal;
+	}
+
+	*zp = heaplib_node_usable(n);
+
+	o = __atomic_load_n(&h->pending, __ATOMIC_RELAXED);
+	do {
+		__heaplib_pending_next(n) = o;
+	}
+	while(!__atomic_compare_exchange_n(&h->pending, &o, n, True,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	return heaplib_error_none;
+}
+#endif
+
+/**
+ * \brief The node of Region 'h' whose payload begins at 'v', or nil.
+ *
+ * A Region that is scrubbed in the background has its nodes checked there,
+ * so the node is found from 'v' directly and the free node below it from
+ * the index. So is one flagged heaplib_flags_direct, which gives up those
+ * checks for speed. Otherwise the Region is walked from its base, checking
+ * the magic of every node on the way.
+ *
+ * \param Lp [out] The closest free node below it, or nil.
+ *
+ * \warning This must be called with the Region locked.
+ */
+static heaplib_node_t *
+__heaplib_free_find(heaplib_region_t * h, vaddr_t v, heaplib_node_t ** Lp)
+{
+	heaplib_node_t * a;
+	int num;
+
+	*Lp = nil;
+
+	if((h->flags & (heaplib_flags_scrub | heaplib_flags_direct)) &&
+	   __heaplib_index_ready(h, 1))
+	{
+		a = (heaplib_node_t * )((vbaddr_t)v - sizeof(heaplib_node_t));
+		if(!heaplib_region_within(a, h) ||
+		   ((size_t)v & (HEAPLIB_CHUNKSZ - 1)) != 0 ||
+		   a->magic != HEAPLIB_NODE_MAGIC ||
+		   (vbaddr_t)heaplib_node_next(a) > h->addr + h->size)
+		{
+			PRINTF("error: free of a bad pointer %p\n", v);
+			heaplib_trace(heaplib_trace_bad_pointer, h, 0, v);
+			return nil;
+		}
+
+		*Lp = __heaplib_index_below(h, a);
+		return a;
+	}
+
+	num = 0;
+	a = (heaplib_node_t * )h->addr;
+	while(heaplib_region_within(a, h))
+	{
+		/* Save the Last (most recently observed) Free node */
+		if(!heaplib_node_active(a))
+			*Lp = a;
+
+		if(a->magic != HEAPLIB_NODE_MAGIC)
+		{
+			PRINTF("error: magic failure at node=%d/%p\n", num, a);
+			heaplib_trace(heaplib_trace_bad_magic, h, 0, a);
+			return nil;
+		}
+		num++;
+
+		if(v == (vaddr_t)&a->payload[0])
+			return a;
+
+		a = heaplib_node_next(a);
+	}
+
+	return nil;
+}
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+/**
+ * \brief Report pending node 'n' of Region 'h', which isn't a node that
+ * can be freed, and drop it from the batch.
+ */
+static void
+__heaplib_drain_bad(heaplib_region_t * h, heaplib_node_t * n)
+{
+	USED(h);
+	USED(n);
+
+	PRINTF("error: pending node %p isn't an active node\n", n);
+	heaplib_trace(heaplib_trace_bad_pointer, h, 0, &n->payload[0]);
+}
+
+/**
+ * \brief Put the sorted batch 's' back on the pending stack of Region 'h'.
+ */
+static void
+__heaplib_drain_return(heaplib_region_t * h, heaplib_node_t * s)
+{
+	heaplib_node_t * t;
+	heaplib_node_t * o;
+
+	for(t = s; __heaplib_pending_next(t); t = __heaplib_pending_next(t))
+		;
+
+	o = __atomic_load_n(&h->pending, __ATOMIC_RELAXED);
+	do {
+		__heaplib_pending_next(t) = o;
+	}
+	while(!__atomic_compare_exchange_n(&h->pending, &o, s, True,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+/**
+ * \brief Free every node left on the pending stack of Region 'h'.
+ *
+ * The stack is sorted by address so the whole batch is freed in one walk
+ * of the Region. Queued asynchronous requests aren't kicked, as that can't
+ * be done with a Region locked; the caller should once it is unlocked.
+ *
+ * Entries that aren't active nodes are reported and skipped. If the walk
+ * meets a corrupt node, the rest of the batch goes back on the stack rather
+ * than being lost, as those nodes can no longer be freed any other way.
+ *
+ * \return The number of nodes freed.
+ *
+ * \warning This must be called with the Region locked.
+ */
+int
+__heaplib_region_drain(heaplib_region_t * h)
+{
+	heaplib_node_t * p;
+	heaplib_node_t * s;
+	heaplib_node_t * n;
+	heaplib_node_t * L;
+	heaplib_node_t * a;
+	heaplib_node_t ** q;
+	boolean_t c;
+	int k;
+
+	/* Ordered against the waiter count; see heaplib_free */
+	if(!__atomic_load_n(&h->pending, __ATOMIC_SEQ_CST))
+		return 0;
+
+	p = __atomic_exchange_n(&h->pending, nil, __ATOMIC_SEQ_CST);
+
+	/* Sort the batch by address; it is rarely more than a few nodes */
+	s = nil;
+	while(p)
+	{
+		n = p;
+		p = __heaplib_pending_next(p);
+
+		for(q = &s; *q && *q < n; q = &__heaplib_pending_next(*q))
+			;
+
+		__heaplib_pending_next(n) = *q;
+		*q = n;
+	}
+
+	c = False;
+	k = 0;
+
+	/* Scrubbed and direct Regions find each node's neighbour in the index */
+	if((h->flags & (heaplib_flags_scrub | heaplib_flags_direct)) &&
+	   __heaplib_index_ready(h, 1))
+	{
+		for(; s; s = p)
+		{
+			p = __heaplib_pending_next(s);
+			if(!heaplib_region_within(s, h) ||
+			   s->magic != HEAPLIB_NODE_MAGIC ||
+			   !heaplib_node_active(s))
+			{
+				__heaplib_drain_bad(h, s);
+				continue;
+			}
+
+			c |= __heaplib_free_node(h, s, __heaplib_index_below(h, s));
+			k++;
+		}
+
+		s = nil;
+	}
+
+	L = nil;
+	a = (heaplib_node_t * )h->addr;
+	while(s && heaplib_region_within(a, h))
+	{
+		if(a->magic != HEAPLIB_NODE_MAGIC)
+		{
+			PRINTF("error: magic failure draining node=%p\n", a);
+			heaplib_trace(heaplib_trace_bad_magic, h, 0, a);
+			__heaplib_drain_return(h, s);
+			s = nil;
+			break;
+		}
+
+		/* Entries the walk stepped over aren't nodes */
+		while(s && s < a)
+		{
+			__heaplib_drain_bad(h, s);
+			s = __heaplib_pending_next(s);
+		}
+
+		if(a == s)
+		{
+			s = __heaplib_pending_next(s);
+			if(heaplib_node_active(a))
+			{
+				c |= __heaplib_free_node(h, a, L);
+				k++;
+			}
+			else
+			{
+				__heaplib_drain_bad(h, a);
+			}
+		}
+
+		if(!heaplib_node_active(a))
+			L = a;
+
+		a = heaplib_node_next(a);
+	}
+
+	/* And those past the last node */
+	for(; s; s = __heaplib_pending_next(s))
+		__heaplib_drain_bad(h, s);
+
+	if(c)
+		__heaplib_coalesce(h, nil);
+
+	__heaplib_region_delete_internal(h);
+
+	heaplib_trace(heaplib_trace_drain, h, k, nil);
+
+	return k;
+}
+#endif
 
 /**
  * \brief Free a node.
  *
+ * An allocation with more than one holder isn't freed; heaplib_error_again
+ * is returned and the pointer is left alone, so it can be released instead.
+ *
+ * If the Region is locked by another thread, the node is left for that
+ * thread to free rather than waiting for it, unless heaplib_flags_wait is
+ * given.
+ *
  * \param vp [in] The pointer to free.
  * \param f [in] Flags.
  *
@@ -63,236 +450,772 @@ heaplib_free(vaddr_t * vp, heaplib_flags_t f)
 	heaplib_node_t * L;
 	heaplib_node_t * a;
 	heaplib_error_t e;
+	uint64_t t;
 	vaddr_t v;
-	int num;
+	task_t o;
+	size_t z;
+	int i;
+	int c;
+
+	t = heaplib_stat_start();
+
+	v = *vp;
+	*vp = nil;
+
+	if(__heaplib_large_within(v))
+	{
+		if(__heaplib_large_refs(v, 0, &c) == heaplib_error_none && c > 1)
+		{
+			PRINTF("error: free of a shared allocation %p\n", v);
+			heaplib_trace(heaplib_trace_shared, nil, c, v);
+			*vp = v;
+			return heaplib_error_again;
+		}
+
+		z = __heaplib_large_size(v);
+		o = __heaplib_large_task(v);
+		e = __heaplib_large_free(v);
+		if(e == heaplib_error_none)
+			__heaplib_task_credit(o, NREGIONS, z);
+		heaplib_stat_stop(heaplib_stat_free, NREGIONS, z, t);
+		heaplib_trace(heaplib_trace_free, nil, z, v);
+		__heaplib_async_kick();
+		return e;
+	}
+
+	// XXX
+	// change this to go backward if we are beyond the midpoint
+
+	/* Make sure the pointer is valid */
+	PRINTF("free: find region\n");
+
+	i = __heaplib_region_index(v);
+	if(i == NREGIONS)
+	{
+		PRINTF("free: cant find region\n");
+		heaplib_trace(heaplib_trace_bad_pointer, nil, 0, v);
+		return heaplib_error_fatal;
+	}
+
+	h = __heaplib_region_at(i);
+
+	/* Rather than wait behind a long coalesce, leave the node for the
+	 * lock holder.
+	 */
+	e = heaplib_region_lock_flags(&h->lock, (f & heaplib_flags_wait) ? f :
+		f | heaplib_flags_nowait);
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+	if(e != heaplib_error_none)
+	{
+		e = __heaplib_free_defer(h, v, &z);
+		if(e == heaplib_error_again)
+		{
+			*vp = v;
+		}
+		else if(e == heaplib_error_none)
+		{
+			heaplib_stat_stop(heaplib_stat_free, i, z, t);
+			heaplib_trace(heaplib_trace_defer, h, z, v);
+
+			/* The holder may never drain, so take the node back
+			 * if the lock has come free since. Otherwise wake any
+			 * sleepers: a sleeper counts itself before it drains
+			 * for the last time, and the node was pushed before the
+			 * count is read, so either it saw the node or it is
+			 * seen here. The lock is never waited for, as this
+			 * thread may be the one holding it.
+			 */
+			if(heaplib_region_lock_flags(&h->lock,
+			    heaplib_flags_nowait) == heaplib_error_none)
+			{
+				c = __heaplib_region_drain(h);
+				heaplib_region_unlock(&h->lock);
+
+				if(c)
+					__heaplib_async_kick();
+			}
+			else if(__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST))
+			{
+				heaplib_cond_broadcast(&h->cond);
+			}
+		}
+		return e;
+	}
+#endif
+
+	/* The Region may have gone before it was locked */
+	if((h->flags & heaplib_flags_active) == 0 || !heaplib_region_within(v, h))
+	{
+		PRINTF("free: region gone\n");
+		heaplib_trace(heaplib_trace_bad_pointer, h, 0, v);
+		heaplib_region_unlock(&h->lock);
+		return heaplib_error_fatal;
+	}
+
+	__heaplib_region_drain(h);
+
+	a = __heaplib_free_find(h, v, &L);
+	if(!a)
+	{
+		PRINTF("free: heaplib_error_fatal\n");
+		heaplib_region_unlock(&h->lock);
+		return heaplib_error_fatal;
+	}
+
+	if(!heaplib_node_active(a))
+	{
+		PRINTF("error: free on active node? %p\n", v);
+		heaplib_trace(heaplib_trace_double_free, h, 0, v);
+		heaplib_region_unlock(&h->lock);
+		return heaplib_error_fatal;
+	}
+
+	/* Active nodes have no footer to check when they lend it to the
+	 * payload.
+	 */
+	af = heaplib_node_footer(a);
+	if(a->magic != HEAPLIB_NODE_MAGIC ||
+	   (HEAPLIB_FOOTER_SLACK == 0 && af->magic != HEAPLIB_MAGIC))
+	{
+		PRINTF("error: magic corrupt; node=%p\n", a);
+		heaplib_trace(heaplib_trace_bad_magic, h, 0, a);
+		heaplib_region_unlock(&h->lock);
+		return heaplib_error_fatal;
+	}
+
+	/* Other holders must release it instead */
+	if(heaplib_node_refs(a) > 1)
+	{
+		PRINTF("error: free of a shared node %p\n", a);
+		heaplib_trace(heaplib_trace_shared, h, heaplib_node_refs(a), v);
+		heaplib_region_unlock(&h->lock);
+		*vp = v;
+		return heaplib_error_again;
+	}
+
+	/* A node with no holders is already being freed */
+	if(heaplib_node_refs(a) == 0)
+	{
+		PRINTF("error: double free of node %p\n", a);
+		heaplib_trace(heaplib_trace_double_free, h, 0, v);
+		heaplib_region_unlock(&h->lock);
+		return heaplib_error_fatal;
+	}
+
+	z = heaplib_node_usable(a);
+	if(__heaplib_free_node(h, a, L))
+	{
+		PRINTF("WARN: forced free coalesce\n");
+		__heaplib_coalesce(h, nil);
+	}
+
+	/* If all memory is free'd and we're restricted, perform the actual
+	 * Delete operation. Even if we delete the Region, the lock stays live.
+	 */
+	__heaplib_region_delete_internal(h);
+
+	heaplib_region_unlock(&h->lock);
+
+	heaplib_stat_stop(heaplib_stat_free, i, z, t);
+	heaplib_trace(heaplib_trace_free, h, z, v);
+
+	/* Queued requests may fit now */
+	__heaplib_async_kick();
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Allocate memory.
+ *
+ * \param vp [out] The allocated payload base address.
+ * \param x [in] Scale of allocation.
+ * \param y [in] Size of allocation.
+ * \param f [in] Allocation flags.
+ *
+ * \author Don A. Bailey <donb@labmou.se>
+ * \date December 22, 2020
+ */
+heaplib_error_t
+heaplib_calloc(vaddr_t * vp, size_t x, size_t y, heaplib_flags_t f)
+{
+	return heaplib_calloc_timeout(vp, x, y, f, HEAPLIB_WAIT_FOREVER);
+}
+
+/**
+ * \brief Allocate, sleeping for up to 'ms' for memory to be freed.
+ *
+ * Only requests flagged heaplib_flags_waitmem sleep; a request that can't be
+ * satisfied before the timeout returns heaplib_error_again. So does one that
+ * takes the calling task over its quota, after waiting up to 'ms' if the
+ * task is throttled.
+ */
+heaplib_error_t
+heaplib_calloc_timeout(
+	vaddr_t * vp,
+	size_t x,
+	size_t y,
+	heaplib_flags_t f,
+	unsigned int ms)
+{
+	heaplib_error_t e;
+	uint64_t t;
+	size_t z;
+	size_t c;
+
+	t = heaplib_stat_start();
+
+#if !HEAPLIB_NATURAL
+	/* Don't coalesce and retry a request that can never succeed */
+	if((f & heaplib_flags_natural) != 0)
+		return heaplib_error_fatal;
+#endif
+
+	/* First, check overflow */
+	z = x * y;
+	if(z < x || z < y)
+	{
+		/* XXX error */
+		return heaplib_error_fatal;
+	}
+
+	/* Now, round up by chunks. Every node holds at least one chunk. */
+	c = HEAPLIB_B2C(z);
+	if(c == 0)
+		c = 1;
+	z = HEAPLIB_C2B(c);
+
+	/* Check for overflow again */
+	if(z < x || z < y)
+	{
+		/* XXX error */
+		return heaplib_error_fatal;
+	}
+
+	e = __heaplib_calloc_any(vp, z, f, ms);
+	if(e == heaplib_error_none)
+		e = __heaplib_calloc_quota(vp, z, f, ms);
+
+	/* Failures are timed too; they are filed outside any Region, as are
+	 * large objects.
+	 */
+	heaplib_stat_stop(heaplib_stat_calloc,
+		e == heaplib_error_none ? __heaplib_region_index(*vp) : NREGIONS,
+		z, t);
+
+	heaplib_trace(heaplib_trace_calloc, e == heaplib_error_none ?
+		__heaplib_region_at(__heaplib_region_index(*vp)) : nil, z,
+		e == heaplib_error_none ? *vp : nil);
+
+	PRINTF("__heaplib_calloc: thread=%ld e=%d *vp=%p sz=%ld \n",
+		pthread_self(),
+		e,
+		*vp,
+		z);
+
+	return e;
+}
+
+/**
+ * \brief Allocate 'z' bytes from Region 'h' and nowhere else.
+ *
+ * The Region may grow if it is reserved, but its flags aren't checked
+ * against 'f' and no quota is applied; the caller chose it.
+ */
+heaplib_error_t
+__heaplib_calloc_from(
+	heaplib_region_t * h,
+	vaddr_t * vp,
+	size_t z,
+	heaplib_flags_t f)
+{
+	heaplib_error_t e;
+	size_t c;
+	int d;
+
+	c = HEAPLIB_B2C(z);
+	if(c == 0)
+		c = 1;
+	z = HEAPLIB_C2B(c);
+
+	e = heaplib_region_lock_flags(&h->lock, f);
+	if(e != heaplib_error_none)
+		return e;
+
+	d = 0;
+	e = heaplib_error_fatal;
+	if((h->flags & heaplib_flags_active) != 0 &&
+	   (h->flags & heaplib_flags_dontusemask) == 0)
+		e = __heaplib_calloc_in(h, vp, z, f, &d);
+
+	heaplib_region_unlock(&h->lock);
+
+	if(d)
+		__heaplib_async_kick();
+
+	return e;
+}
+
+/**
+ * \brief Allocate 'z' rounded bytes from wherever they fit.
+ *
+ * Large requests go straight to pages, falling back on the Regions.
+ */
+static heaplib_error_t
+__heaplib_calloc_any(
+	vaddr_t * vp,
+	size_t z,
+	heaplib_flags_t f,
+	unsigned int ms)
+{
+	heaplib_error_t e;
+
+	if(__heaplib_large_want(z, f) &&
+	   __heaplib_large_calloc(vp, z) == heaplib_error_none)
+	{
+		__heaplib_task_charge(NREGIONS, __heaplib_large_size(*vp));
+		return heaplib_error_none;
+	}
+
+	e = __heaplib_calloc(vp, z, f);
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
+	if(e != heaplib_error_none && (f & heaplib_flags_waitmem))
+		e = __heaplib_calloc_wait(vp, z, f, ms);
+#else
+	/* With one thread, nothing can be freed while we wait */
+	USED(ms);
+#endif
+
+	return e;
+}
+
+/**
+ * \brief Undo the allocation at '*vp' if it took the calling task over its
+ * quota.
+ *
+ * Under the throttle policy the allocation is retried every slice until it
+ * fits the quota, which needs memory held by the task to be freed, or 'ms'
+ * passes.
+ *
+ * \return heaplib_error_again if the allocation was undone.
+ */
+static heaplib_error_t
+__heaplib_calloc_quota(
+	vaddr_t * vp,
+	size_t z,
+	heaplib_flags_t f,
+	unsigned int ms)
+{
+	heaplib_quota_t p;
+	heaplib_error_t e;
+	unsigned long d;
+	unsigned long t;
+
+	d = platform_time_ms() + ms;
+
+	while(__heaplib_task_over(&p))
+	{
+		heaplib_free(vp, heaplib_flags_wait);
+
+		if(p != heaplib_quota_throttle)
+			return heaplib_error_again;
+
+		t = platform_time_ms();
+		if(ms != HEAPLIB_WAIT_FOREVER && t >= d)
+			return heaplib_error_again;
+
+		platform_sleep(HEAPLIB_WAIT_SLICE);
+
+		e = __heaplib_calloc_any(vp, z, f,
+			ms == HEAPLIB_WAIT_FOREVER ? ms : (unsigned int)(d - t));
+		if(e != heaplib_error_none)
+			return e;
+	}
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Bytes to commit when a reserved Region can't satisfy a request.
+ *
+ * Natural requests may need up to twice their size to find an aligned
+ * payload, so always leave room for that plus a node's metadata.
+ */
+static size_t
+__heaplib_extend_size(size_t z)
+{
+	z = (z * 2) + HEAPLIB_MIN_NODE;
+	return z > HEAPLIB_EXTEND_STEP ? z : HEAPLIB_EXTEND_STEP;
+}
+
+/**
+ * \brief Resize an allocation.
+ *
+ * Large objects are resized in place or remapped without a copy. Anything
+ * else shrinks in place, or moves to a new node when it has to grow. Bytes
+ * beyond the old size always read as zero, as they would from calloc.
+ * Allocations with more than one holder can't be resized, and return
+ * heaplib_error_again. If a moved allocation's old node can't be freed, the
+ * new one is freed instead and the error is returned with 'vp' unchanged.
+ *
+ * \param vp [in,out] The payload to resize; updated if it moves.
+ * \param z [in] The new size in bytes.
+ * \param f [in] Allocation flags.
+ */
+heaplib_error_t
+heaplib_realloc(vaddr_t * vp, size_t z, heaplib_flags_t f)
+{
+	heaplib_region_t * h;
+	heaplib_node_t * n;
+	heaplib_error_t e;
+	vaddr_t v;
+	vaddr_t x;
+	task_t t;
+	size_t o;
+	int c;
+
+	if(!*vp)
+	{
+		return heaplib_calloc(vp, 1, z, f);
+	}
+
+	if(__heaplib_large_within(*vp))
+	{
+		if(__heaplib_large_refs(*vp, 0, &c) == heaplib_error_none && c > 1)
+			return heaplib_error_again;
+
+		if(__heaplib_large_want(z, f))
+		{
+			o = __heaplib_large_size(*vp);
+			t = __heaplib_large_task(*vp);
+			e = __heaplib_large_resize(vp, z);
+			if(e == heaplib_error_none)
+			{
+				__heaplib_task_credit(t, NREGIONS, o);
+				__heaplib_task_charge(NREGIONS,
+					__heaplib_large_size(*vp));
+			}
+
+			if(e != heaplib_error_again)
+				return e;
+		}
+
+		o = __heaplib_large_size(*vp);
+		if(o == 0)
+			return heaplib_error_fatal;
+	}
+	else
+	{
+		e = heaplib_ptr2region(*vp, &h, f);
+		if(e != heaplib_error_none)
+			return e;
+
+		if(!heaplib_ptr2node(h, *vp, &n))
+		{
+			PRINTF("error: realloc of a pointer we don't own\n");
+			heaplib_trace(heaplib_trace_bad_pointer, h, 0, *vp);
+			heaplib_region_unlock(&h->lock);
+			return heaplib_error_fatal;
+		}
 
-	v = *vp;
-	*vp = nil;
+		if(heaplib_node_refs(n) > 1)
+		{
+			heaplib_region_unlock(&h->lock);
+			return heaplib_error_again;
+		}
 
-	// XXX
-	// change this to go backward if we are beyond the midpoint
+		o = heaplib_node_usable(n);
+		if(z <= o && !__heaplib_large_want(z, f))
+		{
+			platform_zero((vaddr_t)((vbaddr_t)*vp + z), o - z);
+			heaplib_region_unlock(&h->lock);
+			return heaplib_error_none;
+		}
 
-	/* Make sure the pointer is valid */
-	PRINTF("free: find region\n");
+		heaplib_region_unlock(&h->lock);
+	}
+
+	e = heaplib_calloc(&v, 1, z, f);
+	if(e != heaplib_error_none)
+		return e;
 
-	e = heaplib_ptr2region(v, &h, f);
+	memcpy((void * )v, (void * )*vp, o < z ? o : z);
+
+	/* It may have been shared since it was checked */
+	x = *vp;
+	e = heaplib_free(&x, f);
 	if(e != heaplib_error_none)
 	{
-		PRINTF("free: cant find region: %d\n", e);
+		PRINTF("error: realloc can't free the old block %p\n", *vp);
+		heaplib_free(&v, f);
 		return e;
 	}
 
-	PRINTF("free: spinning\n");
+	*vp = v;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Find the active node whose payload begins at 'v'.
+ *
+ * \warning This must be called with the Region locked.
+ */
+boolean_t
+heaplib_ptr2node(heaplib_region_t * h, vaddr_t v, heaplib_node_t ** np)
+{
+	heaplib_node_t * a;
 
-	/* The Region is returned locked */
-	num = 0;
-	L = nil;
 	a = (heaplib_node_t * )h->addr;
 	while(heaplib_region_within(a, h))
 	{
-		/* Save the Last (most recently observed) Free node */
-		if(!a->active)
-			L = a;
-
-		if(a->magic != HEAPLIB_MAGIC)
+		if(a->magic != HEAPLIB_NODE_MAGIC)
 		{
-			PRINTF("error: magic failure at node=%d/%p\n", num, a);
-			heaplib_lock_unlock(&h->lock);
-			return heaplib_error_fatal;
+			PRINTF("error: magic failure at node=%p\n", a);
+			heaplib_trace(heaplib_trace_bad_magic, h, 0, a);
+			return False;
 		}
-		num++;
 
 		if(v == (vaddr_t)&a->payload[0])
 		{
-			if(!a->active)
-			{
-				PRINTF("error: free on active node? %p\n", v);
-				heaplib_lock_unlock(&h->lock);
-				return heaplib_error_fatal;
-			}
+			*np = a;
+			return heaplib_node_active(a);
+		}
 
-			af = heaplib_node_footer(a);
-			if(a->magic != HEAPLIB_MAGIC || 
-			   af->magic != HEAPLIB_MAGIC)
-			{
-				PRINTF("error: magic corrupt; node=%p\n", a);
-				heaplib_lock_unlock(&h->lock);
-				return heaplib_error_fatal;
-			}
+		a = heaplib_node_next(a);
+	}
 
-			a->active = False;
-			if(a->pc_t.flags & heaplib_flags_wiped)
-			{
-				memset(&a->payload[0], 0, a->size);
-			}
+	return False;
+}
 
-			/* Place the node back in the list */
-			if(!L)
-			{
-				/* Found a node lower in memory than free_list
-				 * or free_list has not yet been set.
-				 */
-				heaplib_free_next(a) = h->free_list;
-				heaplib_free_prev(a) = nil;
-				if(h->free_list)
-					heaplib_free_prev(h->free_list) = a;
-				h->free_list = a;
-			}
-			else
-			{
-				heaplib_free_next(a) = heaplib_free_next(L);
-				heaplib_free_next(L) = a;
-				heaplib_free_prev(a) = L;
-				if(heaplib_free_next(a))
-					heaplib_free_prev(
-						heaplib_free_next(a)) = a;
-			}
+/**
+ * \brief Allocate cleared (zeroed) memory.
+ *
+ * Try each Region routed for the request's size and flags, in order, and
+ * attempt to allocate a node within that region.
+ *
+ * \author Don A. Bailey <donb@labmou.se>
+ * \date December 20, 2019
+ */
+static heaplib_error_t
+__heaplib_calloc(vaddr_t * vp, size_t z, heaplib_flags_t f)
+{
+	uint8_t r[NREGIONS];
+	heaplib_region_t * h;
+	heaplib_error_t e;
+	int n;
+	int i;
+	int d;
 
-			h->free += heaplib_node_size(a);
-			h->nodes_active -= 1;
-			h->nodes_free += 1;
+	*vp = nil;
 
-			/* Only force coalesce if we are surrounded, otherwise
-			 * occurrence is too high 
-			 */
-			L = heaplib_node_prev(a);
-			if((heaplib_region_within(a, h) && 
-			   !heaplib_node_next(a)->active) &&
-			   (heaplib_region_within(L, h) && !L->active))
-			{
-				PRINTF("WARN: forced free coalesce\n");
-				__heaplib_coalesce(h, nil);
-			}
+	PRINTF("__heaplib_calloc: z=%ld\n", z);
 
-			/* If all memory is free'd and we're restricted,
-			 * perform the actual Delete operation. Even if we
-			 * delete the Region, the lock stays live.
-			 */
-			__heaplib_region_delete_internal(h);
+	n = __heaplib_region_routes(r, z, f);
+	if(n < 0)
+		return heaplib_error_again;
 
-			heaplib_lock_unlock(&h->lock);
-			return heaplib_error_none;
+	d = 0;
+	e = heaplib_error_fatal;
+	for(i = 0; i < n; i++)
+	{
+		e = __heaplib_region_lock_routed(&h, r[i], f);
+		if(e != heaplib_error_none)
+			continue;
+
+		if(__heaplib_calloc_in(h, vp, z, f, &d) == heaplib_error_none)
+		{
+			heaplib_region_unlock(&h->lock);
+			e = heaplib_error_none;
+			break;
 		}
 
-		a = heaplib_node_next(a);
+		heaplib_region_unlock(&h->lock);
+		e = heaplib_error_fatal;
 	}
 
-	/* Not found */
-	PRINTF("free: heaplib_error_fatal\n");
-	heaplib_lock_unlock(&h->lock);
-	return heaplib_error_fatal;
+	/* Drained frees may let a queued request in */
+	if(d)
+		__heaplib_async_kick();
+
+	if(e == heaplib_error_none)
+		return e;
+
+	PRINTF("__heaplib_calloc: generic? %d\n", e);
+
+	return e;
 }
 
 /**
- * \brief Allocate memory.
- *
- * \param vp [out] The allocated payload base address.
- * \param x [in] Scale of allocation.
- * \param y [in] Size of allocation.
- * \param f [in] Allocation flags.
+ * \brief Attempt to allocate within a single locked Region, growing it if
+ * it is reserved.
  *
- * \author Don A. Bailey <donb@labmou.se>
- * \date December 22, 2020
+ * \param dp [in,out] Counts deferred frees drained here; once the Region is
+ * unlocked, the caller kicks the async queue if any were.
  */
-heaplib_error_t
-heaplib_calloc(vaddr_t * vp, size_t x, size_t y, heaplib_flags_t f)
+static heaplib_error_t
+__heaplib_calloc_in(
+	heaplib_region_t * h,
+	vaddr_t * vp,
+	size_t z,
+	heaplib_flags_t f,
+	int * dp)
 {
-	heaplib_error_t e;
-	size_t z;
-	size_t c;
+	/* Frees left while the Region was busy come first */
+	*dp += __heaplib_region_drain(h);
 
-	/* First, check overflow */
-	z = x * y;
-	if(z < x || z < y)
+	/* Ensure this Region has enough free bytes (they may not
+	 * be contiguous)
+	 */
+	if(h->free >= z && heaplib_region_routed(h, z))
 	{
-		/* XXX error */
-		return heaplib_error_fatal;
-	}
+		PRINTF("__heaplib_calloc: found h->free > z\n");
 
-	/* Now, round up by chunks */
-	c = HEAPLIB_B2C(z);
-	z = HEAPLIB_C2B(c);
+		/* We have enough RAM and the flags are correct. */
+		if(__heaplib_calloc_with_coalesce(h, vp, z, f) ==
+		    heaplib_error_none)
+		{
+			PRINTF("__heaplib_calloc: calloc_w_coal\n");
+			return heaplib_error_none;
+		}
+	}
 
-	/* Check for overflow again */
-	if(z < x || z < y)
+	/* Grow a reserved Region before moving on to the next one */
+	if(h->reserved > h->size && heaplib_region_routed(h, z) &&
+	   __heaplib_region_extend(h, __heaplib_extend_size(z)) ==
+	    heaplib_error_none)
 	{
-		/* XXX error */
-		return heaplib_error_fatal;
+		return __heaplib_calloc_with_coalesce(h, vp, z, f);
 	}
 
-	e = __heaplib_calloc(vp, z, f);
-
-	PRINTF("__heaplib_calloc: thread=%ld e=%d *vp=%p sz=%ld \n",
-		pthread_self(),
-		e,
-		*vp,
-		z);
-
-	return e;
+	return heaplib_error_fatal;
 }
 
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
 /**
- * \brief Allocate cleared (zeroed) memory.
+ * \brief Sleep until memory is freed, then try again.
  *
- * Search each region for a usable chunk of memory fitting the request, and
- * attempt to allocate a node within that region.
+ * The caller sleeps on the matching Region with the most free bytes, where
+ * frees wake it once a large enough run of memory exists. If other Regions
+ * also match, the sleep is cut into slices so they are rescanned too.
  *
- * \author Don A. Bailey <donb@labmou.se>
- * \date December 20, 2019
+ * \return heaplib_error_again if 'ms' passes first.
  */
 static heaplib_error_t
-__heaplib_calloc(vaddr_t * vp, size_t z, heaplib_flags_t f)
+__heaplib_calloc_wait(
+	vaddr_t * vp,
+	size_t z,
+	heaplib_flags_t f,
+	unsigned int ms)
 {
 	heaplib_region_t * h;
+	heaplib_region_t * b;
 	heaplib_error_t e;
+	unsigned long d;
+	unsigned long t;
+	unsigned int w;
+	int k;
+	int n;
 
-	*vp = nil;
-
-	PRINTF("__heaplib_calloc: z=%ld\n", z);
+	d = platform_time_ms() + ms;
+	k = 0;
 
-	e = heaplib_region_find_first(&h, f);
-	if(e != heaplib_error_none)
+	while(True)
 	{
-		PRINTF("__heaplib_calloc: region_find_first %d\n", e);
-		return e;
-	}
+		/* Pick the Region to sleep on */
+		b = nil;
+		n = 0;
+		e = heaplib_region_find_first(&h, f);
+		while(e == heaplib_error_none)
+		{
+			/* Don't wait on a Region that can never fit 'z' */
+			if(heaplib_region_routed(h, z) &&
+			   z + HEAPLIB_MIN_NODE <= h->reserved &&
+			   (!b || h->free > b->free))
+				b = h;
+			n++;
+
+			e = heaplib_region_find_next(&h, f);
+		}
 
-	/* We've been guaranteed that we have locked the first Region at this
-	 * point, either immediately or by waiting for it.
-	 */
+		if(!b)
+		{
+			e = heaplib_error_fatal;
+			break;
+		}
 
-	do {
-		/* Ensure this Region has enough free bytes (they may not
-		 * be contiguous)
+		heaplib_region_lock_flags(&b->lock, heaplib_flags_wait);
+
+		/* The Region may have gone away, or been freed into, while
+		 * it was unlocked.
 		 */
-		if(h->free >= z && __validate_region_request(h, z))
+		if((b->flags & heaplib_flags_active) == 0 ||
+		   (b->flags & heaplib_flags_dontusemask) != 0)
 		{
-			PRINTF("__heaplib_calloc: found h->free > z\n");
+			heaplib_region_unlock(&b->lock);
+			continue;
+		}
 
-			/* We have enough RAM and the flags are correct. */
-			e = __heaplib_calloc_with_coalesce(h, vp, z, f);
-			if(e == heaplib_error_none)
-			{
-				PRINTF("__heaplib_calloc: calloc_w_coal\n");
+		if(__heaplib_calloc_in(b, vp, z, f, &k) == heaplib_error_none)
+		{
+			heaplib_region_unlock(&b->lock);
+			e = heaplib_error_none;
+			break;
+		}
 
-				heaplib_lock_unlock(&h->lock);
-				return e;
-			}
+		t = platform_time_ms();
+		if(ms != HEAPLIB_WAIT_FOREVER && t >= d)
+		{
+			heaplib_region_unlock(&b->lock);
+			e = heaplib_error_again;
+			break;
 		}
 
-		e = heaplib_region_find_next(&h, f);
-	}
-	while(h && e == heaplib_error_none);
+		w = ms == HEAPLIB_WAIT_FOREVER ? ms : (unsigned int)(d - t);
+		if(n > 1 && w > HEAPLIB_WAIT_SLICE)
+			w = HEAPLIB_WAIT_SLICE;
 
-	/* heaplib_region_find_next unlocks the last Region on our behalf, so
-	 * if we arrive here, there is no Region left to unlock. This also 
-	 * always unlocks the global lock.
-	 */
+		/* Counted before the last drain, so a free deferred after it
+		 * sees the count and wakes us; see heaplib_free.
+		 */
+		__atomic_add_fetch(&b->waiters, 1, __ATOMIC_SEQ_CST);
+		if(z < b->wait_min)
+			b->wait_min = z;
 
-	PRINTF("__heaplib_calloc: generic? %d\n", e);
+		k += __heaplib_region_drain(b);
+		if(k == 0)
+		{
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+			/* Its broadcast may land between the drain and the
+			 * sleep, so never sleep longer than a slice.
+			 */
+			if(w > HEAPLIB_WAIT_SLICE)
+				w = HEAPLIB_WAIT_SLICE;
+#endif
+			heaplib_region_cond_wait(&b->cond, &b->lock, w);
+		}
+
+		if(__atomic_sub_fetch(&b->waiters, 1, __ATOMIC_SEQ_CST) == 0)
+			b->wait_min = (size_t)~0;
+
+		heaplib_region_unlock(&b->lock);
+
+		if(k)
+		{
+			__heaplib_async_kick();
+			k = 0;
+		}
+
+		if(__heaplib_calloc(vp, z, f) == heaplib_error_none)
+			return heaplib_error_none;
+	}
+
+	if(k)
+		__heaplib_async_kick();
 
 	return e;
 }
+#endif
 
 /**
  * \brief Keep attempting to allocate memory while coalesce succeeds.
@@ -374,8 +1297,12 @@ __heaplib_coalesce(heaplib_region_t * h, int * jp)
 	heaplib_footer_t * bf;
 	heaplib_node_t * a;
 	heaplib_node_t * b;
+	uint64_t t;
+	size_t x;
 	int j;
 
+	t = heaplib_stat_start();
+
 	j = 0;
 	if(jp)
 		*jp = 0;
@@ -385,14 +1312,14 @@ __heaplib_coalesce(heaplib_region_t * h, int * jp)
 	a = nil;
 	b = h->free_list;
 	if(b)
-		a = heaplib_free_next(b);
+		a = heaplib_free_next(h, b);
 
 	while(a && heaplib_region_within(a, h))
 	{
 		if(heaplib_node_next(b) != a)
 		{
 			b = a;
-			a = heaplib_free_next(a);
+			a = heaplib_free_next(h, a);
 		}
 		else
 		{
@@ -400,23 +1327,44 @@ __heaplib_coalesce(heaplib_region_t * h, int * jp)
 			h->free += sizeof(*a) + sizeof(*bf);
 
 			/* Consume the higher node */
-			heaplib_free_next(b) = heaplib_free_next(a);
-			if(heaplib_free_next(b))
-				heaplib_free_prev(heaplib_free_next(b)) = b;
-
-			PRINTF("coal: CONSUME size=%lu\n", b->size);
+			if(h->rover == a)
+				h->rover = b;
+			if(h->scrub.next == a)
+				h->scrub.next = b;
+			heaplib_free_set_next(h, b, heaplib_free_next(h, a));
+			if(heaplib_free_next(h, b))
+				heaplib_free_set_prev(h, heaplib_free_next(h, b), b);
+
+			PRINTF("coal: CONSUME size=%lu\n", heaplib_node_size(b));
+			heaplib_trace(heaplib_trace_coalesce, h, heaplib_node_size(b), b);
+
+			x = heaplib_node_size(b) + heaplib_node_size(a) +
+				sizeof(*a) + sizeof(*bf);
+
+			/* The old footer, header and links now sit in the
+			 * payload, so two clear nodes stay clear only if
+			 * those are cleared too.
+			 */
+			if(heaplib_node_zero(b) && heaplib_node_zero(a))
+				memset(heaplib_node_footer(b), 0, sizeof(*bf) +
+					sizeof(*a) + HEAPLIB_LINK_BYTES);
+			else
+				heaplib_node_clear_zero(b);
 
-			b->size += heaplib_node_size(a) +
-					sizeof(*a) +
-					sizeof(*bf);
-			PRINTF("coal: CONSUME NOW size=%lu\n", b->size);
+			heaplib_node_set_size(b, x);
+			PRINTF("coal: CONSUME NOW size=%lu\n", heaplib_node_size(b));
+			heaplib_trace(heaplib_trace_coalesce, h, heaplib_node_size(b), b);
 
 			bf = heaplib_node_footer(b);
 			bf->size = heaplib_node_size(b);
 
-			a = heaplib_free_next(b);
+			__heaplib_index_resize(h, b);
+			__heaplib_index_remove(h, a);
+
+			a = heaplib_free_next(h, b);
 
 			h->nodes_free -= 1;
+			h->changes++;
 
 			j++;
 		}
@@ -425,6 +1373,9 @@ __heaplib_coalesce(heaplib_region_t * h, int * jp)
 	if(jp)
 		*jp = j;
 
+	heaplib_stat_stop(heaplib_stat_coalesce,
+		__heaplib_region_index((vaddr_t)h->addr), 0, t);
+
 	return heaplib_error_none;
 }
 
@@ -450,20 +1401,70 @@ __heaplib_calloc_within_region(
 	heaplib_node_t * n;
 	heaplib_node_t * o;
 	heaplib_error_t r;
+	uint32_t i;
+
+#if !HEAPLIB_NATURAL
+	if((f & heaplib_flags_natural) != 0)
+	{
+		PRINTF("error: natural alignment isn't built in\n");
+		return heaplib_error_fatal;
+	}
+#endif
+
+	/* Natural requests need the full size to be aligned; everything else
+	 * can borrow the footer bytes when the node is active.
+	 */
+	if((f & heaplib_flags_natural) == 0)
+	{
+		z = heaplib_node_request(z);
+	}
 
+	/* Try the Region's preferred node, then fall back on first fit */
 	o = nil;
-	n = h->free_list;
+	n = __heaplib_calloc_place(h, z);
+	if(n && __heaplib_calloc_try_natural(h, n, &o, z, f) != heaplib_error_none)
+		o = nil;
+
+	/* First fit searches the index if it can, and the free list if not */
+	if(!o && __heaplib_index_ready(h, z))
+	{
+		i = 0;
+		while((n = __heaplib_index_first(h, z, &i)) != nil)
+		{
+			if(heaplib_node_active(n))
+			{
+				PRINTF("error: active node in the index!\n");
+				heaplib_trace(heaplib_trace_bad_list, h, 0, n);
+				return heaplib_error_fatal;
+			}
+
+			if(__heaplib_calloc_try_natural(h, n, &o, z, f) ==
+			    heaplib_error_none)
+				break;
+
+			i++;
+		}
+
+		n = nil;
+	}
+	else
+	{
+		n = o ? nil : h->free_list;
+	}
+
 	while(n)
 	{
 		if(!heaplib_region_within(n, h))
 		{
 			PRINTF("error: ain't got nothin\n");
+			heaplib_trace(heaplib_trace_bad_list, h, 0, n);
 			return heaplib_error_fatal;
 		}
 
-		if(n->active)
+		if(heaplib_node_active(n))
 		{
 			PRINTF("error: active node in the free list!\n");
+			heaplib_trace(heaplib_trace_bad_list, h, 0, n);
 			return heaplib_error_fatal;
 		}
 
@@ -478,40 +1479,146 @@ __heaplib_calloc_within_region(
 			PRINTF("error: size matched but can't alloc\n");
 		}
 
-		n = heaplib_free_next(n);
+		n = heaplib_free_next(h, n);
 	}
 
 	if(!o)
 		return heaplib_error_fatal;
 
-	PRINTF("found! node=%p size=%ld \n", o, o->size);
+	PRINTF("found! node=%p size=%ld \n", o, heaplib_node_size(o));
 
 	*vp = (vaddr_t)&o->payload[0];
 
 	/* Now we can safely alter the free list */
-	if(heaplib_free_prev(o))
-		heaplib_free_next(heaplib_free_prev(o)) = heaplib_free_next(o);
-	if(heaplib_free_next(o))
-		heaplib_free_prev(heaplib_free_next(o)) = heaplib_free_prev(o);
+	if(heaplib_free_prev(h, o))
+		heaplib_free_set_next(h, heaplib_free_prev(h, o),
+			heaplib_free_next(h, o));
+	if(heaplib_free_next(h, o))
+		heaplib_free_set_prev(h, heaplib_free_next(h, o),
+			heaplib_free_prev(h, o));
 	if(h->free_list == o)
-		h->free_list = heaplib_free_next(o);
+		h->free_list = heaplib_free_next(h, o);
+	__heaplib_index_remove(h, o);
+
+	/* Next fit resumes after this node, at the rest of it if it split */
+	h->rover = heaplib_free_next(h, o);
+
+	/* A known-zero payload only needs its links and lent footer cleared */
+	if(heaplib_node_zero(o))
+	{
+		memset(&o->payload[0], 0, HEAPLIB_LINK_BYTES);
+		memset(&o->payload[heaplib_node_size(o)], 0,
+			HEAPLIB_FOOTER_SLACK);
+		heaplib_node_clear_zero(o);
+	}
+	else
+	{
+		platform_zero((vaddr_t)&o->payload[0],
+			heaplib_node_usable(o));
+	}
 
-	memset(&o->payload[0], 0, o->size);
+	n = heaplib_node_next(o);
+	if(heaplib_region_within(n, h))
+		heaplib_node_clear_prev_free(n);
 
-	o->pc_t.task = GET_PLATFORM_TASKID();
-	o->pc_t.flags = f;
-	o->pc_t.refs = 1;
+	heaplib_node_set_task(o, GET_PLATFORM_TASKID());
+	heaplib_node_set_flags(o, f);
+	heaplib_node_set_refs(o, 1);
 
-	o->magic = HEAPLIB_MAGIC;
-	o->active = True;
+	o->magic = HEAPLIB_NODE_MAGIC;
+	heaplib_node_set_active(o);
 
+	h->changes++;
 	h->free -= heaplib_node_size(o);
 	h->nodes_active += 1;
 	h->nodes_free -= 1;
 
+	__heaplib_task_charge(__heaplib_region_index((vaddr_t)h->addr),
+		heaplib_node_usable(o));
+
 	return heaplib_error_none;
 }
 
+/**
+ * \brief The free node Region 'h' would rather use for 'z' bytes, or nil
+ * to take the first that fits.
+ *
+ * - Next fit scans on from the node after the last allocation, wrapping
+ *   around, so small remainders near the start aren't rescanned each time.
+ * - Best fit takes the smallest node that fits, lowest address first. The
+ *   index finds it in one pass over its sizes.
+ * - Exact fit takes the first node that fits without being split, and
+ *   otherwise the first that fits.
+ *
+ * \warning This must be called with the Region locked.
+ */
+static heaplib_node_t *
+__heaplib_calloc_place(heaplib_region_t * h, size_t z)
+{
+	heaplib_node_t * s;
+	heaplib_node_t * b;
+	heaplib_node_t * n;
+
+	switch(h->flags & heaplib_flags_placemask)
+	{
+	case heaplib_flags_nextfit:
+		s = h->rover;
+		if(!s || !heaplib_region_within(s, h))
+			s = h->free_list;
+
+		for(n = s; n; n = heaplib_free_next(h, n))
+		{
+			if(heaplib_node_size(n) >= z)
+				return n;
+		}
+
+		for(n = h->free_list; n && n != s; n = heaplib_free_next(h, n))
+		{
+			if(heaplib_node_size(n) >= z)
+				return n;
+		}
+
+		return nil;
+
+	case heaplib_flags_bestfit:
+		if(__heaplib_index_ready(h, z))
+			return __heaplib_index_best(h, z);
+
+		b = nil;
+		for(n = h->free_list; n; n = heaplib_free_next(h, n))
+		{
+			if(heaplib_node_size(n) < z ||
+			   (b && heaplib_node_size(n) >= heaplib_node_size(b)))
+				continue;
+
+			/* Nothing beats a node that won't be split */
+			b = n;
+			if(heaplib_node_size(n) - z < HEAPLIB_MIN_NODE)
+				break;
+		}
+
+		return b;
+
+	case heaplib_flags_exactfit:
+		b = nil;
+		for(n = h->free_list; n; n = heaplib_free_next(h, n))
+		{
+			if(heaplib_node_size(n) < z)
+				continue;
+
+			if(heaplib_node_size(n) - z < HEAPLIB_MIN_NODE)
+				return n;
+
+			if(!b)
+				b = n;
+		}
+
+		return b;
+	}
+
+	return nil;
+}
+
 static heaplib_error_t
 __heaplib_calloc_try_natural(
 	heaplib_region_t * h,
@@ -520,10 +1627,14 @@ __heaplib_calloc_try_natural(
 	size_t z,
 	heaplib_flags_t f)
 {
+#if HEAPLIB_NATURAL
 	if((f & heaplib_flags_natural) != 0)
 	{
 		return __heaplib_calloc_do_natural(h, n, op, z);
 	}
+#else
+	USED(f);
+#endif
 
 	return __heaplib_calloc_do_split(h, n, op, z);
 }
@@ -553,33 +1664,46 @@ __heaplib_calloc_do_split(
    	  (heaplib_node_size(n) - z) < HEAPLIB_MIN_NODE)
 	{
 		PRINTF("node expand!\n");
+		heaplib_trace(heaplib_trace_expand, h, heaplib_node_size(n), n);
 		*op = n;
 		return heaplib_error_none;
 	}
 
 	PRINTF("node: split! original node size=%ld\n", heaplib_node_size(n));
+	heaplib_trace(heaplib_trace_split, h, heaplib_node_size(n), n);
 	x = heaplib_node_size(n);
 
 	/* There's ample room to perform node split */
-	n->size = z;
+	heaplib_node_set_size(n, z);
 	o = heaplib_node_next(n);
 
+	o->magic = HEAPLIB_NODE_MAGIC;
+	o->size = x - z - (sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
+
+	/* The rest of a clear payload is still clear */
+	if(heaplib_node_zero(n))
+		heaplib_node_set_zero(o);
+
 	/* Temporarily add 'b' to the free list so it
  	 * can get adjusted properly later
  	 */
-	heaplib_free_next(o) = heaplib_free_next(n);
-	heaplib_free_next(n) = o;
-	heaplib_free_prev(o) = n;
-	if(heaplib_free_next(o))
-		heaplib_free_prev(heaplib_free_next(o)) = o;
+	heaplib_free_set_next(h, o, heaplib_free_next(h, n));
+	heaplib_free_set_next(h, n, o);
+	heaplib_free_set_prev(h, o, n);
+	if(heaplib_free_next(h, o))
+		heaplib_free_set_prev(h, heaplib_free_next(h, o), o);
 
-	o->magic = HEAPLIB_MAGIC;
-	o->size = x - z - (sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
-
-	PRINTF("split: new node size=%ld\n", o->size);
+	PRINTF("split: new node size=%ld\n", heaplib_node_size(o));
 
+	/* 'n' is about to become active and only needs a footer if active
+	 * nodes keep theirs.
+	 */
 	heaplib_footer_init(o);
-	heaplib_footer_init(n);
+	if(HEAPLIB_FOOTER_SLACK == 0)
+		heaplib_footer_init(n);
+
+	__heaplib_index_resize(h, n);
+	__heaplib_index_insert(h, o);
 
 	h->free -= (sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
 	h->nodes_free += 1;
@@ -589,6 +1713,7 @@ __heaplib_calloc_do_split(
 	return heaplib_error_none;
 }
 
+#if HEAPLIB_NATURAL
 /**
  * \brief Evaluate whether we can handle Natural alignment.
  *
@@ -614,6 +1739,7 @@ __heaplib_calloc_do_natural(
 	size_t x;
 
 	PRINTF("DO NATURAL node size=%ld\n", heaplib_node_size(n));
+	heaplib_trace(heaplib_trace_natural, h, heaplib_node_size(n), n);
 
 	m = z - 1;
 	a = (vbaddr_t)((size_t)&n->payload[0] & ~m);
@@ -667,35 +1793,39 @@ __heaplib_calloc_do_natural(
 	 * and offset by our word/chunk size, refuse to allocate and warn
 	 * that we have a weird number of bytes.
 	 */
-	if((d % sizeof(size_t)) != 0)
+	if((d % HEAPLIB_CHUNKSZ) != 0)
 	{
 		PRINTF("warning: strange byte alignment!!!\n");
 		return heaplib_error_fatal;
 	}
 
 	/* Now we know that 'n' represents a viable node so it's OK to edit */
-	x = n->size;
-	n->size = d;
-	n->active = 0;
+	x = heaplib_node_size(n);
+	heaplib_node_set_size(n, d);
 
 	/* 'n' is now the prev node */
 	/* 'o' is now our natural node */
 	o = heaplib_node_next(n);
 	o->size = x - (d + sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
-	o->magic = HEAPLIB_MAGIC;
-	o->active = 0;
+	o->magic = HEAPLIB_NODE_MAGIC;
+	heaplib_node_set_prev_free(o);
+	if(heaplib_node_zero(n))
+		heaplib_node_set_zero(o);
 
 	/* Adjust the metadata */
-	heaplib_free_prev(o) = n;
-	heaplib_free_next(o) = heaplib_free_next(n);
-	if(heaplib_free_next(o))
-		heaplib_free_prev(heaplib_free_next(o)) = o;
+	heaplib_free_set_prev(h, o, n);
+	heaplib_free_set_next(h, o, heaplib_free_next(h, n));
+	if(heaplib_free_next(h, o))
+		heaplib_free_set_prev(h, heaplib_free_next(h, o), o);
 
-	heaplib_free_next(n) = o;
+	heaplib_free_set_next(h, n, o);
 
 	heaplib_footer_init(o);
 	heaplib_footer_init(n);
 
+	__heaplib_index_resize(h, n);
+	__heaplib_index_insert(h, o);
+
 	h->nodes_free += 1;
 	h->free -= (sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
 
@@ -704,4 +1834,4 @@ __heaplib_calloc_do_natural(
 	 */
 	return __heaplib_calloc_do_split(h, o, op, z);
 }
-
+#endif
@@ -0,0 +1,104 @@
+/**
+ * \file heap/src/arena.c
+ *
+ * \brief Scoped arenas.
+ *
+ * An arena is one node, taken from a chosen Region or from any Region that
+ * matches its flags, with a bump pointer over its payload. Allocating from
+ * it is a bounds check and an addition, done inline by heaplib_arena_calloc.
+ * Nothing is freed on its own: a mark taken with heaplib_arena_mark can be
+ * rewound to, and destroying the arena frees the node in one call, so a
+ * whole request's objects cost a single heaplib_free.
+ *
+ * The payload starts out zero, so objects are handed out without clearing.
+ * Rewinding clears what it takes back, which keeps that true.
+ */
+#include "heaplib/heaplib.h"
+
+/* Bytes of the node spent on the arena itself */
+#define ARENA_HEADER HEAPLIB_C2B(HEAPLIB_B2C(sizeof(heaplib_arena_t)))
+
+/**
+ * \brief Create an arena that can hand out 'z' bytes.
+ *
+ * \param ap [out] The new arena.
+ * \param h [in] The Region to take it from, or nil for any Region matching
+ * 'f'.
+ * \param z [in] Bytes the arena can hand out, before alignment.
+ * \param f [in] Allocation flags for the node.
+ */
+heaplib_error_t
+heaplib_arena_create(
+	heaplib_arena_t ** ap,
+	heaplib_region_t * h,
+	size_t z,
+	heaplib_flags_t f)
+{
+	heaplib_arena_t * a;
+	heaplib_error_t e;
+	vaddr_t v;
+
+	*ap = nil;
+
+	z = HEAPLIB_C2B(HEAPLIB_B2C(z));
+	if(z + ARENA_HEADER < z)
+		return heaplib_error_fatal;
+
+	z += ARENA_HEADER;
+
+	if(h)
+		e = __heaplib_calloc_from(h, &v, z, f);
+	else
+		e = heaplib_calloc(&v, 1, z, f);
+
+	if(e != heaplib_error_none)
+		return e;
+
+	a = (heaplib_arena_t * )v;
+	a->base = (vbaddr_t)v + ARENA_HEADER;
+	a->next = a->base;
+	a->end = (vbaddr_t)v + z;
+
+	*ap = a;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Give back everything allocated from 'a' since mark 'm'.
+ *
+ * Pointers into the rewound space must no longer be used.
+ *
+ * \return heaplib_error_fatal if 'm' is ahead of the arena.
+ */
+heaplib_error_t
+heaplib_arena_rewind(heaplib_arena_t * a, size_t m)
+{
+	vbaddr_t p;
+
+	if(m > heaplib_arena_mark(a))
+		return heaplib_error_fatal;
+
+	p = a->base + m;
+	platform_zero((vaddr_t)p, (size_t)(a->next - p));
+	a->next = p;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Free arena '*ap' and everything allocated from it.
+ */
+heaplib_error_t
+heaplib_arena_destroy(heaplib_arena_t ** ap, heaplib_flags_t f)
+{
+	vaddr_t v;
+
+	v = (vaddr_t)*ap;
+	*ap = nil;
+
+	if(!v)
+		return heaplib_error_fatal;
+
+	return heaplib_free(&v, f);
+}
@@ -0,0 +1,281 @@
+/**
+ * \file heap/src/async.c
+ *
+ * \brief Asynchronous allocation.
+ *
+ * A request that can't be satisfied right away is queued instead of failing,
+ * and completed through its callback once memory is freed. The queue has its
+ * own lock and is only ever serviced after any Region lock has been dropped,
+ * so queued requests never hold up the allocator. Its lock is never held
+ * while allocating either: the head is taken off the queue, allocated for
+ * with no lock held, and put back if it still doesn't fit. One thread
+ * services the queue at a time, and others that free memory meanwhile only
+ * ask it to try again. Records come from a fixed pool, since the allocator
+ * can't lean on itself when it is out of memory.
+ */
+#include "heaplib/heaplib.h"
+
+static heaplib_lock_t async_lock;
+static heaplib_async_t async_pool[HEAPLIB_ASYNC_MAX];
+static heaplib_async_t * async_spare;
+static heaplib_async_t * volatile async_queue;
+
+/* The request being allocated for, off the queue, and whether it was
+ * cancelled meanwhile. Only the thread servicing the queue sets it.
+ */
+static heaplib_async_t * async_current;
+static boolean_t async_cancelled;
+static volatile boolean_t async_running;
+static boolean_t async_again;
+
+static void __async_requeue(heaplib_async_t * );
+
+void
+__heaplib_async_init(void)
+{
+	int i;
+
+	heaplib_lock_init(&async_lock);
+
+	async_queue = nil;
+	async_spare = nil;
+	for(i = 0; i < nelem(async_pool); i++)
+	{
+		async_pool[i].next = async_spare;
+		async_spare = &async_pool[i];
+	}
+}
+
+/**
+ * \brief Allocate 'z' zeroed bytes, now or once memory is freed.
+ *
+ * If memory is available and nothing is queued, 'fn' is called before this
+ * returns. Otherwise the request is queued behind every request of the same
+ * or higher priority, and 'fn' is called from whichever thread next frees
+ * enough memory.
+ *
+ * \param ap [out] The queued request, for cancellation, or nil.
+ * \param prio [in] Higher priorities are served first; equal ones in order.
+ *
+ * \return heaplib_error_again if the request was queued. The handle is only
+ * valid until 'fn' is called.
+ */
+heaplib_error_t
+heaplib_calloc_async(
+	heaplib_async_t ** ap,
+	size_t z,
+	heaplib_flags_t f,
+	unsigned int prio,
+	heaplib_async_fn_t fn,
+	void * ctx)
+{
+	heaplib_async_t ** q;
+	heaplib_async_t * a;
+	vaddr_t v;
+
+	if(ap)
+		*ap = nil;
+
+	if(!fn)
+		return heaplib_error_fatal;
+
+	/* Never sleep; that's what the queue is for */
+	f &= ~heaplib_flags_waitmem;
+
+	/* Don't jump ahead of requests that are already waiting */
+	if(!async_queue && heaplib_calloc(&v, 1, z, f) == heaplib_error_none)
+	{
+		fn(v, ctx);
+		return heaplib_error_none;
+	}
+
+	heaplib_lock_lock(&async_lock);
+
+	a = async_spare;
+	if(!a)
+	{
+		PRINTF("error: heaplib_calloc_async: queue is full\n");
+		heaplib_trace(heaplib_trace_queue_full, nil, z, nil);
+		heaplib_lock_unlock(&async_lock);
+		return heaplib_error_fatal;
+	}
+	async_spare = a->next;
+
+	a->size = z;
+	a->flags = f;
+	a->priority = prio;
+	a->fn = fn;
+	a->ctx = ctx;
+
+	for(q = (heaplib_async_t ** )&async_queue; *q; q = &(*q)->next)
+	{
+		if((*q)->priority < prio)
+			break;
+	}
+
+	a->next = *q;
+	*q = a;
+
+	if(ap)
+		*ap = a;
+
+	heaplib_lock_unlock(&async_lock);
+
+	/* Memory freed since the attempt above found nothing queued */
+	__heaplib_async_kick();
+
+	return heaplib_error_again;
+}
+
+/**
+ * \brief Remove a queued request before it completes.
+ *
+ * \return heaplib_error_fatal if the request is no longer queued.
+ */
+heaplib_error_t
+heaplib_calloc_async_cancel(heaplib_async_t * a)
+{
+	heaplib_async_t ** q;
+
+	heaplib_lock_lock(&async_lock);
+
+	/* Being allocated for; the thread doing so drops it */
+	if(a == async_current && !async_cancelled)
+	{
+		async_cancelled = True;
+		heaplib_lock_unlock(&async_lock);
+		return heaplib_error_none;
+	}
+
+	for(q = (heaplib_async_t ** )&async_queue; *q; q = &(*q)->next)
+	{
+		if(*q == a)
+		{
+			*q = a->next;
+			a->next = async_spare;
+			async_spare = a;
+
+			heaplib_lock_unlock(&async_lock);
+			return heaplib_error_none;
+		}
+	}
+
+	heaplib_lock_unlock(&async_lock);
+
+	return heaplib_error_fatal;
+}
+
+/**
+ * \brief Complete queued requests, in order, until one doesn't fit.
+ *
+ * Requests behind one that doesn't fit keep waiting, so a large request
+ * isn't starved by a stream of small ones. Only one thread services the
+ * queue at a time. A kick while it does, including the one made when
+ * allocating for a request drains deferred frees, just flags that the head
+ * is worth another try, and the servicing thread retries it. Callbacks may
+ * therefore run on any thread that frees.
+ *
+ * \warning Must be called without any Region locked.
+ */
+void
+__heaplib_async_kick(void)
+{
+	heaplib_async_fn_t fn;
+	heaplib_async_t * a;
+	heaplib_error_t e;
+	boolean_t c;
+	void * ctx;
+	vaddr_t v;
+
+	/* A request off the queue still needs to hear of memory being freed */
+	if(!async_queue && !async_running)
+		return;
+
+	heaplib_lock_lock(&async_lock);
+
+	if(async_running)
+	{
+		async_again = True;
+		heaplib_lock_unlock(&async_lock);
+		return;
+	}
+
+	async_running = True;
+
+	while((a = async_queue) != nil)
+	{
+		async_again = False;
+		async_queue = a->next;
+		async_current = a;
+		async_cancelled = False;
+
+		heaplib_lock_unlock(&async_lock);
+
+		e = heaplib_calloc(&v, 1, a->size, a->flags);
+
+		heaplib_lock_lock(&async_lock);
+
+		c = async_cancelled;
+		async_current = nil;
+
+		if(c)
+		{
+			a->next = async_spare;
+			async_spare = a;
+
+			if(e == heaplib_error_none)
+			{
+				heaplib_lock_unlock(&async_lock);
+				heaplib_free(&v, 0);
+				heaplib_lock_lock(&async_lock);
+			}
+
+			continue;
+		}
+
+		if(e != heaplib_error_none)
+		{
+			__async_requeue(a);
+			if(async_again)
+				continue;
+
+			break;
+		}
+
+		fn = a->fn;
+		ctx = a->ctx;
+		a->next = async_spare;
+		async_spare = a;
+
+		heaplib_lock_unlock(&async_lock);
+
+		fn(v, ctx);
+
+		heaplib_lock_lock(&async_lock);
+	}
+
+	async_running = False;
+
+	heaplib_lock_unlock(&async_lock);
+}
+
+/**
+ * \brief Put request 'a' back at the front of its priority, ahead of any
+ * queued since it was taken off.
+ *
+ * \warning Must be called with the queue locked.
+ */
+static void
+__async_requeue(heaplib_async_t * a)
+{
+	heaplib_async_t ** q;
+
+	for(q = (heaplib_async_t ** )&async_queue; *q; q = &(*q)->next)
+	{
+		if((*q)->priority <= a->priority)
+			break;
+	}
+
+	a->next = *q;
+	*q = a;
+}
@@ -0,0 +1,107 @@
+/**
+ * \file heap/src/idle.c
+ *
+ * \brief Background maintenance.
+ *
+ * Work that doesn't need to happen on the allocation path is done here, one
+ * pass at a time, either from the platform's idle hook or from a task that
+ * heaplib_idle_start creates.
+ */
+#include "heaplib/heaplib.h"
+
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
+static void __heaplib_idle_task(void * );
+
+static unsigned int idle_period;
+#endif
+
+/**
+ * \brief Run one maintenance pass over every Region.
+ *
+ * Frees left while a Region was busy are finished first. Regions flagged
+ * heaplib_flags_trim are trimmed once enough memory has been freed into them
+ * since they were last trimmed. Regions flagged
+ * heaplib_flags_prezero have some of their free memory cleared ahead of
+ * allocation, and Regions flagged heaplib_flags_scrub have some of their
+ * nodes checked for corruption.
+ */
+void
+heaplib_idle(void)
+{
+	heaplib_region_t * h;
+	heaplib_error_t e;
+	int n;
+
+	n = 0;
+	e = heaplib_region_find_first(&h, heaplib_flags_nowait);
+	while(e == heaplib_error_none)
+	{
+		n += __heaplib_region_drain(h);
+
+		if((h->flags & heaplib_flags_trim) &&
+		   h->untrimmed >= HEAPLIB_TRIM_THRESHOLD)
+		{
+			__heaplib_region_trim(h);
+		}
+
+		if(h->flags & heaplib_flags_prezero)
+		{
+			__heaplib_region_prezero(h, HEAPLIB_PREZERO_BUDGET);
+		}
+
+		if(h->flags & heaplib_flags_scrub)
+		{
+			__heaplib_region_scrub(h, HEAPLIB_SCRUB_BUDGET);
+		}
+
+		e = heaplib_region_find_next(&h, heaplib_flags_nowait);
+	}
+
+	/* Queued requests may fit in what was drained */
+	if(n)
+		__heaplib_async_kick();
+}
+
+/**
+ * \brief Run heaplib_idle every 'ms' milliseconds from a background task.
+ *
+ * \return heaplib_error_fatal if the platform can't create tasks, or the
+ * build has no locks, in which case heaplib_idle should be called from the
+ * platform's idle hook.
+ */
+heaplib_error_t
+heaplib_idle_start(unsigned int ms)
+{
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_NONE
+	USED(ms);
+
+	return heaplib_error_fatal;
+#else
+	if(idle_period)
+		return heaplib_error_fatal;
+
+	idle_period = ms ? ms : 1;
+
+	if(platform_task_start(__heaplib_idle_task, nil) != 0)
+	{
+		idle_period = 0;
+		return heaplib_error_fatal;
+	}
+
+	return heaplib_error_none;
+#endif
+}
+
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
+static void
+__heaplib_idle_task(void * arg)
+{
+	USED(arg);
+
+	for(;;)
+	{
+		platform_sleep(idle_period);
+		heaplib_idle();
+	}
+}
+#endif
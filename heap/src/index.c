@@ -0,0 +1,420 @@
+/**
+ * \file heap/src/index.c
+ *
+ * \brief Dense indexes of the free nodes of each Region.
+ *
+ * Each Region keeps the offset and size of its free nodes in two parallel
+ * arrays sorted by offset. Searching the size array is a linear scan over
+ * contiguous memory that the platform can vectorize, where walking the free
+ * list misses the cache on every node. The free list stays the authority:
+ * an index that overflows, or a Region it can't describe, simply isn't used
+ * and the allocator walks the list as before.
+ */
+#include "heaplib/heaplib.h"
+
+static heaplib_index_t indexes[NREGIONS];
+
+static uint32_t __index_find(heaplib_index_t *, uint32_t);
+static void __index_compact(heaplib_index_t * );
+static boolean_t __index_rebuild(heaplib_region_t * );
+
+/* The size an index stores for node 'n' */
+#define __index_size(n) \
+	((int32_t)(heaplib_node_size(n) > HEAPLIB_INDEX_SIZE_MAX ? \
+		HEAPLIB_INDEX_SIZE_MAX : heaplib_node_size(n)))
+
+/* The offset of node 'n' from the base of Region 'h' */
+#define __index_off(h, n) ((uint32_t)((vbaddr_t)(n) - (h)->addr))
+
+/**
+ * \brief Give Region 'h', in slot 'i', its index.
+ */
+void
+__heaplib_index_init(heaplib_region_t * h, int i)
+{
+	h->index = &indexes[i];
+	__heaplib_index_reset(h);
+}
+
+/**
+ * \brief Empty the index of Region 'h'.
+ *
+ * Offsets are 32 bits wide, so a Region that can grow past 4 GiB is never
+ * indexed.
+ *
+ * \warning This must be called with the Region locked.
+ */
+void
+__heaplib_index_reset(heaplib_region_t * h)
+{
+	h->index->n = 0;
+	h->index->holes = 0;
+	h->index->valid = ((uint64_t)h->reserved >> 32) == 0;
+}
+
+/**
+ * \brief Index the free node 'n' of Region 'h'.
+ *
+ * \warning This must be called with the Region locked.
+ */
+void
+__heaplib_index_insert(heaplib_region_t * h, heaplib_node_t * n)
+{
+	heaplib_index_t * x;
+	uint32_t o;
+	uint32_t p;
+
+	x = h->index;
+	if(!x->valid)
+		return;
+
+	o = __index_off(h, n);
+	p = __index_find(x, o);
+
+	/* Reindexing a node, or reusing its hole */
+	if(p < x->n && x->off[p] == o)
+	{
+		if(x->size[p] == 0)
+			x->holes--;
+		x->size[p] = __index_size(n);
+		return;
+	}
+
+	/* A hole either side can take the node without moving anything */
+	if(p > 0 && x->size[p - 1] == 0)
+		p--;
+	else if(p >= x->n || x->size[p] != 0)
+		p = x->n;
+
+	if(p < x->n)
+	{
+		x->off[p] = o;
+		x->size[p] = __index_size(n);
+		x->holes--;
+		return;
+	}
+
+	if(x->n == PLATFORM_INDEX_MAX)
+	{
+		if(x->holes == 0)
+		{
+			/* Walk the list until enough nodes are in use again */
+			x->valid = False;
+			return;
+		}
+
+		__index_compact(x);
+	}
+
+	p = __index_find(x, o);
+	memmove(&x->off[p + 1], &x->off[p], (x->n - p) * sizeof(x->off[0]));
+	memmove(&x->size[p + 1], &x->size[p], (x->n - p) * sizeof(x->size[0]));
+	x->off[p] = o;
+	x->size[p] = __index_size(n);
+	x->n++;
+}
+
+/**
+ * \brief Drop node 'n', no longer free, from the index of Region 'h'.
+ *
+ * \warning This must be called with the Region locked.
+ */
+void
+__heaplib_index_remove(heaplib_region_t * h, heaplib_node_t * n)
+{
+	heaplib_index_t * x;
+	uint32_t o;
+	uint32_t p;
+
+	x = h->index;
+	if(!x->valid)
+		return;
+
+	o = __index_off(h, n);
+	p = __index_find(x, o);
+	if(p == x->n || x->off[p] != o || x->size[p] == 0)
+		return;
+
+	x->size[p] = 0;
+	x->holes++;
+
+	while(x->n && x->size[x->n - 1] == 0)
+	{
+		x->n--;
+		x->holes--;
+	}
+
+	if(x->holes > x->n / 2)
+		__index_compact(x);
+}
+
+/**
+ * \brief Update the size indexed for free node 'n' of Region 'h'.
+ *
+ * \warning This must be called with the Region locked.
+ */
+void
+__heaplib_index_resize(heaplib_region_t * h, heaplib_node_t * n)
+{
+	heaplib_index_t * x;
+	uint32_t o;
+	uint32_t p;
+
+	x = h->index;
+	if(!x->valid)
+		return;
+
+	o = __index_off(h, n);
+	p = __index_find(x, o);
+	if(p == x->n || x->off[p] != o || x->size[p] == 0)
+	{
+		__heaplib_index_insert(h, n);
+		return;
+	}
+
+	x->size[p] = __index_size(n);
+}
+
+/**
+ * \brief Whether a request of 'z' bytes can be searched for in the index of
+ * Region 'h', rebuilding it first if it overflowed and would now fit.
+ *
+ * \warning This must be called with the Region locked.
+ */
+boolean_t
+__heaplib_index_ready(heaplib_region_t * h, size_t z)
+{
+	if(z == 0 || z > HEAPLIB_INDEX_SIZE_MAX)
+		return False;
+
+	if(h->index->valid)
+		return True;
+
+	return __index_rebuild(h);
+}
+
+/**
+ * \brief The lowest free node of Region 'h' with room for 'z' bytes, from
+ * entry '*ip' on.
+ *
+ * \param ip [in,out] Where to start, and where the node was found; resume
+ * from one past it to find the next.
+ *
+ * \warning This must be called with the Region locked and the index ready.
+ */
+heaplib_node_t *
+__heaplib_index_first(heaplib_region_t * h, size_t z, uint32_t * ip)
+{
+	heaplib_index_t * x;
+	size_t i;
+
+	x = h->index;
+	if(*ip >= x->n)
+		return nil;
+
+	i = *ip + platform_search_first(&x->size[*ip], x->n - *ip, (int32_t)z);
+	if(i == x->n)
+		return nil;
+
+	*ip = (uint32_t)i;
+
+	return (heaplib_node_t * )(h->addr + x->off[i]);
+}
+
+/**
+ * \brief The smallest free node of Region 'h' with room for 'z' bytes, the
+ * lowest of them if several are the same size.
+ *
+ * \warning This must be called with the Region locked and the index ready.
+ */
+heaplib_node_t *
+__heaplib_index_best(heaplib_region_t * h, size_t z)
+{
+	heaplib_index_t * x;
+	size_t i;
+
+	x = h->index;
+
+	i = platform_search_best(&x->size[0], x->n, (int32_t)z);
+	if(i == x->n)
+		return nil;
+
+	return (heaplib_node_t * )(h->addr + x->off[i]);
+}
+
+/**
+ * \brief The closest free node below node 'n' of Region 'h', or nil.
+ *
+ * \warning This must be called with the Region locked and the index ready.
+ */
+heaplib_node_t *
+__heaplib_index_below(heaplib_region_t * h, heaplib_node_t * n)
+{
+	heaplib_index_t * x;
+	uint32_t p;
+
+	x = h->index;
+
+	p = __index_find(x, __index_off(h, n));
+	while(p > 0)
+	{
+		p--;
+		if(x->size[p] != 0)
+			return (heaplib_node_t * )(h->addr + x->off[p]);
+	}
+
+	return nil;
+}
+
+/**
+ * \brief Whether the index of Region 'h' matches its free list.
+ *
+ * An invalid index isn't used, so it always matches.
+ *
+ * \warning This must be called with the Region locked.
+ */
+boolean_t
+__heaplib_index_check(heaplib_region_t * h)
+{
+	heaplib_index_t * x;
+	heaplib_node_t * n;
+	uint32_t holes;
+	uint32_t i;
+
+	x = h->index;
+	if(!x->valid)
+		return True;
+
+	holes = 0;
+	i = 0;
+	for(n = h->free_list; n; n = heaplib_free_next(h, n))
+	{
+		while(i < x->n && x->size[i] == 0)
+		{
+			holes++;
+			i++;
+		}
+
+		if(i == x->n || x->off[i] != __index_off(h, n) ||
+		   x->size[i] != __index_size(n))
+		{
+			PRINTF("error: index entry %u doesn't match node=%p\n",
+				i, n);
+			heaplib_trace(heaplib_trace_bad_list, h, i, n);
+			return False;
+		}
+
+		if(i > 0 && x->off[i - 1] >= x->off[i])
+		{
+			PRINTF("error: index entry %u out of order\n", i);
+			heaplib_trace(heaplib_trace_bad_list, h, i, nil);
+			return False;
+		}
+
+		i++;
+	}
+
+	for(; i < x->n; i++)
+	{
+		if(x->size[i] != 0)
+		{
+			PRINTF("error: index entry %u isn't a free node\n", i);
+			heaplib_trace(heaplib_trace_bad_list, h, i, nil);
+			return False;
+		}
+
+		holes++;
+	}
+
+	if(holes != x->holes)
+	{
+		PRINTF("error: index has %u holes, counted %u\n", x->holes, holes);
+		heaplib_trace(heaplib_trace_bad_list, h, holes, nil);
+		return False;
+	}
+
+	return True;
+}
+
+/**
+ * \brief The first entry of index 'x' at or above offset 'o'.
+ */
+static uint32_t
+__index_find(heaplib_index_t * x, uint32_t o)
+{
+	uint32_t l;
+	uint32_t r;
+	uint32_t m;
+
+	l = 0;
+	r = x->n;
+	while(l < r)
+	{
+		m = l + (r - l) / 2;
+		if(x->off[m] < o)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+/**
+ * \brief Squeeze the holes out of index 'x'.
+ */
+static void
+__index_compact(heaplib_index_t * x)
+{
+	uint32_t i;
+	uint32_t j;
+
+	for(i = j = 0; i < x->n; i++)
+	{
+		if(x->size[i] == 0)
+			continue;
+
+		x->off[j] = x->off[i];
+		x->size[j] = x->size[i];
+		j++;
+	}
+
+	x->n = j;
+	x->holes = 0;
+}
+
+/**
+ * \brief Index the free list of Region 'h' from scratch, if it fits.
+ */
+static boolean_t
+__index_rebuild(heaplib_region_t * h)
+{
+	heaplib_index_t * x;
+	heaplib_node_t * n;
+
+	x = h->index;
+
+	/* Leave room to grow, so a list hovering near the limit doesn't
+	 * rebuild on every allocation.
+	 */
+	if(((uint64_t)h->reserved >> 32) != 0 ||
+	   h->nodes_free >= PLATFORM_INDEX_MAX / 2)
+		return False;
+
+	/* The list is in address order, so each node goes on the end */
+	x->n = 0;
+	x->holes = 0;
+	for(n = h->free_list; n; n = heaplib_free_next(h, n))
+	{
+		if(x->n == PLATFORM_INDEX_MAX)
+			return False;
+
+		x->off[x->n] = __index_off(h, n);
+		x->size[x->n] = __index_size(n);
+		x->n++;
+	}
+
+	x->valid = True;
+
+	return True;
+}
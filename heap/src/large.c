@@ -0,0 +1,534 @@
+/**
+ * \file heap/src/large.c
+ *
+ * \brief Page-granular space for large objects.
+ *
+ * Requests above a threshold skip the Regions entirely and are given whole
+ * pages out of a single reservation from the platform page provider. A pair
+ * of bitmaps tracks which pages are in use and which pages begin a span.
+ * Freed spans are handed straight back to the platform, and a span that
+ * has to move to grow is remapped rather than copied where the platform
+ * allows it. Spans have no header, so their reference counts and owning
+ * tasks are kept per page alongside the bitmaps.
+ */
+#include "heaplib/heaplib.h"
+
+#define BITS (sizeof(size_t) * 8)
+
+struct
+heaplib_large_t
+{
+	heaplib_lock_t lock;
+	vbaddr_t base;
+	size_t reserved;
+	size_t threshold;
+	size_t npages;
+	size_t rover;
+	size_t * used;
+	size_t * head;
+	task_t * tasks;
+	uint8_t * refs;
+};
+
+typedef struct heaplib_large_t heaplib_large_t;
+
+static heaplib_large_t large;
+
+static boolean_t __large_test(size_t * , size_t);
+static void __large_mark(size_t, size_t);
+static void __large_lost(size_t, size_t);
+static size_t __large_find(size_t);
+static size_t __large_span(size_t);
+
+#define __large_set(m, i) ((m)[(i) / BITS] |= ((size_t)1 << ((i) % BITS)))
+#define __large_clear(m, i) ((m)[(i) / BITS] &= ~((size_t)1 << ((i) % BITS)))
+
+/* Live spans hold at least one reference; lost pages are marked with none */
+#define __large_live(i) (__large_test(large.head, (i)) && large.refs[(i)] != 0)
+
+#define __large_page(v) \
+	((size_t)(((vbaddr_t)(v) - large.base) / platform_page_size()))
+#define __large_addr(i) \
+	((vaddr_t)(large.base + ((i) * platform_page_size())))
+
+/**
+ * \brief Reserve the large object space.
+ *
+ * \param rsv [in] Bytes of address space to reserve for large objects.
+ * \param t [in] Requests of at least this many bytes use the space.
+ *
+ * \warning Call once, after heaplib_init and before any allocation.
+ */
+heaplib_error_t
+heaplib_large_init(size_t rsv, size_t t)
+{
+	size_t m;
+	size_t p;
+
+	if(large.base)
+		return heaplib_error_fatal;
+
+	p = platform_page_size();
+	rsv = (rsv + p - 1) & ~(p - 1);
+
+	large.base = (vbaddr_t)platform_page_reserve(rsv);
+	if(!large.base)
+	{
+		PRINTF("error: heaplib_large_init: can't reserve\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, rsv, nil);
+		return heaplib_error_fatal;
+	}
+
+	/* Both bitmaps, the owners and the counts live in the first pages of
+	 * the reservation.
+	 */
+	m = ((rsv / p) + BITS - 1) / BITS;
+	m = ((2 * m * sizeof(size_t)) + (rsv / p) * (sizeof(task_t) + 1) +
+		p - 1) & ~(p - 1);
+	if(m >= rsv || platform_page_commit((vaddr_t)large.base, m) != 0)
+	{
+		platform_page_release((vaddr_t)large.base, rsv);
+		large.base = nil;
+		return heaplib_error_fatal;
+	}
+
+	large.reserved = rsv;
+	large.npages = rsv / p;
+	large.used = (size_t * )large.base;
+	large.head = large.used + ((large.npages + BITS - 1) / BITS);
+	large.tasks = (task_t * )(large.head + ((large.npages + BITS - 1) / BITS));
+	large.refs = (uint8_t * )(large.tasks + large.npages);
+	large.threshold = t > p ? t : p;
+
+	heaplib_lock_init(&large.lock);
+
+	/* The bitmap pages are never handed out */
+	__large_mark(0, m / p);
+	large.rover = m / p;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Should a request of 'z' bytes with flags 'f' use the large space?
+ *
+ * Only requests that don't constrain Region properties or alignment can be
+ * served from plain pages.
+ */
+boolean_t
+__heaplib_large_want(size_t z, heaplib_flags_t f)
+{
+	return large.base != nil && z >= large.threshold &&
+		(f & (heaplib_flags_internal |
+		      heaplib_flags_encrypted |
+		      heaplib_flags_natural)) == 0;
+}
+
+/**
+ * \brief Does 'v' point into the large object space?
+ */
+boolean_t
+__heaplib_large_within(vaddr_t v)
+{
+	return large.base != nil &&
+		(vbaddr_t)v >= large.base &&
+		(vbaddr_t)v < large.base + large.reserved;
+}
+
+/**
+ * \brief Allocate a span of zeroed pages.
+ *
+ * Committed pages always read back as zero, so no clearing is needed.
+ */
+heaplib_error_t
+__heaplib_large_calloc(vaddr_t * vp, size_t z)
+{
+	size_t n;
+	size_t i;
+
+	n = (z + platform_page_size() - 1) / platform_page_size();
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_find(n);
+	if(i == 0 || platform_page_commit(__large_addr(i),
+			n * platform_page_size()) != 0)
+	{
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_fatal;
+	}
+
+	__large_mark(i, n);
+	large.refs[i] = 1;
+	large.tasks[i] = GET_PLATFORM_TASKID();
+
+	heaplib_lock_unlock(&large.lock);
+
+	*vp = __large_addr(i);
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Free a span and give its pages back to the platform.
+ */
+heaplib_error_t
+__heaplib_large_free(vaddr_t v)
+{
+	size_t n;
+	size_t i;
+
+	if(((vbaddr_t)v - large.base) % platform_page_size())
+		return heaplib_error_fatal;
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_page(v);
+	if(!__large_live(i))
+	{
+		PRINTF("error: free on a large address that isn't a span\n");
+		heaplib_trace(heaplib_trace_bad_pointer, nil, 0, v);
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_fatal;
+	}
+
+	n = __large_span(i);
+
+	platform_page_decommit(v, n * platform_page_size());
+
+	__large_clear(large.head, i);
+	while(n--)
+	{
+		__large_clear(large.used, i + n);
+	}
+
+	if(i < large.rover)
+		large.rover = i;
+
+	heaplib_lock_unlock(&large.lock);
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Usable bytes in the span at 'v', or zero if it isn't a span.
+ */
+size_t
+__heaplib_large_size(vaddr_t v)
+{
+	size_t z;
+	size_t i;
+
+	z = 0;
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_page(v);
+	if(((vbaddr_t)v - large.base) % platform_page_size() == 0 &&
+	   __large_live(i))
+	{
+		z = __large_span(i) * platform_page_size();
+	}
+
+	heaplib_lock_unlock(&large.lock);
+
+	return z;
+}
+
+/**
+ * \brief The task that owns the span at 'v', or nil if it isn't a span.
+ */
+task_t
+__heaplib_large_task(vaddr_t v)
+{
+	task_t t;
+	size_t i;
+
+	t = (task_t)nil;
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_page(v);
+	if(((vbaddr_t)v - large.base) % platform_page_size() == 0 &&
+	   __large_live(i))
+	{
+		t = large.tasks[i];
+	}
+
+	heaplib_lock_unlock(&large.lock);
+
+	return t;
+}
+
+/**
+ * \brief Add 'd' to the reference count of the span at 'v'.
+ *
+ * \param cp [out] The count afterwards.
+ *
+ * \return heaplib_error_again, leaving the count alone, if it would leave
+ * the range 1 to HEAPLIB_REFS_MAX. As with Region nodes, the last holder
+ * frees the span rather than dropping its count to zero, which would mark
+ * it lost.
+ */
+heaplib_error_t
+__heaplib_large_refs(vaddr_t v, int d, int * cp)
+{
+	heaplib_error_t e;
+	size_t i;
+	int c;
+
+	e = heaplib_error_fatal;
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_page(v);
+	if(((vbaddr_t)v - large.base) % platform_page_size() == 0 &&
+	   __large_live(i))
+	{
+		c = large.refs[i] + d;
+		e = heaplib_error_again;
+		if(c >= 1 && c <= HEAPLIB_REFS_MAX)
+		{
+			large.refs[i] = (uint8_t)c;
+			*cp = c;
+			e = heaplib_error_none;
+		}
+	}
+
+	heaplib_lock_unlock(&large.lock);
+
+	return e;
+}
+
+/**
+ * \brief Resize a span without copying its contents.
+ *
+ * Shrinking gives the tail pages back. Growing first tries to take the free
+ * pages directly above the span, then asks the platform to move the pages
+ * to a new span. Bytes beyond the old size always read as zero. Once
+ * resized, the span belongs to the calling task, as a copy would.
+ *
+ * \return heaplib_error_again if the caller must fall back to a copy. If
+ * the pages moved but couldn't be put back, '*vp' is updated to the span
+ * at its old size, and the copy is made from there.
+ */
+heaplib_error_t
+__heaplib_large_resize(vaddr_t * vp, size_t z)
+{
+	heaplib_error_t e;
+	uint8_t c;
+	size_t n;
+	size_t o;
+	size_t i;
+	size_t j;
+	size_t k;
+	size_t p;
+	int r;
+	int q;
+
+	p = platform_page_size();
+	n = (z + p - 1) / p;
+
+	heaplib_lock_lock(&large.lock);
+
+	i = __large_page(*vp);
+	if(((vbaddr_t)*vp - large.base) % p != 0 ||
+	   !__large_live(i))
+	{
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_fatal;
+	}
+
+	o = __large_span(i);
+
+	if(n <= o)
+	{
+		/* Keep the zero guarantee for the partial last page */
+		if(z % p)
+			memset((void * )((vbaddr_t)*vp + z), 0, p - (z % p));
+
+		if(n < o)
+			platform_page_decommit(__large_addr(i + n), (o - n) * p);
+
+		for(j = n; j < o; j++)
+			__large_clear(large.used, i + j);
+
+		if(n < o && i + n < large.rover)
+			large.rover = i + n;
+
+		large.tasks[i] = GET_PLATFORM_TASKID();
+
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_none;
+	}
+
+	/* Grow in place if the pages above are free */
+	for(j = o; j < n && i + j < large.npages; j++)
+	{
+		if(__large_test(large.used, i + j))
+			break;
+	}
+
+	if(j == n && platform_page_commit(__large_addr(i + o), (n - o) * p) == 0)
+	{
+		for(j = o; j < n; j++)
+			__large_set(large.used, i + j);
+
+		large.tasks[i] = GET_PLATFORM_TASKID();
+
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_none;
+	}
+
+	/* Move the existing pages to a new span and commit the rest */
+	k = __large_find(n);
+	r = k ? platform_page_move(__large_addr(i), __large_addr(k), o * p) : -1;
+	if(r < 0)
+	{
+		heaplib_lock_unlock(&large.lock);
+		return heaplib_error_again;
+	}
+
+	e = heaplib_error_none;
+	if(platform_page_commit(__large_addr(k + o), (n - o) * p) != 0)
+	{
+		/* Put the pages back where they were */
+		e = heaplib_error_again;
+		q = platform_page_move(__large_addr(k), __large_addr(i), o * p);
+		if(q >= 0)
+		{
+			if(q > 0)
+				__large_lost(k, o);
+
+			heaplib_lock_unlock(&large.lock);
+			return e;
+		}
+
+		/* They can't go back, so the span moves at its old size */
+		n = o;
+	}
+
+	c = large.refs[i];
+	__large_clear(large.head, i);
+	if(r > 0)
+	{
+		__large_lost(i, o);
+	}
+	else
+	{
+		for(j = 0; j < o; j++)
+			__large_clear(large.used, i + j);
+
+		if(i < large.rover)
+			large.rover = i;
+	}
+
+	__large_mark(k, n);
+	large.refs[k] = c;
+	large.tasks[k] = e == heaplib_error_none ? GET_PLATFORM_TASKID() :
+		large.tasks[i];
+
+	heaplib_lock_unlock(&large.lock);
+
+	*vp = __large_addr(k);
+
+	return e;
+}
+
+static boolean_t
+__large_test(size_t * m, size_t i)
+{
+	return (m[i / BITS] & ((size_t)1 << (i % BITS))) != 0;
+}
+
+static void
+__large_mark(size_t i, size_t n)
+{
+	__large_set(large.head, i);
+	while(n--)
+	{
+		__large_set(large.used, i + n);
+	}
+}
+
+/**
+ * \brief Retire 'n' pages from page 'i' that the platform couldn't reserve
+ * again after moving their contents away.
+ *
+ * Some other mapping may take their place, so they stay marked in use for
+ * good. They begin a span of their own so that no neighbour's span counts
+ * them, and hold no references so that nothing can free them.
+ */
+static void
+__large_lost(size_t i, size_t n)
+{
+	PRINTF("error: large pages at %p can't be reserved again\n",
+		__large_addr(i));
+	heaplib_trace(heaplib_trace_region_failed, nil, n * platform_page_size(),
+		__large_addr(i));
+
+	__large_mark(i, n);
+	large.refs[i] = 0;
+}
+
+/**
+ * \brief Count the pages in the span that begins at page 'i'.
+ */
+static size_t
+__large_span(size_t i)
+{
+	size_t n;
+
+	n = 1;
+	while(i + n < large.npages &&
+	      __large_test(large.used, i + n) &&
+	      !__large_test(large.head, i + n))
+	{
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * \brief Find 'n' contiguous free pages, first fit from the rover.
+ *
+ * Page zero always holds the bitmaps, so zero means nothing was found.
+ *
+ * \warning Must be called with the large space locked.
+ */
+static size_t
+__large_find(size_t n)
+{
+	size_t r;
+	size_t i;
+
+	i = large.rover;
+	r = 0;
+	while(i + n <= large.npages)
+	{
+		/* Skip fully used words quickly */
+		if((i % BITS) == 0 && large.used[i / BITS] == (size_t)~0)
+		{
+			i += BITS;
+			r = 0;
+			continue;
+		}
+
+		if(__large_test(large.used, i))
+		{
+			r = 0;
+		}
+		else if(++r == n)
+		{
+			i = i + 1 - n;
+			if(i == large.rover)
+				large.rover = i + n;
+			return i;
+		}
+
+		i++;
+	}
+
+	return 0;
+}
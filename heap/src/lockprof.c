@@ -0,0 +1,229 @@
+/**
+ * \file heap/src/lockprof.c
+ *
+ * \brief Contention profile of the Master and Region locks.
+ *
+ * Built with HEAPLIB_LOCKPROF, every acquisition through
+ * heaplib_region_lock_flags is attributed to the function that made it.
+ * For each lock and call site the profile keeps the number of acquisitions,
+ * how many found the lock taken, and the total and longest time spent
+ * waiting for and holding it. All updates are made by the lock holder, so
+ * they need no further synchronisation. The profile is dumped at exit.
+ */
+#include "heaplib/heaplib.h"
+
+#ifdef HEAPLIB_LOCKPROF
+struct
+heaplib_lockprof_site_t
+{
+	const char * name;
+	uint64_t count;
+	uint64_t contended;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	uint64_t hold_total;
+	uint64_t hold_max;
+};
+
+typedef struct heaplib_lockprof_site_t heaplib_lockprof_site_t;
+
+struct
+heaplib_lockprof_t
+{
+	uint64_t since;
+	heaplib_lockprof_site_t * holder;
+	heaplib_lockprof_site_t sites[HEAPLIB_LOCKPROF_SITES];
+};
+
+typedef struct heaplib_lockprof_t heaplib_lockprof_t;
+
+/* One profile per Region lock, then the Master */
+static heaplib_lockprof_t lockprof[NREGIONS + 1];
+
+/**
+ * \brief The entry for call site 's', claiming a new one if needed. Sites
+ * past the limit share the last entry.
+ */
+static heaplib_lockprof_site_t *
+__lockprof_site(heaplib_lockprof_t * p, const char * s)
+{
+	int i;
+
+	for(i = 0; i < HEAPLIB_LOCKPROF_SITES; i++)
+	{
+		if(p->sites[i].name == s)
+			return &p->sites[i];
+
+		if(p->sites[i].name == nil)
+		{
+			p->sites[i].name = s;
+			return &p->sites[i];
+		}
+	}
+
+	p->sites[HEAPLIB_LOCKPROF_SITES - 1].name = "(other)";
+	return &p->sites[HEAPLIB_LOCKPROF_SITES - 1];
+}
+
+/**
+ * \brief Record that 'x' was just taken by call site 's'.
+ *
+ * \param x [in] The lock, now held by the caller.
+ * \param s [in] The function that took it.
+ * \param c [in] Whether the lock was already held by someone else.
+ * \param t [in] Platform clock when the caller started to wait.
+ */
+void
+__heaplib_lockprof_acquired(
+	heaplib_lock_t * x,
+	const char * s,
+	boolean_t c,
+	uint64_t t)
+{
+	heaplib_lockprof_site_t * q;
+	heaplib_lockprof_t * p;
+	uint64_t n;
+
+	n = platform_clock();
+	p = &lockprof[__heaplib_lock_index(x)];
+	q = __lockprof_site(p, s);
+
+	q->count++;
+	if(c)
+		q->contended++;
+
+	q->wait_total += n - t;
+	if(n - t > q->wait_max)
+		q->wait_max = n - t;
+
+	p->holder = q;
+	p->since = n;
+}
+
+/**
+ * \brief Record that 'x' is about to be released.
+ *
+ * \warning This must be called with 'x' still held.
+ */
+void
+__heaplib_lockprof_released(heaplib_lock_t * x)
+{
+	heaplib_lockprof_site_t * q;
+	heaplib_lockprof_t * p;
+	uint64_t n;
+
+	n = platform_clock();
+	p = &lockprof[__heaplib_lock_index(x)];
+	q = p->holder;
+	if(!q)
+		return;
+
+	p->holder = nil;
+
+	q->hold_total += n - p->since;
+	if(n - p->since > q->hold_max)
+		q->hold_max = n - p->since;
+}
+
+/**
+ * \brief Dump the profile at exit.
+ */
+void
+__heaplib_lockprof_init(void)
+{
+	platform_atexit(heaplib_lockprof_dump);
+}
+
+static void
+__lockprof_line(const char * who, heaplib_lockprof_site_t * q)
+{
+	REPORTF("heaplib: %-32s n=%-10lu contended=%-10lu "
+		"wait=%lu/%lu hold=%lu/%lu ns total/max\n",
+		who,
+		(unsigned long)q->count,
+		(unsigned long)q->contended,
+		(unsigned long)HEAPLIB_TICKS_NS(q->wait_total),
+		(unsigned long)HEAPLIB_TICKS_NS(q->wait_max),
+		(unsigned long)HEAPLIB_TICKS_NS(q->hold_total),
+		(unsigned long)HEAPLIB_TICKS_NS(q->hold_max));
+}
+
+/**
+ * \brief Print each lock's totals, then its call sites by longest hold.
+ */
+void
+heaplib_lockprof_dump(void)
+{
+	heaplib_lockprof_site_t * o[HEAPLIB_LOCKPROF_SITES];
+	heaplib_lockprof_site_t * q;
+	heaplib_lockprof_site_t t;
+	heaplib_lockprof_t * p;
+	char w[32];
+	int n;
+	int i;
+	int j;
+	int k;
+
+	for(k = 0; k < nelem(lockprof); k++)
+	{
+		p = &lockprof[k];
+
+		memset(&t, 0, sizeof(t));
+		n = 0;
+		for(i = 0; i < HEAPLIB_LOCKPROF_SITES; i++)
+		{
+			q = &p->sites[i];
+			if(!q->name)
+				break;
+
+			t.count += q->count;
+			t.contended += q->contended;
+			t.wait_total += q->wait_total;
+			t.hold_total += q->hold_total;
+			if(q->wait_max > t.wait_max)
+				t.wait_max = q->wait_max;
+			if(q->hold_max > t.hold_max)
+				t.hold_max = q->hold_max;
+
+			/* Insert by longest hold, longest first */
+			for(j = n++; j > 0 && o[j - 1]->hold_max < q->hold_max; j--)
+				o[j] = o[j - 1];
+			o[j] = q;
+		}
+
+		if(t.count == 0)
+			continue;
+
+		if(k == NREGIONS)
+		{
+			strcpy(w, "master");
+		}
+		else
+		{
+			strcpy(w, "region ");
+			w[7] = '0' + (char)(k % 10);
+			w[8] = 0;
+		}
+		__lockprof_line(w, &t);
+
+		for(i = 0; i < n; i++)
+		{
+			w[0] = ' ';
+			w[1] = ' ';
+			strncpy(&w[2], o[i]->name, sizeof(w) - 3);
+			w[sizeof(w) - 1] = 0;
+			__lockprof_line(w, o[i]);
+		}
+	}
+}
+#else
+void
+__heaplib_lockprof_init(void)
+{
+}
+
+void
+heaplib_lockprof_dump(void)
+{
+}
+#endif
@@ -0,0 +1,217 @@
+/**
+ * \file heap/src/refs.c
+ *
+ * \brief Reference-counted allocations.
+ *
+ * Every allocation starts with one reference, held by the caller of calloc.
+ * heaplib_retain adds a holder and heaplib_release drops one, freeing the
+ * allocation through heaplib_free when the last holder lets go. A buffer can
+ * so be handed to several consumers without copying it.
+ *
+ * Counts of Region nodes live in the node header and change with atomic
+ * operations, so neither call takes a lock. A caller must already hold a
+ * reference to take another, which keeps the node alive while it is found.
+ * Large objects have no header; their counts are kept under the large space
+ * lock instead.
+ */
+#include "heaplib/heaplib.h"
+
+/**
+ * \brief The active node whose payload is 'v', or nil.
+ *
+ * No lock is taken; the caller's reference keeps the node from changing.
+ */
+static heaplib_node_t *
+__refs_node(vaddr_t v)
+{
+	heaplib_node_t * n;
+
+	if(v == nil || __heaplib_region_index(v) == NREGIONS)
+		return nil;
+
+	n = (heaplib_node_t * )((vbaddr_t)v - sizeof(heaplib_node_t));
+	if(n->magic != HEAPLIB_NODE_MAGIC || !heaplib_node_active(n))
+		return nil;
+
+	return n;
+}
+
+/**
+ * \brief Add 'd' to the count of node 'n'.
+ *
+ * A node with no holders is being freed, so the count never reaches zero
+ * here; the last holder frees the node instead.
+ *
+ * \return The count afterwards, or -1 if it would leave the range 1 to
+ * HEAPLIB_REFS_MAX, in which case it is left alone.
+ */
+static int
+__refs_add(heaplib_node_t * n, int d)
+{
+#ifdef HEAPLIB_COMPACT
+	uint8_t o;
+	int c;
+
+	o = __atomic_load_n(&n->refs, __ATOMIC_RELAXED);
+	do {
+		c = (int)o + d;
+		if(c < 1 || c > HEAPLIB_REFS_MAX)
+			return -1;
+	}
+	while(!__atomic_compare_exchange_n(&n->refs, &o, (uint8_t)c, True,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return c;
+#else
+	heaplib_attr_t o;
+	heaplib_attr_t x;
+	int c;
+
+	/* The flags share the word but never change while a node is active */
+	o.word = __atomic_load_n(&n->pc_t.attr.word, __ATOMIC_RELAXED);
+	do {
+		c = (int)o.refs + d;
+		if(c < 1 || c > HEAPLIB_REFS_MAX)
+			return -1;
+
+		x = o;
+		x.refs = (size_t)c;
+	}
+	while(!__atomic_compare_exchange_n(&n->pc_t.attr.word, &o.word, x.word,
+		True, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return c;
+#endif
+}
+
+/**
+ * \brief Add a holder to the allocation at 'v'.
+ *
+ * \return heaplib_error_again if it already has HEAPLIB_REFS_MAX holders.
+ */
+heaplib_error_t
+heaplib_retain(vaddr_t v)
+{
+	heaplib_node_t * n;
+	int c;
+
+	if(__heaplib_large_within(v))
+		return __heaplib_large_refs(v, 1, &c);
+
+	n = __refs_node(v);
+	if(!n)
+	{
+		PRINTF("error: retain of a pointer we don't own\n");
+		heaplib_trace(heaplib_trace_bad_pointer, nil, 0, v);
+		return heaplib_error_fatal;
+	}
+
+	if(__refs_add(n, 1) > 0)
+		return heaplib_error_none;
+
+	return heaplib_node_refs(n) == 0 ? heaplib_error_fatal :
+		heaplib_error_again;
+}
+
+/**
+ * \brief Drop the caller's hold on '*vp', freeing it if it was the last.
+ *
+ * Like heaplib_free, the caller's pointer is always cleared.
+ *
+ * \param vp [in,out] The allocation to release.
+ * \param f [in] Flags for the free.
+ */
+heaplib_error_t
+heaplib_release(vaddr_t * vp, heaplib_flags_t f)
+{
+	heaplib_node_t * n;
+	heaplib_error_t e;
+	vaddr_t v;
+	int c;
+
+	v = *vp;
+	*vp = nil;
+
+	/* Neither count goes below 1, so the holder that can't lower it is the
+	 * last and frees it, which catches a double release.
+	 */
+	if(__heaplib_large_within(v))
+	{
+		e = __heaplib_large_refs(v, -1, &c);
+		if(e != heaplib_error_again)
+			return e;
+	}
+	else
+	{
+		n = __refs_node(v);
+		if(!n)
+		{
+			PRINTF("error: release of a pointer we don't own\n");
+			heaplib_trace(heaplib_trace_bad_pointer, nil, 0, v);
+			return heaplib_error_fatal;
+		}
+
+		if(__refs_add(n, -1) > 0)
+			return heaplib_error_none;
+	}
+
+	return heaplib_free(&v, f);
+}
+
+/**
+ * \brief Take the only reference to node 'n', leaving it with none while it
+ * waits to be freed.
+ *
+ * \return The count beforehand; it is only taken if that was 1.
+ */
+int
+__heaplib_refs_take(heaplib_node_t * n)
+{
+#ifdef HEAPLIB_COMPACT
+	uint8_t o;
+
+	o = 1;
+	if(__atomic_compare_exchange_n(&n->refs, &o, 0, False,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return 1;
+
+	return (int)o;
+#else
+	heaplib_attr_t o;
+	heaplib_attr_t x;
+
+	o.word = __atomic_load_n(&n->pc_t.attr.word, __ATOMIC_RELAXED);
+	do {
+		if(o.refs != 1)
+			return (int)o.refs;
+
+		x = o;
+		x.refs = 0;
+	}
+	while(!__atomic_compare_exchange_n(&n->pc_t.attr.word, &o.word, x.word,
+		True, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return 1;
+#endif
+}
+
+/**
+ * \brief The number of holders of the allocation at 'v', or -1 if 'v' isn't
+ * one.
+ */
+int
+heaplib_refs(vaddr_t v)
+{
+	heaplib_node_t * n;
+	int c;
+
+	if(__heaplib_large_within(v))
+		return __heaplib_large_refs(v, 0, &c) == heaplib_error_none ?
+			c : -1;
+
+	n = __refs_node(v);
+	if(!n)
+		return -1;
+
+	return (int)heaplib_node_refs(n);
+}
@@ -13,15 +13,31 @@
 static heaplib_region_t regions[NREGIONS];
 static heaplib_lock_t heaplib_region_lock;
 
+/* The Regions to try, in order, for each routing key and size band. Rebuilt
+ * with the Master locked whenever a Region is added or rerouted.
+ */
+static uint8_t routes[HEAPLIB_ROUTE_KEYS][HEAPLIB_ROUTE_BANDS][NREGIONS];
+static uint8_t nroutes[HEAPLIB_ROUTE_KEYS][HEAPLIB_ROUTE_BANDS];
+
 static heaplib_error_t __region_test_and_lock(
 				heaplib_region_t *,
-				heaplib_flags_t);
+				heaplib_flags_t,
+				const char * );
 static heaplib_error_t __region_scan_next_and_lock(
 				heaplib_region_t **,
 				vbaddr_t,
-				heaplib_flags_t);
+				heaplib_flags_t,
+				const char * );
+
+static heaplib_error_t __region_add(
+				vaddr_t,
+				size_t,
+				size_t,
+				heaplib_flags_t,
+				heaplib_region_t **);
 
 static void __heaplib_node_init(heaplib_region_t *, heaplib_node_t * );
+static void __region_route_build(void);
 
 void
 heaplib_init(void)
@@ -31,18 +47,100 @@ heaplib_init(void)
 	for(i = 0; i < nelem(regions); i++)
 	{
 		heaplib_lock_init(&regions[i].lock);
+		heaplib_cond_init(&regions[i].cond);
+		regions[i].wait_min = (size_t)~0;
+		__heaplib_index_init(&regions[i], i);
 	}
 
 	heaplib_lock_init(&heaplib_region_lock);
+
+	__heaplib_async_init();
+	__heaplib_stats_init();
+	__heaplib_lockprof_init();
+	platform_zero_init();
+	platform_search_init();
+}
+
+/**
+ * \brief The index of the Region containing 'v', or NREGIONS if none does.
+ *
+ * No lock is taken. heaplib_free, reference counting and the malloc shim
+ * use this to decide who owns a pointer, and statistics are filed by it.
+ *
+ * This is safe for any pointer to a live allocation. Regions live in a
+ * static table, so the scan never touches memory that can go away, and
+ * heaplib_region_delete only marks a Region: it is torn down, under its
+ * own lock, once its last node is freed. Deferred frees stay active until
+ * drained, so they hold it up as well. A Region holding a live node can't
+ * be torn down or have its slot reused, so the answer for such a pointer
+ * never changes. For any other pointer the answer may be stale, so
+ * callers still check the node's magic, and heaplib_free checks the Region
+ * again once it is locked. Freeing into a Region after it is deleted is a
+ * use after free, as with any other allocator.
+ */
+int
+__heaplib_region_index(vaddr_t v)
+{
+	int i;
+
+	for(i = 0; i < nelem(regions); i++)
+	{
+		if((regions[i].flags & heaplib_flags_active) &&
+		   heaplib_region_within(v, &regions[i]))
+		{
+			return i;
+		}
+	}
+
+	return NREGIONS;
+}
+
+/**
+ * \brief The Region in slot 'i', active or not, or nil past the last.
+ */
+heaplib_region_t *
+__heaplib_region_at(int i)
+{
+	if(i < 0 || i >= nelem(regions))
+		return nil;
+
+	return &regions[i];
+}
+
+/**
+ * \brief The slot of Region 'h', or NREGIONS for nil.
+ */
+int
+__heaplib_region_slot(heaplib_region_t * h)
+{
+	return h ? (int)(h - &regions[0]) : NREGIONS;
+}
+
+/**
+ * \brief The index of the Region owning lock 'x', or NREGIONS for the
+ * Master lock.
+ */
+int
+__heaplib_lock_index(heaplib_lock_t * x)
+{
+	int i;
+
+	for(i = 0; i < nelem(regions); i++)
+	{
+		if(x == &regions[i].lock)
+			return i;
+	}
+
+	return NREGIONS;
 }
 
-#if DEBUG
+#if HEAPLIB_WALK
 static void
 __region_walk(heaplib_region_t * h)
 {
 	heaplib_node_t * n;
 
-	PRINTF(
+	REPORTF(
 		"walk region: free=%ld size=%ld addr=%p flags=%x free_list=%p "
 		"nodes_free=%ld nodes_active=%ld\n",
 		h->free,
@@ -54,34 +152,34 @@ __region_walk(heaplib_region_t * h)
 		h->nodes_active);
 
 	n = (heaplib_node_t * )h->addr;
-	PRINTF("walk region addr=%p\n", n);
+	REPORTF("walk region addr=%p\n", n);
 
 	while(heaplib_region_within(n, h))
 	{
-		if(n->active)
+		if(heaplib_node_active(n))
 		{
-			PRINTF(
+			REPORTF(
 				"walk: node=%p payload=%p active=%d size=%ld "
 				"task=%ld refs=%x flags=%lx\n",
 				n,
 				&n->payload[0],
-				n->active,
+				heaplib_node_active(n),
 				heaplib_node_size(n),
-				n->pc_t.task,
-				n->pc_t.refs,
-				n->pc_t.flags);
+				heaplib_node_task(n),
+				heaplib_node_refs(n),
+				(long)heaplib_node_flags(n));
 		}
 		else
 		{
-			PRINTF(
+			REPORTF(
 				"walk: node=%p payload=%p active=%d size=%ld "
 				"next=%p prev=%p\n",
 				n,
 				&n->payload[0],
-				n->active,
+				heaplib_node_active(n),
 				heaplib_node_size(n),
-				heaplib_free_next(n),
-				heaplib_free_prev(n));
+				heaplib_free_next(h, n),
+				heaplib_free_prev(h, n));
 		}
 
 		n = heaplib_node_next(n);
@@ -91,7 +189,6 @@ __region_walk(heaplib_region_t * h)
 void
 heaplib_walk(void)
 {
-	boolean_t x;
 	int i;
 
 	/* First thing we do is attempt to lock the Master. */
@@ -101,14 +198,14 @@ heaplib_walk(void)
 
 	for(i = 0; i < nelem(regions); i++)
 	{
-		PRINTF("walk: region=%d\n", i);
+		REPORTF("walk: region=%d\n", i);
 		/* This debugging routine always waits */
-		heaplib_lock_lock(&regions[i].lock);
+		heaplib_region_lock_flags(&regions[i].lock, heaplib_flags_wait);
 		__region_walk(&regions[i]);
-		heaplib_lock_unlock(&regions[i].lock);
+		heaplib_region_unlock(&regions[i].lock);
 	}
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 }
 #endif
 
@@ -130,6 +227,7 @@ heaplib_ptr2region(vaddr_t v, heaplib_region_t ** hp, heaplib_flags_t f)
 	if(e != heaplib_error_none)
 	{
 		PRINTF("error: can't lock the master lock\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
 		return heaplib_error_again;
 	}
 
@@ -140,6 +238,7 @@ heaplib_ptr2region(vaddr_t v, heaplib_region_t ** hp, heaplib_flags_t f)
 		if(e != heaplib_error_none)
 		{
 			PRINTF("ERROR: can't region lock in ptr2region\n");
+			heaplib_trace(heaplib_trace_lock_failed, &regions[i], 0, nil);
 			break;
 		}
 
@@ -156,10 +255,10 @@ heaplib_ptr2region(vaddr_t v, heaplib_region_t ** hp, heaplib_flags_t f)
 			}
 		}
 
-		heaplib_lock_unlock(&regions[i].lock);
+		heaplib_region_unlock(&regions[i].lock);
 	}
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 	return e;
 }
 
@@ -176,29 +275,22 @@ heaplib_error_t
 heaplib_region_find_first(heaplib_region_t ** rp, heaplib_flags_t f)
 {
 	heaplib_error_t e;
-	int i;
 
 	/* First thing we do is attempt to lock the Master. Yield to flags */
 	e = heaplib_region_lock_flags(&heaplib_region_lock, f);
 	if(e != heaplib_error_none)
 	{
 		PRINTF("ERROR: region_find_first: cant lock\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
 		return e;
 	}
 
-	e = heaplib_error_fatal;
-	/* Once locked, search for the next matching Region */
-	for(i = 0; i < nelem(regions); i++)
-	{
-		e = __region_test_and_lock(&regions[i], f);
-		if(e == heaplib_error_none)
-		{
-			*rp = &regions[i];
-			break;
-		}
-	}
+	/* Start from the lowest address, as heaplib_region_find_next goes up
+	 * from the Region it is given.
+	 */
+	e = __region_scan_next_and_lock(rp, nil, f, __func__);
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 	return e;
 }
 
@@ -208,14 +300,15 @@ heaplib_region_find_first(heaplib_region_t ** rp, heaplib_flags_t f)
  * 	    retrieve all Regions if they wish.
  */
 static heaplib_error_t
-__region_test_and_lock(heaplib_region_t * rp, heaplib_flags_t f)
+__region_test_and_lock(heaplib_region_t * rp, heaplib_flags_t f, const char * s)
 {
 	heaplib_error_t e;
 
-	e = heaplib_region_lock_flags(&(rp)->lock, f);
+	e = heaplib_region_lock_site(&(rp)->lock, f, s);
 	if(e != heaplib_error_none)
 	{
 		PRINTF("ERROR: __region_test_and_lock cantlock\n");
+		heaplib_trace(heaplib_trace_lock_failed, rp, 0, nil);
 		return e;
 	}
 
@@ -235,7 +328,7 @@ __region_test_and_lock(heaplib_region_t * rp, heaplib_flags_t f)
 	}
 
 	/* No match. Unlock */
-	heaplib_lock_unlock(&(rp)->lock);
+	heaplib_region_unlock(&(rp)->lock);
 	return heaplib_error_fatal;
 }
 
@@ -262,12 +355,13 @@ heaplib_region_find_next(heaplib_region_t ** rp, heaplib_flags_t f)
 	 * without first holding the Master lock.
 	 */
 	b = (*rp)->addr;
-	heaplib_lock_unlock(&(*rp)->lock);
+	heaplib_region_unlock(&(*rp)->lock);
 
 	e = heaplib_region_lock_flags(&heaplib_region_lock, f);
 	if(e != heaplib_error_none)
 	{
 		PRINTF("error: heaplib_region_find_next: cant lock master\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
 		return e;
 	}
 
@@ -278,9 +372,9 @@ heaplib_region_find_next(heaplib_region_t ** rp, heaplib_flags_t f)
 	 * attempt succeeded or not. If the caller wants to wait, they should
 	 * explicitly ask to.
 	 */
-	e = __region_scan_next_and_lock(rp, b, f);
+	e = __region_scan_next_and_lock(rp, b, f, __func__);
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 
 	return e;
 }
@@ -297,7 +391,8 @@ static heaplib_error_t
 __region_scan_next_and_lock(
 	heaplib_region_t ** hp,
 	vbaddr_t b,
-	heaplib_flags_t f)
+	heaplib_flags_t f,
+	const char * s)
 {
 	heaplib_region_t * h;
 	heaplib_error_t e;
@@ -341,7 +436,7 @@ __region_scan_next_and_lock(
 				   (regions[j].addr > b))
 				{
 					n = regions[j].addr;
-					h = &regions[i];
+					h = &regions[j];
 				}
 			}
 		}
@@ -354,7 +449,7 @@ __region_scan_next_and_lock(
 		b = h->addr;
 
 		/* If we found our Region, return */
-		e = __region_test_and_lock(h, f);
+		e = __region_test_and_lock(h, f, s);
 		if(e == heaplib_error_none)
 		{
 			/* We are locked and ready */
@@ -367,6 +462,215 @@ __region_scan_next_and_lock(
 	return heaplib_error_fatal;
 }
 
+/**
+ * \brief The routing key for the Region flags in 'f'.
+ */
+static int
+__region_route_key(heaplib_flags_t f)
+{
+	return ((f & heaplib_flags_internal) ? 1 : 0) |
+		((f & heaplib_flags_encrypted) ? 2 : 0) |
+		((f & heaplib_flags_wiped) ? 4 : 0);
+}
+
+/**
+ * \brief The size band of a 'z' byte request: the power of two below it.
+ */
+static int
+__region_route_band(size_t z)
+{
+	if(z < 2)
+		return 0;
+
+	return HEAPLIB_ROUTE_BANDS - 1 - __builtin_clzl((unsigned long)z);
+}
+
+/**
+ * \brief Whether Region 'h' takes any request in size band 'b'.
+ */
+static boolean_t
+__region_route_overlaps(heaplib_region_t * h, int b)
+{
+	size_t lo;
+	size_t hi;
+
+	lo = b == 0 ? 0 : (size_t)1 << b;
+	hi = (size_t)1 << (b + 1);
+
+	/* The top band has no end */
+	if(b == HEAPLIB_ROUTE_BANDS - 1)
+		return h->route_max == 0 || h->route_max > lo;
+
+	return h->route_min < hi && (h->route_max == 0 || h->route_max > lo);
+}
+
+/**
+ * \brief Whether Region 'a' should be tried before Region 'b'.
+ *
+ * Regions dedicated to a range of sizes go before those taking any size, so
+ * a band's own Regions fill first. Otherwise they keep the order they were
+ * added in.
+ */
+static boolean_t
+__region_route_before(heaplib_region_t * a, heaplib_region_t * b)
+{
+	boolean_t da;
+	boolean_t db;
+
+	da = a->route_min != 0 || a->route_max != 0;
+	db = b->route_min != 0 || b->route_max != 0;
+
+	return da && !db;
+}
+
+/**
+ * \brief Rebuild the routing table from the active Regions.
+ *
+ * Each key lists the Regions whose flags match it, as
+ * __region_test_and_lock would match them, and key zero lists every Region.
+ *
+ * \warning This must be called with the Master locked.
+ */
+static void
+__region_route_build(void)
+{
+	heaplib_region_t * h;
+	uint8_t * r;
+	int k;
+	int b;
+	int i;
+	int j;
+	int n;
+
+	for(k = 0; k < HEAPLIB_ROUTE_KEYS; k++)
+	{
+		for(b = 0; b < HEAPLIB_ROUTE_BANDS; b++)
+		{
+			r = routes[k][b];
+			n = 0;
+			for(i = 0; i < nelem(regions); i++)
+			{
+				h = &regions[i];
+				if((h->flags & heaplib_flags_active) == 0 ||
+				   (k != 0 && k != __region_route_key(h->flags)) ||
+				   !__region_route_overlaps(h, b))
+					continue;
+
+				/* Insert in order; there are only a few */
+				for(j = n; j > 0 &&
+				    __region_route_before(h, &regions[r[j - 1]]); j--)
+					r[j] = r[j - 1];
+
+				r[j] = (uint8_t)i;
+				n++;
+			}
+
+			nroutes[k][b] = (uint8_t)n;
+		}
+	}
+}
+
+/**
+ * \brief Copy the Regions to try for a 'z' byte request with flags 'f' to
+ * 'r', in order.
+ *
+ * The table is looked up directly by size band and Region flags, so this
+ * costs the same however many Regions there are. The Regions are not
+ * locked; pass each to __heaplib_region_lock_routed in turn.
+ *
+ * \param r [out] Room for NREGIONS Region indices.
+ *
+ * \return The number of Regions, or -1 if the Master couldn't be locked.
+ */
+int
+__heaplib_region_routes(uint8_t * r, size_t z, heaplib_flags_t f)
+{
+	int k;
+	int b;
+	int n;
+
+	if(heaplib_region_lock_flags(&heaplib_region_lock, f) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: __heaplib_region_routes: cant lock master\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
+		return -1;
+	}
+
+	k = __region_route_key(f & heaplib_flags_regionmask);
+	b = __region_route_band(z);
+	n = nroutes[k][b];
+	memcpy(r, routes[k][b], n);
+
+	heaplib_region_unlock(&heaplib_region_lock);
+
+	return n;
+}
+
+/**
+ * \brief Lock Region 'i' from a route if it can still take requests with
+ * flags 'f'.
+ *
+ * The Master isn't needed: a Region only becomes active or inactive with its
+ * own lock held, which is checked again here. The route may be stale, which
+ * at worst tries a Region that no longer suits, or misses one just added.
+ */
+heaplib_error_t
+__heaplib_region_lock_routed(heaplib_region_t ** hp, int i, heaplib_flags_t f)
+{
+	heaplib_error_t e;
+
+	e = __region_test_and_lock(&regions[i], f, __func__);
+	if(e == heaplib_error_none)
+		*hp = &regions[i];
+
+	return e;
+}
+
+/**
+ * \brief Route requests from 'min' bytes up to, but not including, 'max'
+ * bytes to Region 'h'.
+ *
+ * A 'max' of zero has no upper limit, so routing from 0 to 0 lets the Region
+ * take any request again. Regions routed to a size are tried before those
+ * taking any size, so a Region can be set aside for small objects, keeping
+ * them from fragmenting a Region kept for large buffers.
+ */
+heaplib_error_t
+heaplib_region_route(heaplib_region_t * h, size_t min, size_t max)
+{
+	heaplib_error_t e;
+
+	if(max != 0 && min >= max)
+		return heaplib_error_fatal;
+
+	e = heaplib_region_lock_flags(&heaplib_region_lock, heaplib_flags_wait);
+	if(e != heaplib_error_none)
+		return e;
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+
+	e = heaplib_error_fatal;
+	if(h->flags & heaplib_flags_active)
+	{
+		h->route_min = min;
+		h->route_max = max;
+		e = heaplib_error_none;
+	}
+
+	heaplib_region_unlock(&h->lock);
+
+	if(e == heaplib_error_none)
+		__region_route_build();
+
+	heaplib_region_unlock(&heaplib_region_lock);
+
+	if(e == heaplib_error_none)
+		__heaplib_async_kick();
+
+	return e;
+}
+
 /**
  * \brief Perform the actual delete function
  *
@@ -383,15 +687,28 @@ void
 __heaplib_region_delete_internal(heaplib_region_t * h)
 {
 	if((h->flags & heaplib_flags_restrict) &&
-	   (h->free == h->size) &&
 	   (h->nodes_active == 0))
 	{
+		/* Memory from the page provider goes back to it */
+		if(h->flags & heaplib_flags_reserved)
+		{
+			platform_page_release((vaddr_t)h->addr, h->reserved);
+		}
+
 		h->free_list = nil;
+		h->rover = nil;
+		h->pending = nil;
 		h->nodes_free = 0;
 		h->addr = nil;
 		h->flags = 0;
+		h->route_min = 0;
+		h->route_max = 0;
 		h->size = 0;
+		h->reserved = 0;
 		h->free = 0;
+		h->untrimmed = 0;
+		__heaplib_index_reset(h);
+		memset(&h->scrub, 0, sizeof(h->scrub));
 	}
 }
 
@@ -413,6 +730,7 @@ heaplib_region_delete(heaplib_region_t * h)
 	if(e != heaplib_error_none)
 	{
 		PRINTF("error: heaplib_region_add: can't lock master\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
 		return e;
 	}
 
@@ -434,7 +752,7 @@ heaplib_region_delete(heaplib_region_t * h)
 		}
 	}
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 
 	return e;
 }
@@ -447,17 +765,285 @@ heaplib_region_delete(heaplib_region_t * h)
  */
 heaplib_error_t
 heaplib_region_add(vaddr_t a, size_t sz, heaplib_flags_t f)
+{
+	heaplib_error_t e;
+
+	/* Caller memory can only be advised to use transparent huge pages */
+	if((f & heaplib_flags_hugepage) && platform_page_advise_huge(a, sz) != 0)
+	{
+		PRINTF("heaplib_region_add: no huge pages; using small pages\n");
+		f &= ~heaplib_flags_hugepage;
+	}
+
+	e = __region_add(a, sz, sz, f & ~heaplib_flags_reserved, nil);
+	if(e == heaplib_error_none)
+		__heaplib_async_kick();
+
+	return e;
+}
+
+/**
+ * \brief Add a Region that reserves address space and commits it on demand.
+ *
+ * Reserve 'rsv' bytes from the platform page provider and commit the first
+ * 'sz' bytes. The Region grows toward the end of the reservation as its tail
+ * is consumed, either explicitly through heaplib_region_extend or when an
+ * allocation would otherwise fail.
+ *
+ * \param hp [out] The new Region, if not nil.
+ * \param rsv [in] Bytes of address space to reserve.
+ * \param sz [in] Bytes to commit immediately.
+ * \param f [in] Region flags.
+ */
+heaplib_error_t
+heaplib_region_reserve(
+	heaplib_region_t ** hp,
+	size_t rsv,
+	size_t sz,
+	heaplib_flags_t f)
+{
+	heaplib_error_t e;
+	boolean_t pinned;
+	vaddr_t a;
+	size_t p;
+
+	p = platform_page_size();
+	if((f & heaplib_flags_hugepage) && platform_hugepage_size())
+		p = platform_hugepage_size();
+	else
+		f &= ~heaplib_flags_hugepage;
+
+	rsv = (rsv + p - 1) & ~(p - 1);
+	sz = (sz + p - 1) & ~(p - 1);
+	if(sz > rsv)
+		sz = rsv;
+
+	pinned = False;
+	if(f & heaplib_flags_hugepage)
+		a = platform_page_reserve_huge(rsv, &pinned);
+	else
+		a = platform_page_reserve(rsv);
+	if(!a)
+	{
+		PRINTF("error: heaplib_region_reserve: can't reserve\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, rsv, nil);
+		return heaplib_error_fatal;
+	}
+
+	/* Explicit huge pages arrive committed and can't be given back in
+	 * smaller pieces, so the Region starts at its full size.
+	 */
+	if(pinned)
+	{
+		sz = rsv;
+		f = (f | heaplib_flags_pinned) & ~heaplib_flags_trim;
+	}
+
+	if(platform_page_commit(a, sz) != 0)
+	{
+		PRINTF("error: heaplib_region_reserve: can't commit\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, sz, a);
+		platform_page_release(a, rsv);
+		return heaplib_error_fatal;
+	}
+
+	e = __region_add(a, sz, rsv, f | heaplib_flags_reserved, hp);
+	if(e != heaplib_error_none)
+	{
+		platform_page_release(a, rsv);
+		return e;
+	}
+
+	__heaplib_async_kick();
+
+	return e;
+}
+
+/**
+ * \brief Grow a reserved Region in place.
+ *
+ * \param h [in] A Region created by heaplib_region_reserve.
+ * \param sz [in] Minimum number of bytes to commit.
+ */
+heaplib_error_t
+heaplib_region_extend(heaplib_region_t * h, size_t sz)
+{
+	heaplib_error_t e;
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+
+	e = heaplib_error_fatal;
+	if((h->flags & heaplib_flags_active) != 0 &&
+	   (h->flags & heaplib_flags_restrict) == 0)
+	{
+		e = __heaplib_region_extend(h, sz);
+	}
+
+	heaplib_region_unlock(&h->lock);
+
+	if(e == heaplib_error_none)
+		__heaplib_async_kick();
+
+	return e;
+}
+
+/**
+ * \brief Commit more of a reserved Region and hand it to the wilderness.
+ *
+ * The wilderness is the node that ends at the top of the Region. If it is
+ * free it simply grows, otherwise the new memory becomes a new free node at
+ * the end of the address-ordered free list.
+ *
+ * \warning This must be called with the Region locked.
+ */
+heaplib_error_t
+__heaplib_region_extend(heaplib_region_t * h, size_t sz)
+{
+	heaplib_node_t * n;
+	heaplib_node_t * t;
+	heaplib_node_t * L;
+	size_t p;
+
+	if((h->flags & heaplib_flags_reserved) == 0)
+		return heaplib_error_fatal;
+
+	p = heaplib_region_page(h);
+	sz = (sz + p - 1) & ~(p - 1);
+	if(sz > h->reserved - h->size)
+		sz = h->reserved - h->size;
+
+	/* Find the highest free node; the free list is address ordered */
+	L = nil;
+	for(t = h->free_list; t; t = heaplib_free_next(h, t))
+		L = t;
+
+	n = (heaplib_node_t * )(h->addr + h->size);
+	t = L;
+	if(t && heaplib_node_next(t) != n)
+		t = nil;
+
+	/* A new node needs room for its own metadata */
+	if(sz == 0 || (!t && sz < HEAPLIB_MIN_NODE))
+		return heaplib_error_fatal;
+
+	if(platform_page_commit((vaddr_t)(h->addr + h->size), sz) != 0)
+	{
+		PRINTF("error: __heaplib_region_extend: can't commit\n");
+		heaplib_trace(heaplib_trace_region_failed, h, h->size + sz, h->addr);
+		return heaplib_error_fatal;
+	}
+
+	if(t)
+	{
+		/* The old footer is now inside the payload. Committed pages
+		 * are clear, so clearing it keeps a clear node clear.
+		 */
+		if(heaplib_node_zero(t))
+			memset(heaplib_node_footer(t), 0, sizeof(heaplib_footer_t));
+		heaplib_node_set_size(t, heaplib_node_size(t) + sz);
+		heaplib_footer_init(t);
+		__heaplib_index_resize(h, t);
+		h->free += sz;
+		h->changes++;
+	}
+	else
+	{
+		/* The node below is active, so PREVFREE stays clear */
+		n->size = sz - (sizeof(heaplib_node_t) + sizeof(heaplib_footer_t));
+		n->magic = HEAPLIB_NODE_MAGIC;
+		heaplib_node_set_zero(n);
+		heaplib_free_set_next(h, n, nil);
+		heaplib_free_set_prev(h, n, nil);
+
+		/* It goes after the highest free node */
+		if(L)
+		{
+			heaplib_free_set_next(h, L, n);
+			heaplib_free_set_prev(h, n, L);
+		}
+		else
+		{
+			h->free_list = n;
+		}
+
+		heaplib_footer_init(n);
+		__heaplib_index_insert(h, n);
+		h->free += heaplib_node_size(n);
+		h->nodes_free += 1;
+		h->changes++;
+	}
+
+	h->size += sz;
+
+	heaplib_trace(heaplib_trace_extend, h, h->size, h->addr);
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Claim a Region slot and initialize it over 'sz' bytes at 'a'.
+ *
+ * \param rsv [in] Bytes the Region may eventually grow to.
+ * \param hp [out] The new Region, if not nil.
+ */
+static heaplib_error_t
+__region_add(
+	vaddr_t a,
+	size_t sz,
+	size_t rsv,
+	heaplib_flags_t f,
+	heaplib_region_t ** hp)
 {
 	heaplib_footer_t * nf;
 	heaplib_region_t * h;
 	heaplib_node_t * n;
 	heaplib_error_t e;
+	size_t d;
 	int i;
 
+	/* Every node must start on a word boundary: headers may not be packed,
+	 * and even packed ones hold words that are updated atomically, such as
+	 * the reference count and the link of a deferred free.
+	 */
+	d = (sizeof(size_t) - ((size_t)a & (sizeof(size_t) - 1))) &
+		(sizeof(size_t) - 1);
+	if(sz <= d)
+	{
+		PRINTF("error: heaplib_region_add: region too small\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, sz, a);
+		return heaplib_error_fatal;
+	}
+
+	a = (vaddr_t)((vbaddr_t)a + d);
+	sz -= d;
+
+	/* Every node size must be a whole number of chunks */
+	sz &= ~(HEAPLIB_CHUNKSZ - 1);
+	if(sz < HEAPLIB_MIN_NODE)
+	{
+		PRINTF("error: heaplib_region_add: region too small\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, sz, a);
+		return heaplib_error_fatal;
+	}
+
+#ifdef HEAPLIB_COMPACT
+	/* Compact links and sizes are 32-bit Region-relative offsets */
+	if(rsv > HEAPLIB_REGION_MAX)
+	{
+		PRINTF("error: heaplib_region_add: region too large\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, rsv, a);
+		return heaplib_error_fatal;
+	}
+#endif
+
+	if(rsv < sz)
+		rsv = sz;
+
 	e = heaplib_region_lock_flags(&heaplib_region_lock, f);
 	if(e != heaplib_error_none)
 	{
 		PRINTF("error: heaplib_region_add: can't lock master\n");
+		heaplib_trace(heaplib_trace_lock_failed, nil, 0, nil);
 		return e;
 	}
 
@@ -473,7 +1059,7 @@ heaplib_region_add(vaddr_t a, size_t sz, heaplib_flags_t f)
 				break;
 			}
 
-			heaplib_lock_unlock(&regions[i].lock);
+			heaplib_region_unlock(&regions[i].lock);
 		}
 	}
 
@@ -481,6 +1067,7 @@ heaplib_region_add(vaddr_t a, size_t sz, heaplib_flags_t f)
 	if(!h)
 	{
 		PRINTF("error: no region is free\n");
+		heaplib_trace(heaplib_trace_region_failed, nil, sz, a);
 		e = heaplib_error_fatal;
 	}
 	else
@@ -488,22 +1075,45 @@ heaplib_region_add(vaddr_t a, size_t sz, heaplib_flags_t f)
 		h->free = sz - (sizeof(*n) + sizeof(*nf));
 		h->flags = f | heaplib_flags_active;
 		h->size = sz;
+		h->reserved = rsv;
 		h->addr = (vbaddr_t)a;
 		h->nodes_active = 0;
 		h->nodes_free = 1;
+		h->untrimmed = 0;
+
+		/* The old size classes are routes over a sixteenth of it */
+		h->route_min = 0;
+		h->route_max = 0;
+		if(f & heaplib_flags_smallreq)
+			h->route_max = rsv / 16;
+		else if(f & heaplib_flags_largereq)
+			h->route_min = rsv / 16;
 
 		/* Initialize the Region */
 		n = (heaplib_node_t * )h->addr;
 		h->free_list = n;
+		h->rover = nil;
+		h->pending = nil;
 
 		__heaplib_node_init(h, n);
 
-		heaplib_lock_unlock(&h->lock);
+		__heaplib_index_reset(h);
+		__heaplib_index_insert(h, n);
+		memset(&h->scrub, 0, sizeof(h->scrub));
+
+		heaplib_trace(heaplib_trace_add, h, sz, a);
+
+		if(hp)
+			*hp = h;
+
+		heaplib_region_unlock(&h->lock);
+
+		__region_route_build();
 	}
 
-	heaplib_lock_unlock(&heaplib_region_lock);
+	heaplib_region_unlock(&heaplib_region_lock);
 
-	return heaplib_error_none;
+	return e;
 }
 
 static void
@@ -511,13 +1121,17 @@ __heaplib_node_init(heaplib_region_t * h, heaplib_node_t * n)
 {
 	heaplib_footer_t * f;
 
-	n->size = h->free & ~1;
-	heaplib_free_next(n) = nil;
-	heaplib_free_prev(n) = nil;
-	n->magic = HEAPLIB_MAGIC;
+	n->size = h->free;
+	n->magic = HEAPLIB_NODE_MAGIC;
+
+	/* Committed pages are always clear; caller memory only if we're told */
+	if(h->flags & (heaplib_flags_reserved | heaplib_flags_zeroed))
+		heaplib_node_set_zero(n);
+	heaplib_free_set_next(h, n, nil);
+	heaplib_free_set_prev(h, n, nil);
 
 	f = heaplib_node_footer(n);
 	f->magic = HEAPLIB_MAGIC;
-	f->size = n->size;
+	f->size = heaplib_node_size(n);
 }
 
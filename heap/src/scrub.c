@@ -0,0 +1,178 @@
+/**
+ * \file heap/src/scrub.c
+ *
+ * \brief Check the integrity of a Region a few nodes at a time.
+ *
+ * Each pass resumes where the last one stopped and checks a bounded number
+ * of nodes: header magic, footer magic and size, the free list links on
+ * both sides of each free node and the PREVFREE bit of the node after it.
+ * Once a pass reaches the end of the Region without the Region having
+ * changed since it began, its tallies must match the Region's counters and
+ * the free node index must match the free list.
+ *
+ * Regions flagged heaplib_flags_scrub are checked by heaplib_idle, which
+ * lets heaplib_free skip walking them.
+ */
+#include "heaplib/heaplib.h"
+
+static heaplib_error_t __scrub_node(heaplib_region_t *, heaplib_node_t * );
+static heaplib_error_t __scrub_corrupt(
+				heaplib_region_t *,
+				heaplib_node_t *,
+				const char * );
+
+/**
+ * \brief Check up to 'budget' nodes of Region 'h'.
+ *
+ * \return heaplib_error_fatal if the Region is corrupt, in which case it is
+ * restricted so nothing more is allocated from it.
+ *
+ * \warning This must be called with the Region locked.
+ */
+heaplib_error_t
+__heaplib_region_scrub(heaplib_region_t * h, size_t budget)
+{
+	heaplib_scrub_t * s;
+	heaplib_node_t * n;
+	size_t k;
+
+	s = &h->scrub;
+
+	if(!s->next || !heaplib_region_within(s->next, h))
+	{
+		s->next = (heaplib_node_t * )h->addr;
+		s->changes = h->changes;
+		s->free = 0;
+		s->nodes_free = 0;
+		s->nodes_active = 0;
+	}
+
+	for(k = 0, n = s->next; k < budget && heaplib_region_within(n, h); k++)
+	{
+		if(__scrub_node(h, n) != heaplib_error_none)
+			return heaplib_error_fatal;
+
+		if(heaplib_node_active(n))
+		{
+			s->nodes_active++;
+		}
+		else
+		{
+			s->free += heaplib_node_size(n);
+			s->nodes_free++;
+		}
+
+		n = heaplib_node_next(n);
+	}
+
+	if(heaplib_region_within(n, h))
+	{
+		s->next = n;
+		return heaplib_error_none;
+	}
+
+	s->next = nil;
+
+	/* Tallies from a pass the allocator cut into prove nothing */
+	if(s->changes != h->changes)
+		return heaplib_error_none;
+
+	if(s->free != h->free || s->nodes_free != h->nodes_free ||
+	   s->nodes_active != h->nodes_active)
+	{
+		return __scrub_corrupt(h, nil, "counters don't match nodes");
+	}
+
+	/* The index holds a bounded number of nodes, so checking it is too */
+	if(!__heaplib_index_check(h))
+		return __scrub_corrupt(h, nil, "index doesn't match free list");
+
+	s->passes++;
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Check up to 'budget' nodes of Region 'h', waiting for its lock.
+ *
+ * \return heaplib_error_fatal if the Region is corrupt.
+ */
+heaplib_error_t
+heaplib_region_scrub(heaplib_region_t * h, size_t budget)
+{
+	heaplib_error_t e;
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+	e = __heaplib_region_scrub(h, budget);
+	heaplib_region_unlock(&h->lock);
+
+	return e;
+}
+
+/**
+ * \brief Check node 'n' of Region 'h' and its free list links.
+ */
+static heaplib_error_t
+__scrub_node(heaplib_region_t * h, heaplib_node_t * n)
+{
+	heaplib_footer_t * f;
+	heaplib_node_t * N;
+	heaplib_node_t * x;
+
+	if(n->magic != HEAPLIB_NODE_MAGIC)
+		return __scrub_corrupt(h, n, "bad magic");
+
+	N = heaplib_node_next(n);
+	if((vbaddr_t)N > h->addr + h->size)
+		return __scrub_corrupt(h, n, "size runs past the Region");
+
+	/* Active nodes lending their footer to the payload have none */
+	f = heaplib_node_footer(n);
+	if((!heaplib_node_active(n) || HEAPLIB_FOOTER_SLACK == 0) &&
+	   (f->magic != HEAPLIB_MAGIC || f->size != heaplib_node_size(n)))
+	{
+		return __scrub_corrupt(h, n, "bad footer");
+	}
+
+	if(heaplib_region_within(N, h) &&
+	   heaplib_node_prev_free(N) == heaplib_node_active(n))
+	{
+		return __scrub_corrupt(h, n, "PREVFREE of the next node is wrong");
+	}
+
+	if(heaplib_node_active(n))
+		return heaplib_error_none;
+
+	/* Free nodes are linked in address order */
+	x = heaplib_free_prev(h, n);
+	if(x ? (!heaplib_region_within(x, h) || x >= n ||
+	        heaplib_node_active(x) || heaplib_free_next(h, x) != n) :
+	       h->free_list != n)
+	{
+		return __scrub_corrupt(h, n, "bad free list link back");
+	}
+
+	x = heaplib_free_next(h, n);
+	if(x && (!heaplib_region_within(x, h) || x <= n ||
+	         heaplib_node_active(x) || heaplib_free_prev(h, x) != n))
+	{
+		return __scrub_corrupt(h, n, "bad free list link forward");
+	}
+
+	return heaplib_error_none;
+}
+
+/**
+ * \brief Report corruption of Region 'h' at node 'n', and stop using it.
+ */
+static heaplib_error_t
+__scrub_corrupt(heaplib_region_t * h, heaplib_node_t * n, const char * why)
+{
+	REPORTF("heaplib: Region %p corrupt at node %p: %s\n", h->addr, n, why);
+
+	h->scrub.next = nil;
+	h->scrub.corrupt++;
+	h->flags |= heaplib_flags_restrict;
+
+	return heaplib_error_fatal;
+}
@@ -0,0 +1,139 @@
+/**
+ * \file heap/src/snapshot.c
+ *
+ * \brief Binary snapshots of every Region's node map.
+ *
+ * A snapshot copies the position, size, state, flags and owner of every node
+ * into a caller's buffer, one Region at a time. Each Region is locked only
+ * while its nodes are copied, and nothing is formatted or printed, so a
+ * snapshot is cheap enough to take from release builds on large heaps. The
+ * snapshot tool renders fragmentation maps and histograms from a series of
+ * them offline.
+ */
+#include "heaplib/heaplib.h"
+
+/**
+ * \brief Copy the node map of Region 'h' to 'p'.
+ *
+ * Records are only written while they fit in 'left' bytes, but every node is
+ * counted, so the caller learns how much room the Region needs.
+ *
+ * \return The bytes needed for the Region and all of its nodes.
+ *
+ * \warning This must be called with the Region locked.
+ */
+static size_t
+__snapshot_region(heaplib_region_t * h, int i, uint8_t * p, size_t left)
+{
+	heaplib_snapshot_region_t * r;
+	heaplib_snapshot_node_t * o;
+	heaplib_node_t * n;
+	size_t z;
+	size_t k;
+
+	r = (heaplib_snapshot_region_t * )p;
+	o = (heaplib_snapshot_node_t * )(r + 1);
+	z = sizeof(*r);
+
+	k = 0;
+	n = (heaplib_node_t * )h->addr;
+	while(heaplib_region_within(n, h))
+	{
+		if(z + sizeof(*o) <= left)
+		{
+			o->offset = (uint64_t)((vbaddr_t)n - h->addr);
+			o->size = n->size;
+			o->task = 0;
+			o->flags = 0;
+
+			/* Free nodes keep their list links where active nodes
+			 * keep these.
+			 */
+			if(heaplib_node_active(n))
+			{
+				o->task = (uint64_t)(uintptr_t)heaplib_node_task(n);
+				o->flags = (uint32_t)heaplib_node_flags(n);
+			}
+
+			o++;
+		}
+
+		z += sizeof(*o);
+		k++;
+		n = heaplib_node_next(n);
+	}
+
+	if(z <= left)
+	{
+		r->addr = (uint64_t)(uintptr_t)h->addr;
+		r->size = h->size;
+		r->reserved = h->reserved;
+		r->free = h->free;
+		r->flags = (uint32_t)h->flags;
+		r->index = (uint16_t)i;
+		r->header = (uint8_t)sizeof(heaplib_node_t);
+		r->footer = (uint8_t)sizeof(heaplib_footer_t);
+		r->nnodes = k;
+	}
+
+	return z;
+}
+
+/**
+ * \brief Take a snapshot of every active Region.
+ *
+ * \param b [out] Buffer for the snapshot.
+ * \param len [in] Bytes available at 'b'.
+ * \param zp [out] Bytes used, or needed if 'b' was too small. May be nil.
+ *
+ * \return heaplib_error_again if 'b' was too small. The heap may change
+ * between calls, so retry with some room to spare.
+ */
+heaplib_error_t
+heaplib_snapshot(void * b, size_t len, size_t * zp)
+{
+	heaplib_snapshot_t * s;
+	heaplib_region_t * h;
+	size_t need;
+	size_t z;
+	int n;
+	int i;
+
+	s = (heaplib_snapshot_t * )b;
+	need = sizeof(*s);
+	n = 0;
+
+	for(i = 0; (h = __heaplib_region_at(i)) != nil; i++)
+	{
+		heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+
+		if((h->flags & heaplib_flags_active) == 0)
+		{
+			heaplib_region_unlock(&h->lock);
+			continue;
+		}
+
+		z = __snapshot_region(h, i, (uint8_t * )b + need,
+			len > need ? len - need : 0);
+
+		heaplib_region_unlock(&h->lock);
+
+		need += z;
+		n++;
+	}
+
+	if(zp)
+		*zp = need;
+
+	if(need > len)
+		return heaplib_error_again;
+
+	/* Written last, so a partial snapshot never looks valid */
+	s->magic = HEAPLIB_SNAPSHOT_MAGIC;
+	s->version = HEAPLIB_SNAPSHOT_VERSION;
+	s->nregions = (uint16_t)n;
+	s->time = platform_time_ms();
+	s->length = need;
+
+	return heaplib_error_none;
+}
@@ -0,0 +1,353 @@
+/**
+ * \file heap/src/stats.c
+ *
+ * \brief Latency histograms for allocation, free, coalescing and locking.
+ *
+ * Built with HEAPLIB_STATS, each timed operation adds one count to a
+ * log-linear histogram. Every thread owns a slot of histograms, so recording
+ * never takes a lock or shares a cache line, and readers merge the slots
+ * when they query. Operations are broken down by Region, and allocations and
+ * frees also by size class. The totals are dumped when the program exits.
+ *
+ * Without HEAPLIB_STATS nothing is timed, queries fail and dumps are empty.
+ */
+#include "heaplib/heaplib.h"
+
+static const char * stats_names[heaplib_stat_nops] = {
+	"calloc",
+	"free",
+	"coalesce",
+	"lock",
+};
+
+#ifdef HEAPLIB_STATS
+/* Only allocations and frees have a request size */
+#define STATS_SIZED (heaplib_stat_free + 1)
+
+struct
+heaplib_hist_t
+{
+	uint32_t bucket[HEAPLIB_STATS_BUCKETS];
+	uint64_t max;
+};
+
+typedef struct heaplib_hist_t heaplib_hist_t;
+
+struct
+heaplib_stats_slot_t
+{
+	heaplib_hist_t region[heaplib_stat_nops][HEAPLIB_STATS_REGIONS];
+	heaplib_hist_t size[STATS_SIZED][HEAPLIB_STATS_CLASSES];
+};
+
+typedef struct heaplib_stats_slot_t heaplib_stats_slot_t;
+
+static heaplib_stats_slot_t stats_slots[PLATFORM_STATS_THREADS];
+static unsigned int stats_next;
+static PLATFORM_THREAD_LOCAL heaplib_stats_slot_t * stats_self;
+
+static int
+__stats_msb(uint64_t v)
+{
+	return 63 - __builtin_clzll(v);
+}
+
+/**
+ * \brief The bucket holding 'v' ticks.
+ *
+ * Values below eight have a bucket each. Above that, each power of two is
+ * split into eight buckets by the three bits below the leading one.
+ */
+static int
+__stats_bucket(uint64_t v)
+{
+	int e;
+	int i;
+
+	if(v < HEAPLIB_STATS_SUB)
+		return (int)v;
+
+	e = __stats_msb(v);
+	i = (e - 2) * HEAPLIB_STATS_SUB + (int)((v >> (e - 3)) & 7);
+
+	return i < HEAPLIB_STATS_BUCKETS ? i : HEAPLIB_STATS_BUCKETS - 1;
+}
+
+/**
+ * \brief The largest value in bucket 'i', in ticks.
+ */
+static uint64_t
+__stats_bucket_top(int i)
+{
+	uint64_t w;
+	int e;
+
+	if(i < HEAPLIB_STATS_SUB)
+		return (uint64_t)i;
+
+	e = i / HEAPLIB_STATS_SUB + 2;
+	w = (uint64_t)1 << (e - 3);
+
+	return ((uint64_t)(HEAPLIB_STATS_SUB + i % HEAPLIB_STATS_SUB) << (e - 3)) +
+		w - 1;
+}
+
+/**
+ * \brief The size class of a request of 'z' bytes.
+ */
+static int
+__stats_class(size_t z)
+{
+	int c;
+
+	if(z < 32)
+		return 0;
+
+	c = (__stats_msb(z) - 5) / 2 + 1;
+
+	return c < HEAPLIB_STATS_CLASSES ? c : HEAPLIB_STATS_CLASSES - 1;
+}
+
+static void
+__stats_add(heaplib_hist_t * x, uint64_t t)
+{
+	x->bucket[__stats_bucket(t)]++;
+	if(t > x->max)
+		x->max = t;
+}
+
+static void
+__stats_merge(uint64_t * b, uint64_t * mp, heaplib_hist_t * x)
+{
+	int i;
+
+	for(i = 0; i < HEAPLIB_STATS_BUCKETS; i++)
+		b[i] += x->bucket[i];
+
+	if(x->max > *mp)
+		*mp = x->max;
+}
+
+/**
+ * \brief Record that operation 'op' on Region 'r' took 't' ticks.
+ *
+ * \param op [in] The operation.
+ * \param r [in] Region index, or NREGIONS for work outside any Region.
+ * \param z [in] Request size, or zero for operations without one.
+ * \param t [in] Elapsed platform clock ticks.
+ */
+void
+__heaplib_stat_record(heaplib_stat_op_t op, int r, size_t z, uint64_t t)
+{
+	heaplib_stats_slot_t * s;
+	unsigned int i;
+
+	s = stats_self;
+	if(!s)
+	{
+		/* Threads past the limit share the last slot, losing an
+		 * occasional count to racing updates.
+		 */
+		i = __atomic_fetch_add(&stats_next, 1, __ATOMIC_RELAXED);
+		if(i >= PLATFORM_STATS_THREADS)
+			i = PLATFORM_STATS_THREADS - 1;
+		s = stats_self = &stats_slots[i];
+	}
+
+	if(r < 0 || r > NREGIONS)
+		r = NREGIONS;
+
+	__stats_add(&s->region[op][r], t);
+
+	if(op < STATS_SIZED && z)
+		__stats_add(&s->size[op][__stats_class(z)], t);
+}
+
+/**
+ * \brief Dump the statistics at exit.
+ */
+void
+__heaplib_stats_init(void)
+{
+	platform_atexit(heaplib_stats_dump);
+}
+
+/**
+ * \brief Summarise the latency of an operation across all threads.
+ *
+ * \param sp [out] The summary, in nanoseconds.
+ * \param op [in] The operation.
+ * \param r [in] Region index, NREGIONS for work outside any Region, or -1
+ * for all of them.
+ * \param c [in] Size class, or -1 for all of them. Size classes apply to
+ * allocation and free only, and can't be combined with a Region.
+ */
+heaplib_error_t
+heaplib_stats_query(heaplib_stats_t * sp, heaplib_stat_op_t op, int r, int c)
+{
+	uint64_t b[HEAPLIB_STATS_BUCKETS];
+	heaplib_stats_slot_t * s;
+	uint64_t q[3];
+	uint64_t * o[3];
+	uint64_t m;
+	uint64_t n;
+	int i;
+	int j;
+	int k;
+
+	if(op >= heaplib_stat_nops || r < -1 || r > NREGIONS ||
+	   c < -1 || c >= HEAPLIB_STATS_CLASSES ||
+	   (c >= 0 && (op >= STATS_SIZED || r >= 0)))
+	{
+		return heaplib_error_fatal;
+	}
+
+	memset(b, 0, sizeof(b));
+	m = 0;
+
+	for(i = 0; i < PLATFORM_STATS_THREADS; i++)
+	{
+		s = &stats_slots[i];
+
+		if(c >= 0)
+		{
+			__stats_merge(b, &m, &s->size[op][c]);
+			continue;
+		}
+
+		for(j = 0; j < HEAPLIB_STATS_REGIONS; j++)
+		{
+			if(r < 0 || r == j)
+				__stats_merge(b, &m, &s->region[op][j]);
+		}
+	}
+
+	n = 0;
+	for(i = 0; i < HEAPLIB_STATS_BUCKETS; i++)
+		n += b[i];
+
+	memset(sp, 0, sizeof(*sp));
+	sp->count = n;
+	sp->max = HEAPLIB_TICKS_NS(m);
+	if(n == 0)
+		return heaplib_error_none;
+
+	/* The rank of each percentile, rounded up */
+	q[0] = (n * 500 + 999) / 1000;
+	q[1] = (n * 990 + 999) / 1000;
+	q[2] = (n * 999 + 999) / 1000;
+	o[0] = &sp->p50;
+	o[1] = &sp->p99;
+	o[2] = &sp->p999;
+
+	k = 0;
+	n = 0;
+	for(i = 0; i < HEAPLIB_STATS_BUCKETS && k < 3; i++)
+	{
+		n += b[i];
+		while(k < 3 && n >= q[k])
+		{
+			/* A bucket never reports more than was seen */
+			*o[k] = __stats_bucket_top(i) < m ?
+				HEAPLIB_TICKS_NS(__stats_bucket_top(i)) : sp->max;
+			k++;
+		}
+	}
+
+	return heaplib_error_none;
+}
+#else
+void
+__heaplib_stats_init(void)
+{
+}
+
+heaplib_error_t
+heaplib_stats_query(heaplib_stats_t * sp, heaplib_stat_op_t op, int r, int c)
+{
+	(void)sp;
+	(void)op;
+	(void)r;
+	(void)c;
+
+	return heaplib_error_fatal;
+}
+#endif
+
+/**
+ * \brief Write 'v' in decimal after 'p', which must have room for it.
+ */
+static void
+__stats_label(char * w, const char * p, unsigned long v)
+{
+	char d[24];
+	int i;
+
+	while(*p)
+		*w++ = *p++;
+
+	i = 0;
+	do {
+		d[i++] = '0' + (char)(v % 10);
+		v /= 10;
+	}
+	while(v);
+
+	while(i)
+		*w++ = d[--i];
+	*w = 0;
+}
+
+static void
+__stats_line(heaplib_stat_op_t op, int r, int c)
+{
+	heaplib_stats_t s;
+	char w[32];
+
+	if(heaplib_stats_query(&s, op, r, c) != heaplib_error_none ||
+	   s.count == 0)
+	{
+		return;
+	}
+
+	if(c >= 0)
+		__stats_label(w, "size>=",
+			c ? (unsigned long)32 << (2 * (c - 1)) : 0UL);
+	else if(r >= 0 && r < NREGIONS)
+		__stats_label(w, "region ", (unsigned long)r);
+	else
+		strcpy(w, r < 0 ? "all" : "region -");
+
+	REPORTF("heaplib: %-8s %-12s n=%-10lu p50=%-8lu p99=%-8lu "
+		"p99.9=%-8lu max=%lu ns\n",
+		stats_names[op], w,
+		(unsigned long)s.count,
+		(unsigned long)s.p50,
+		(unsigned long)s.p99,
+		(unsigned long)s.p999,
+		(unsigned long)s.max);
+}
+
+/**
+ * \brief Print a summary of every operation, per Region and per size class.
+ */
+void
+heaplib_stats_dump(void)
+{
+	int op;
+	int i;
+
+	for(op = 0; op < heaplib_stat_nops; op++)
+	{
+		__stats_line(op, -1, -1);
+
+		for(i = 0; i < HEAPLIB_STATS_REGIONS; i++)
+			__stats_line(op, i, -1);
+
+		if(op > heaplib_stat_free)
+			continue;
+
+		for(i = 0; i < HEAPLIB_STATS_CLASSES; i++)
+			__stats_line(op, -1, i);
+	}
+}
@@ -0,0 +1,191 @@
+/**
+ * \file heap/src/trace.c
+ *
+ * \brief Binary event tracing into per-thread rings.
+ *
+ * Built with HEAPLIB_TRACE, each event is a fixed 32 byte record written to
+ * a ring owned by the calling thread: no lock is taken, nothing is
+ * formatted and nothing is printed, so tracing can stay on where debug text
+ * would change the timing it is meant to observe. Once a ring is full the
+ * oldest events are overwritten.
+ *
+ * Threads past the limit share the last ring. Slots are claimed atomically,
+ * so sharing one costs a little contention but loses nothing.
+ *
+ * Without HEAPLIB_TRACE nothing is recorded and reads fail.
+ */
+#include "heaplib/heaplib.h"
+
+#ifdef HEAPLIB_TRACE
+#if HEAPLIB_TRACE_EVENTS & (HEAPLIB_TRACE_EVENTS - 1)
+# error "HEAPLIB_TRACE_EVENTS must be a power of two"
+#endif
+
+struct
+heaplib_trace_ring_t
+{
+	uint64_t head;		/**< Events ever claimed */
+	uint64_t task;
+	heaplib_trace_event_t event[HEAPLIB_TRACE_EVENTS];
+};
+
+typedef struct heaplib_trace_ring_t heaplib_trace_ring_t;
+
+static heaplib_trace_ring_t trace_rings[PLATFORM_STATS_THREADS];
+static unsigned int trace_next;
+static PLATFORM_THREAD_LOCAL heaplib_trace_ring_t * trace_self;
+
+/**
+ * \brief Record event 'op' about Region 'h', which may be nil.
+ *
+ * The slot's sequence number is cleared while it is rewritten, so a reader
+ * racing the writer can tell and skip it.
+ */
+void
+__heaplib_trace_record(
+	heaplib_trace_op_t op,
+	heaplib_region_t * h,
+	uint64_t z,
+	uint64_t n)
+{
+	heaplib_trace_event_t * e;
+	heaplib_trace_ring_t * r;
+	unsigned int i;
+	uint64_t k;
+
+	r = trace_self;
+	if(!r)
+	{
+		i = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+		if(i >= PLATFORM_STATS_THREADS)
+			i = PLATFORM_STATS_THREADS - 1;
+		r = trace_self = &trace_rings[i];
+		r->task = (uint64_t)(uintptr_t)GET_PLATFORM_TASKID();
+	}
+
+	k = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+	e = &r->event[k & (HEAPLIB_TRACE_EVENTS - 1)];
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->time = platform_clock();
+	e->size = z;
+	e->node = n;
+	e->op = (uint16_t)op;
+	e->region = (uint16_t)__heaplib_region_slot(h);
+
+	__atomic_store_n(&e->seq, (uint32_t)(k + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Copy the events of ring 'r' to 'p', oldest first.
+ *
+ * Events are only written while they fit in 'left' bytes, but every one is
+ * counted, so the caller learns how much room the ring needs.
+ *
+ * \return The bytes needed for the ring and its events.
+ */
+static size_t
+__trace_ring(heaplib_trace_ring_t * r, uint8_t * p, size_t left)
+{
+	heaplib_trace_thread_t * t;
+	heaplib_trace_event_t * e;
+	heaplib_trace_event_t x;
+	uint64_t head;
+	uint64_t k;
+	uint32_t s;
+	size_t z;
+
+	t = (heaplib_trace_thread_t * )p;
+	z = sizeof(*t);
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	k = head > HEAPLIB_TRACE_EVENTS ? head - HEAPLIB_TRACE_EVENTS : 0;
+
+	for(; k < head; k++)
+	{
+		e = &r->event[k & (HEAPLIB_TRACE_EVENTS - 1)];
+
+		s = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		x = *e;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* Skip slots that were being rewritten, or already were */
+		if(s != (uint32_t)(k + 1) ||
+		   __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != s)
+			continue;
+
+		if(z + sizeof(x) <= left)
+			memcpy(p + z, &x, sizeof(x));
+
+		z += sizeof(x);
+	}
+
+	if(z <= left)
+	{
+		t->task = r->task;
+		t->nevents = (z - sizeof(*t)) / sizeof(x);
+		t->lost = head - t->nevents;
+	}
+
+	return z;
+}
+
+/**
+ * \brief Copy every thread's trace events.
+ *
+ * \param b [out] Buffer for the trace.
+ * \param len [in] Bytes available at 'b'.
+ * \param zp [out] Bytes used, or needed if 'b' was too small. May be nil.
+ *
+ * \return heaplib_error_again if 'b' was too small. Threads keep recording
+ * between calls, so retry with some room to spare.
+ */
+heaplib_error_t
+heaplib_trace_read(void * b, size_t len, size_t * zp)
+{
+	heaplib_trace_t * s;
+	unsigned int n;
+	unsigned int i;
+	size_t need;
+
+	s = (heaplib_trace_t * )b;
+	need = sizeof(*s);
+
+	n = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+	if(n > PLATFORM_STATS_THREADS)
+		n = PLATFORM_STATS_THREADS;
+
+	for(i = 0; i < n; i++)
+	{
+		need += __trace_ring(&trace_rings[i], (uint8_t * )b + need,
+			len > need ? len - need : 0);
+	}
+
+	if(zp)
+		*zp = need;
+
+	if(need > len)
+		return heaplib_error_again;
+
+	/* Written last, so a partial trace never looks valid */
+	s->magic = HEAPLIB_TRACE_MAGIC;
+	s->version = HEAPLIB_TRACE_VERSION;
+	s->nthreads = (uint16_t)n;
+	s->hz = PLATFORM_CLOCK_HZ;
+	s->length = need;
+
+	return heaplib_error_none;
+}
+#else
+heaplib_error_t
+heaplib_trace_read(void * b, size_t len, size_t * zp)
+{
+	(void)b;
+	(void)len;
+	(void)zp;
+
+	return heaplib_error_fatal;
+}
+#endif
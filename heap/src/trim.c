@@ -0,0 +1,87 @@
+/**
+ * \file heap/src/trim.c
+ *
+ * \brief Give the pages behind large free nodes back to the platform.
+ *
+ * Any free node whose payload covers at least one whole page has the
+ * page-aligned interior of its payload decommitted. The node's header,
+ * footer and free list links stay resident, the partial pages at either end
+ * are cleared by hand, and the node is marked known-zero so that allocating
+ * from it later can skip clearing the payload.
+ *
+ * Released pages must read back as zero, which only holds for private,
+ * anonymous memory. Pages of a shared or file-backed mapping keep their
+ * contents, so only reserved Regions, and added ones the caller has
+ * flagged heaplib_flags_anonymous, are ever trimmed.
+ */
+#include "heaplib/heaplib.h"
+
+/**
+ * \brief Trim every free node in a Region.
+ *
+ * \return The number of bytes handed back to the platform.
+ *
+ * \warning This must be called with the Region locked.
+ */
+size_t
+__heaplib_region_trim(heaplib_region_t * h)
+{
+	heaplib_node_t * n;
+	vbaddr_t s;
+	vbaddr_t e;
+	vbaddr_t ps;
+	vbaddr_t pe;
+	size_t p;
+	size_t t;
+
+	if((h->flags & heaplib_flags_pinned) ||
+	   !(h->flags & (heaplib_flags_reserved | heaplib_flags_anonymous)))
+		return 0;
+
+	p = heaplib_region_page(h);
+	t = 0;
+
+	for(n = h->free_list; n; n = heaplib_free_next(h, n))
+	{
+		s = &n->payload[HEAPLIB_LINK_BYTES];
+		e = &n->payload[heaplib_node_size(n)];
+
+		ps = (vbaddr_t)(((size_t)s + p - 1) & ~(p - 1));
+		pe = (vbaddr_t)((size_t)e & ~(p - 1));
+		if(pe <= ps)
+			continue;
+
+		/* Clear the partial pages at either end by hand */
+		if(!heaplib_node_zero(n))
+		{
+			memset((void * )s, 0, ps - s);
+			memset((void * )pe, 0, e - pe);
+		}
+
+		platform_page_decommit((vaddr_t)ps, pe - ps);
+		heaplib_node_set_zero(n);
+
+		t += pe - ps;
+	}
+
+	h->untrimmed = 0;
+
+	return t;
+}
+
+/**
+ * \brief Trim every free node in a Region.
+ *
+ * \return The number of bytes handed back to the platform.
+ */
+size_t
+heaplib_region_trim(heaplib_region_t * h)
+{
+	size_t t;
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+	t = __heaplib_region_trim(h);
+	heaplib_region_unlock(&h->lock);
+
+	return t;
+}
@@ -0,0 +1,45 @@
+/**
+ * \file heap/src/zero.c
+ *
+ * \brief Clear free memory ahead of allocation.
+ *
+ * A free node marked known-zero can be allocated without clearing its
+ * payload. Nodes are marked when their memory comes straight from the
+ * platform, when a wiped node is freed, and when they are trimmed. Splits
+ * pass the mark on and coalescing keeps it where both halves had it. This
+ * pass marks the rest by clearing them while the allocator is idle, so that
+ * calloc rarely has to.
+ */
+#include "heaplib/heaplib.h"
+
+/**
+ * \brief Clear free nodes in a Region until about 'budget' bytes are done.
+ *
+ * The budget is checked between nodes, so a single large node is always
+ * cleared in full.
+ *
+ * \return The number of bytes cleared.
+ *
+ * \warning This must be called with the Region locked.
+ */
+size_t
+__heaplib_region_prezero(heaplib_region_t * h, size_t budget)
+{
+	heaplib_node_t * n;
+	size_t t;
+
+	t = 0;
+	for(n = h->free_list; n && t < budget; n = heaplib_free_next(h, n))
+	{
+		if(heaplib_node_zero(n))
+			continue;
+
+		platform_zero((vaddr_t)&n->payload[HEAPLIB_LINK_BYTES],
+			heaplib_node_size(n) - HEAPLIB_LINK_BYTES);
+		heaplib_node_set_zero(n);
+
+		t += heaplib_node_size(n);
+	}
+
+	return t;
+}
@@ -12,10 +12,15 @@
 # include "stdlib.h"
 # include "mutex.h"
 # include "task.h"
+# include "waitq.h"
 #endif
 
+#include "heaplib/config.h"
+
 typedef harvest_task_t * task_t;
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
 typedef harvest_mutex_t heaplib_lock_t;
+typedef harvest_waitq_t heaplib_cond_t;
 
 /* Locking primitives */
 #define heaplib_lock_init(x) 	mutex_init((x));
@@ -23,22 +28,151 @@ typedef harvest_mutex_t heaplib_lock_t;
 #define heaplib_lock_unlock(x) 	mutex_unlock((x));
 __attribute__((always_inline)) __inline__ int
 heaplib_lock_trylock(heaplib_lock_t * x) {
+	/* No non-blocking acquire; always succeeds, like pthread trylock */
 	heaplib_lock_lock(x);
-	return True;
+	return 0;
+}
+
+/* Waiting for memory */
+#define heaplib_cond_init(x)	waitq_init((x));
+#define heaplib_cond_broadcast(x) waitq_wake_all((x));
+#elif HEAPLIB_LOCK == HEAPLIB_LOCK_UP
+/* One core: a lock masks machine interrupts. Locks nest, Regions under the
+ * Master, so only the outermost lock saves the interrupt enable and only
+ * the outermost unlock restores it.
+ */
+typedef int heaplib_lock_t;
+typedef int heaplib_cond_t;
+
+extern uint32_t platform_irq_depth;
+extern uint32_t platform_irq_state;
+
+__attribute__((always_inline)) __inline__ void
+platform_irq_mask(void) {
+	uint32_t s;
+
+	__asm__ __volatile__("csrrci %0, mstatus, 8" : "=r"(s) :: "memory");
+	if(platform_irq_depth++ == 0)
+		platform_irq_state = s & 8;
+}
+
+__attribute__((always_inline)) __inline__ void
+platform_irq_unmask(void) {
+	if(--platform_irq_depth == 0 && platform_irq_state)
+		__asm__ __volatile__("csrsi mstatus, 8" ::: "memory");
+}
+
+#define heaplib_lock_init(x) 	((void)(x));
+#define heaplib_lock_lock(x) 	platform_irq_mask();
+#define heaplib_lock_unlock(x) 	platform_irq_unmask();
+__attribute__((always_inline)) __inline__ int
+heaplib_lock_trylock(heaplib_lock_t * x) {
+	(void)x;
+	platform_irq_mask();
+	return 0;
+}
+
+/* Waiters poll; see platform_cond_wait */
+#define heaplib_cond_init(x)	((void)(x));
+#define heaplib_cond_broadcast(x) ((void)(x));
+#else
+/* One task: locks are never contended and nobody else frees memory */
+typedef int heaplib_lock_t;
+typedef int heaplib_cond_t;
+
+#define heaplib_lock_init(x) 	((void)(x));
+#define heaplib_lock_lock(x) 	((void)(x));
+#define heaplib_lock_unlock(x) 	((void)(x));
+__attribute__((always_inline)) __inline__ int
+heaplib_lock_trylock(heaplib_lock_t * x) {
+	(void)x;
+	return 0;
 }
 
+#define heaplib_cond_init(x)	((void)(x));
+#define heaplib_cond_broadcast(x) ((void)(x));
+#endif
+
 /* Debugging and printing */
 #ifdef DEBUG
 # define PRINTF( ... ) printf(__VA_ARGS__)
 #else
 # define PRINTF( ... )
 #endif
+/* Reports that were asked for, such as statistics dumps */
+#define REPORTF( ... ) printf(__VA_ARGS__)
 
 /* Scheduling */
 #define SCHEDULE_TASK(x) /* Nothing to do on Linux */
 #define YIELD() yield();
-#define GET_PLATFORM_TASKID() (task_t)nil
+#define GET_PLATFORM_TASKID() ((task_t)task_current())
+
+/* Cache geometry; line size of RV32 cores */
+#define HEAPLIB_CACHELINE 32
+
+/* Per-thread state for latency statistics. Tasks have no thread-local
+ * storage, so every task shares one slot and a preempted update may rarely
+ * be lost.
+ */
+#define PLATFORM_THREAD_LOCAL
+#define PLATFORM_STATS_THREADS 1
+
+/* Timestamps for latency statistics, in core cycles */
+#define PLATFORM_CLOCK_HZ 100000000ULL
+__attribute__((always_inline)) __inline__ uint64_t
+platform_clock(void) {
+	uint32_t h;
+	uint32_t l;
+	uint32_t x;
+
+	/* Re-read if the low word wrapped between the two halves */
+	do {
+		__asm__ __volatile__("rdcycleh %0" : "=r"(h));
+		__asm__ __volatile__("rdcycle %0" : "=r"(l));
+		__asm__ __volatile__("rdcycleh %0" : "=r"(x));
+	}
+	while(h != x);
+
+	return ((uint64_t)h << 32) | l;
+}
 
 /* How many regions do we support? In the future, this will be dynamic */
-#define NREGIONS 1
+#if HEAPLIB_REGIONS
+# define NREGIONS HEAPLIB_REGIONS
+#else
+# define NREGIONS 1
+#endif
+
+/* Free nodes each Region can index for vector searches; beyond this the
+ * allocator walks the free list instead.
+ */
+#define PLATFORM_INDEX_MAX 256
+
+/* Page provider */
+extern size_t platform_page_size(void);
+extern vaddr_t platform_page_reserve(size_t);
+extern int platform_page_commit(vaddr_t, size_t);
+extern void platform_page_release(vaddr_t, size_t);
+extern void platform_page_decommit(vaddr_t, size_t);
+extern int platform_page_move(vaddr_t, vaddr_t, size_t);
+extern size_t platform_hugepage_size(void);
+extern vaddr_t platform_page_reserve_huge(size_t, boolean_t * );
+extern int platform_page_advise_huge(vaddr_t, size_t);
+
+/* Background tasks */
+extern int platform_task_start(void (*)(void * ), void * );
+extern void platform_sleep(unsigned int);
+extern unsigned long platform_time_ms(void);
+extern int platform_atexit(void (*)(void));
+#if HEAPLIB_LOCK != HEAPLIB_LOCK_NONE
+extern int platform_cond_wait(heaplib_cond_t *, heaplib_lock_t *, unsigned int);
+#endif
+
+/* Zeroing */
+extern void platform_zero_init(void);
+extern void platform_zero(vaddr_t, size_t);
 
+/* Vector search */
+extern void platform_search_init(void);
+extern size_t platform_search_first(const int32_t *, size_t, int32_t);
+extern size_t platform_search_best(const int32_t *, size_t, int32_t);
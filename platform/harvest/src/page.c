@@ -0,0 +1,106 @@
+/**
+ * \file platform/harvest/src/page.c
+ *
+ * \brief Page provider for harvest.
+ *
+ * There is no MMU to reserve address space with, so reservations are carved
+ * from the linker-provided heap area and commits always succeed. Only the
+ * most recent reservation can be handed back.
+ */
+#include "platform/platform.h"
+
+#define HARVEST_PAGESZ 4096
+
+extern uint8_t __heap_start[];
+extern uint8_t __heap_end[];
+
+static uint8_t * brk = nil;
+
+size_t
+platform_page_size(void)
+{
+	return HARVEST_PAGESZ;
+}
+
+vaddr_t
+platform_page_reserve(size_t sz)
+{
+	uint8_t * a;
+
+	if(!brk)
+		brk = (uint8_t * )(((size_t)__heap_start + HARVEST_PAGESZ - 1) &
+			~(HARVEST_PAGESZ - 1));
+
+	if(sz > (size_t)(__heap_end - brk))
+		return nil;
+
+	a = brk;
+	brk += sz;
+
+	return (vaddr_t)a;
+}
+
+/**
+ * \brief Committed pages must read back as zero, and reserved memory may
+ * have been used before, so clear it.
+ */
+int
+platform_page_commit(vaddr_t a, size_t sz)
+{
+	memset((void * )a, 0, sz);
+	return 0;
+}
+
+void
+platform_page_release(vaddr_t a, size_t sz)
+{
+	if((uint8_t * )a + sz == brk)
+		brk = (uint8_t * )a;
+}
+
+/**
+ * \brief Physical memory can't be handed back, so just clear it.
+ */
+void
+platform_page_decommit(vaddr_t a, size_t sz)
+{
+	memset((void * )a, 0, sz);
+}
+
+/**
+ * \brief There is no MMU to remap with; callers fall back to copying.
+ *
+ * \return -1, as nothing moved.
+ */
+int
+platform_page_move(vaddr_t a, vaddr_t b, size_t sz)
+{
+	USED(a);
+	USED(b);
+	USED(sz);
+	return -1;
+}
+
+/**
+ * \brief There are no huge pages without an MMU.
+ */
+size_t
+platform_hugepage_size(void)
+{
+	return 0;
+}
+
+vaddr_t
+platform_page_reserve_huge(size_t sz, boolean_t * pinned)
+{
+	*pinned = False;
+	return platform_page_reserve(sz);
+}
+
+int
+platform_page_advise_huge(vaddr_t a, size_t sz)
+{
+	USED(a);
+	USED(sz);
+	return -1;
+}
@@ -0,0 +1,57 @@
+/**
+ * \file platform/harvest/src/search.c
+ *
+ * \brief Free node index searches for harvest.
+ *
+ * RV32 cores here have no vector unit, so these are plain loops over the
+ * dense size array; still one load per node rather than a pointer chase.
+ */
+#include "platform/platform.h"
+
+void
+platform_search_init(void)
+{
+}
+
+/**
+ * \brief The first of 'n' sizes at 's' that is at least 'z', or 'n'.
+ */
+size_t
+platform_search_first(const int32_t * s, size_t n, int32_t z)
+{
+	size_t i;
+
+	for(i = 0; i < n; i++)
+	{
+		if(s[i] >= z)
+			return i;
+	}
+
+	return n;
+}
+
+/**
+ * \brief The smallest of 'n' sizes at 's' that is at least 'z', the first of
+ * them if several are equal, or 'n'.
+ */
+size_t
+platform_search_best(const int32_t * s, size_t n, int32_t z)
+{
+	size_t b;
+	size_t i;
+
+	b = n;
+	for(i = 0; i < n; i++)
+	{
+		if(s[i] >= z && (b == n || s[i] < s[b]))
+		{
+			b = i;
+
+			/* Nothing beats an exact fit */
+			if(s[i] == z)
+				break;
+		}
+	}
+
+	return b;
+}
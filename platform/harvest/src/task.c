@@ -0,0 +1,87 @@
+/**
+ * \file platform/harvest/src/task.c
+ *
+ * \brief Background tasks and sleeping for harvest.
+ *
+ * The scheduler's idle hook is expected to call heaplib_idle directly, so
+ * heaplib never creates tasks of its own here.
+ */
+#include "platform/platform.h"
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_UP
+/* Locks held, and whether interrupts were enabled before the first */
+uint32_t platform_irq_depth;
+uint32_t platform_irq_state;
+#endif
+
+int
+platform_task_start(void (*fn)(void * ), void * arg)
+{
+	USED(fn);
+	USED(arg);
+
+	return -1;
+}
+
+void
+platform_sleep(unsigned int ms)
+{
+	USED(ms);
+}
+
+unsigned long
+platform_time_ms(void)
+{
+	return sched_time_ms();
+}
+
+/**
+ * \brief Firmware never exits, so there is nothing to run at exit.
+ */
+int
+platform_atexit(void (*fn)(void))
+{
+	(void)fn;
+	return -1;
+}
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+/**
+ * \brief Sleep on the wait queue 'c', releasing 'm' meanwhile, for at
+ * most 'ms'. A timeout of ~0 sleeps until woken.
+ *
+ * \return Zero if woken, non-zero on timeout.
+ */
+int
+platform_cond_wait(heaplib_cond_t * c, heaplib_lock_t * m, unsigned int ms)
+{
+	return waitq_wait_mutex(c, m, ms);
+}
+#elif HEAPLIB_LOCK == HEAPLIB_LOCK_UP
+/**
+ * \brief Unmask interrupts and yield once, so whatever frees memory can run,
+ * then mask them as deeply as before.
+ *
+ * \return Zero; callers check for themselves whether memory turned up.
+ */
+int
+platform_cond_wait(heaplib_cond_t * c, heaplib_lock_t * m, unsigned int ms)
+{
+	uint32_t d;
+
+	(void)c;
+	(void)m;
+	USED(ms);
+
+	d = platform_irq_depth;
+	platform_irq_depth = 1;
+	platform_irq_unmask();
+
+	YIELD();
+
+	platform_irq_mask();
+	platform_irq_depth = d;
+
+	return 0;
+}
+#endif
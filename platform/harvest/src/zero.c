@@ -0,0 +1,41 @@
+/**
+ * \file platform/harvest/src/zero.c
+ *
+ * \brief Zeroing for harvest.
+ *
+ * RV32 cores here have neither vector units nor cache bypassing stores, so
+ * a word-at-a-time loop is as good as it gets.
+ */
+#include "platform/platform.h"
+
+void
+platform_zero_init(void)
+{
+}
+
+/**
+ * \brief Clear 'sz' bytes at 'a'.
+ */
+void
+platform_zero(vaddr_t a, size_t sz)
+{
+	uint8_t * p;
+	uint8_t * e;
+
+	p = (uint8_t * )a;
+	e = p + sz;
+
+	while(p < e && ((size_t)p & (sizeof(size_t) - 1)))
+		*p++ = 0;
+
+	for(; p + (4 * sizeof(size_t)) <= e; p += 4 * sizeof(size_t))
+	{
+		((size_t * )p)[0] = 0;
+		((size_t * )p)[1] = 0;
+		((size_t * )p)[2] = 0;
+		((size_t * )p)[3] = 0;
+	}
+
+	while(p < e)
+		*p++ = 0;
+}
@@ -8,9 +8,13 @@
  */
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #define _GNU_SOURCE
 #include <pthread.h>
 
+#include "heaplib/config.h"
+
 /* OS primitives */
 enum
 {
@@ -28,7 +32,9 @@ typedef int boolean_t;
 typedef pthread_t task_t;
 typedef volatile size_t * vaddr_t;
 typedef volatile uint8_t * vbaddr_t;
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
 typedef pthread_mutex_t heaplib_lock_t;
+typedef pthread_cond_t heaplib_cond_t;
 
 /* Locking primitives */
 #define heaplib_lock_init(x) 	pthread_mutex_init((x), nil);
@@ -36,24 +42,109 @@ typedef pthread_mutex_t heaplib_lock_t;
 #define heaplib_lock_unlock(x) 	pthread_mutex_unlock((x));
 __attribute__((always_inline)) __inline__ int
 heaplib_lock_trylock(heaplib_lock_t * x) {
-	return pthread_mutex_lock(x);
+	return pthread_mutex_trylock(x);
+}
+
+/* Waiting for memory */
+#define heaplib_cond_init(x)	platform_cond_init((x));
+#define heaplib_cond_broadcast(x) pthread_cond_broadcast((x));
+#elif HEAPLIB_LOCK == HEAPLIB_LOCK_NONE
+/* One thread: locks are never contended and nobody else frees memory */
+typedef int heaplib_lock_t;
+typedef int heaplib_cond_t;
+
+#define heaplib_lock_init(x) 	((void)(x));
+#define heaplib_lock_lock(x) 	((void)(x));
+#define heaplib_lock_unlock(x) 	((void)(x));
+__attribute__((always_inline)) __inline__ int
+heaplib_lock_trylock(heaplib_lock_t * x) {
+	(void)x;
+	return 0;
 }
 
+#define heaplib_cond_init(x)	((void)(x));
+#define heaplib_cond_broadcast(x) ((void)(x));
+#else
+# error "threads can't be serialized by masking interrupts on Linux"
+#endif
+
 /* Debugging and printing */
 #ifdef DEBUG
 # define PRINTF( ... ) thread_printf(__VA_ARGS__)
 #else
 # define PRINTF( ... )
 #endif
+/* Reports that were asked for, such as statistics dumps */
+#define REPORTF( ... ) thread_printf(__VA_ARGS__)
 
 /* Scheduling */
 #define SCHEDULE_TASK(x) /* Nothing to do on Linux */
 #define YIELD() platform_yield();
-#define GET_PLATFORM_TASKID() (task_t)nil
+#define GET_PLATFORM_TASKID() ((task_t)pthread_self())
+
+/* Cache geometry; line size of x86-64 and AArch64 cores */
+#define HEAPLIB_CACHELINE 64
+
+/* Clear buffers this large with non-temporal stores; about the size of L2 */
+#define PLATFORM_ZERO_NT_THRESHOLD (1024 * 1024)
+
+/* Per-thread state for latency statistics; threads beyond the limit share
+ * the last slot.
+ */
+#define PLATFORM_THREAD_LOCAL __thread
+#define PLATFORM_STATS_THREADS 64
+
+/* Timestamps for latency statistics, in nanoseconds */
+#define PLATFORM_CLOCK_HZ 1000000000ULL
+__attribute__((always_inline)) __inline__ uint64_t
+platform_clock(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
 
 /* How many regions do we support? In the future, this will be dynamic */
-#define NREGIONS 4
+#if HEAPLIB_REGIONS
+# define NREGIONS HEAPLIB_REGIONS
+#else
+# define NREGIONS 4
+#endif
+
+/* Free nodes each Region can index for vector searches; beyond this the
+ * allocator walks the free list instead.
+ */
+#define PLATFORM_INDEX_MAX 4096
 
 extern void platform_yield(void);
 extern void thread_printf(const char *, ... );
 
+/* Page provider */
+extern size_t platform_page_size(void);
+extern vaddr_t platform_page_reserve(size_t);
+extern int platform_page_commit(vaddr_t, size_t);
+extern void platform_page_release(vaddr_t, size_t);
+extern void platform_page_decommit(vaddr_t, size_t);
+extern int platform_page_move(vaddr_t, vaddr_t, size_t);
+extern size_t platform_hugepage_size(void);
+extern vaddr_t platform_page_reserve_huge(size_t, boolean_t * );
+extern int platform_page_advise_huge(vaddr_t, size_t);
+
+/* Background tasks */
+extern int platform_task_start(void (*)(void * ), void * );
+extern void platform_sleep(unsigned int);
+extern unsigned long platform_time_ms(void);
+extern int platform_atexit(void (*)(void));
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+extern void platform_cond_init(heaplib_cond_t * );
+extern int platform_cond_wait(heaplib_cond_t *, heaplib_lock_t *, unsigned int);
+#endif
+
+/* Zeroing */
+extern void platform_zero_init(void);
+extern void platform_zero(vaddr_t, size_t);
+
+/* Vector search */
+extern void platform_search_init(void);
+extern size_t platform_search_first(const int32_t *, size_t, int32_t);
+extern size_t platform_search_best(const int32_t *, size_t, int32_t);
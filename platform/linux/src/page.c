@@ -0,0 +1,194 @@
+/**
+ * \file platform/linux/src/page.c
+ *
+ * \brief Page provider for Linux.
+ *
+ * Reserve address space without backing it, then commit pages as a Region
+ * grows. Committed anonymous pages are zero filled by the kernel on first
+ * touch, and decommitted pages read back as zero.
+ *
+ * Huge page reservations try the hugetlbfs pool first and fall back to
+ * transparent huge pages when the pool is empty or not configured.
+ */
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "platform/platform.h"
+
+size_t
+platform_page_size(void)
+{
+	static size_t p;
+
+	if(!p)
+		p = (size_t)sysconf(_SC_PAGESIZE);
+
+	return p;
+}
+
+vaddr_t
+platform_page_reserve(size_t sz)
+{
+	void * a;
+
+	a = mmap(nil, sz, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(a == MAP_FAILED)
+		return nil;
+
+	return (vaddr_t)a;
+}
+
+int
+platform_page_commit(vaddr_t a, size_t sz)
+{
+	return mprotect((void * )a, sz, PROT_READ | PROT_WRITE);
+}
+
+void
+platform_page_release(vaddr_t a, size_t sz)
+{
+	munmap((void * )a, sz);
+}
+
+/**
+ * \brief Drop the contents of committed pages.
+ *
+ * The pages stay mapped and read back as zero; the kernel reclaims the
+ * memory behind them.
+ */
+void
+platform_page_decommit(vaddr_t a, size_t sz)
+{
+	madvise((void * )a, sz, MADV_DONTNEED);
+}
+
+/**
+ * \brief Move committed pages to another reserved address without copying.
+ *
+ * mremap leaves a hole where the pages were, so the source is reserved
+ * again afterward.
+ *
+ * \return 0 on success, -1 if nothing moved, or 1 if the pages moved but
+ * the source couldn't be reserved again. Another mapping may then take its
+ * place, so it must never be used again.
+ */
+int
+platform_page_move(vaddr_t a, vaddr_t b, size_t sz)
+{
+	void * x;
+
+	x = mremap((void * )a, sz, sz, MREMAP_MAYMOVE | MREMAP_FIXED,
+		(void * )b);
+	if(x == MAP_FAILED)
+		return -1;
+
+	x = mmap((void * )a, sz, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	if(x == MAP_FAILED)
+		return 1;
+
+	return 0;
+}
+
+/**
+ * \brief The default huge page size, or zero if there isn't one.
+ */
+size_t
+platform_hugepage_size(void)
+{
+	static size_t h = (size_t)~0;
+	unsigned long k;
+	char b[128];
+	FILE * f;
+
+	if(h != (size_t)~0)
+		return h;
+
+	h = 0;
+	f = fopen("/proc/meminfo", "r");
+	if(!f)
+		return h;
+
+	while(fgets(b, sizeof b, f))
+	{
+		if(sscanf(b, "Hugepagesize: %lu kB", &k) == 1)
+		{
+			h = (size_t)k * 1024;
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return h;
+}
+
+/**
+ * \brief Reserve 'sz' bytes, a multiple of the huge page size, backed by
+ * huge pages.
+ *
+ * \param pinned [out] True if the memory came from the hugetlbfs pool. It is
+ * then already committed, and can only be released as a whole.
+ */
+vaddr_t
+platform_page_reserve_huge(size_t sz, boolean_t * pinned)
+{
+	uint8_t * a;
+	uint8_t * b;
+	size_t h;
+
+	*pinned = False;
+
+	h = platform_hugepage_size();
+	if(!h || (sz & (h - 1)))
+		return nil;
+
+	a = mmap(nil, sz, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(a != MAP_FAILED)
+	{
+		*pinned = True;
+		return (vaddr_t)a;
+	}
+
+	/* Over-reserve so the range can be aligned to a huge page */
+	a = mmap(nil, sz + h, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(a == MAP_FAILED)
+		return nil;
+
+	b = (uint8_t * )(((size_t)a + h - 1) & ~(h - 1));
+	if(b != a)
+		munmap(a, b - a);
+	munmap(b + sz, (a + sz + h) - (b + sz));
+
+	/* Without THP the memory is still usable with small pages */
+	platform_page_advise_huge((vaddr_t)b, sz);
+
+	return (vaddr_t)b;
+}
+
+/**
+ * \brief Ask for transparent huge pages over the aligned interior of a range.
+ */
+int
+platform_page_advise_huge(vaddr_t a, size_t sz)
+{
+	size_t h;
+	size_t s;
+	size_t e;
+
+	h = platform_hugepage_size();
+	if(!h)
+		return -1;
+
+	s = ((size_t)a + h - 1) & ~(h - 1);
+	e = ((size_t)a + sz) & ~(h - 1);
+	if(e <= s)
+		return -1;
+
+	return madvise((void * )s, e - s, MADV_HUGEPAGE);
+}
@@ -0,0 +1,280 @@
+/**
+ * \file platform/linux/src/search.c
+ *
+ * \brief Vector search kernels for Linux.
+ *
+ * Free node indexes keep their sizes in a dense array of signed 32-bit
+ * words, so a search compares a whole vector of sizes at once rather than
+ * chasing one link per node. INT32_MAX is reserved to mean "doesn't fit",
+ * so stored sizes must be below it. The widest kernel the CPU supports is
+ * picked once by platform_search_init.
+ */
+#include "platform/platform.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+static size_t __search_first_scalar(const int32_t *, size_t, int32_t);
+static size_t __search_best_scalar(const int32_t *, size_t, int32_t);
+#if defined(__x86_64__) || defined(__i386__)
+static size_t __search_first_sse2(const int32_t *, size_t, int32_t);
+static size_t __search_best_sse2(const int32_t *, size_t, int32_t);
+static size_t __search_first_avx2(const int32_t *, size_t, int32_t);
+static size_t __search_best_avx2(const int32_t *, size_t, int32_t);
+#endif
+
+static size_t (*search_first)(const int32_t *, size_t, int32_t) =
+	__search_first_scalar;
+static size_t (*search_best)(const int32_t *, size_t, int32_t) =
+	__search_best_scalar;
+
+/**
+ * \brief Select the search kernels for this CPU.
+ */
+void
+platform_search_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2"))
+	{
+		search_first = __search_first_avx2;
+		search_best = __search_best_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		search_first = __search_first_sse2;
+		search_best = __search_best_sse2;
+	}
+#endif
+}
+
+/**
+ * \brief The first of 'n' sizes at 's' that is at least 'z', or 'n'.
+ */
+size_t
+platform_search_first(const int32_t * s, size_t n, int32_t z)
+{
+	return search_first(s, n, z);
+}
+
+/**
+ * \brief The smallest of 'n' sizes at 's' that is at least 'z', the first of
+ * them if several are equal, or 'n'.
+ */
+size_t
+platform_search_best(const int32_t * s, size_t n, int32_t z)
+{
+	return search_best(s, n, z);
+}
+
+static size_t
+__search_first_scalar(const int32_t * s, size_t n, int32_t z)
+{
+	size_t i;
+
+	for(i = 0; i < n; i++)
+	{
+		if(s[i] >= z)
+			return i;
+	}
+
+	return n;
+}
+
+static size_t
+__search_best_scalar(const int32_t * s, size_t n, int32_t z)
+{
+	size_t b;
+	size_t i;
+
+	b = n;
+	for(i = 0; i < n; i++)
+	{
+		if(s[i] >= z && (b == n || s[i] < s[b]))
+		{
+			b = i;
+
+			/* Nothing beats an exact fit */
+			if(s[i] == z)
+				break;
+		}
+	}
+
+	return b;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static size_t
+__search_first_sse2(const int32_t * s, size_t n, int32_t z)
+{
+	__m128i k;
+	size_t i;
+	int m;
+
+	/* Sizes are never negative, so z - 1 can't wrap for z >= 1 */
+	k = _mm_set1_epi32(z - 1);
+	for(i = 0; i + 8 <= n; i += 8)
+	{
+		m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+			_mm_loadu_si128((const __m128i * )(s + i)), k)));
+		m |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+			_mm_loadu_si128((const __m128i * )(s + i + 4)), k))) << 4;
+		if(m)
+			return i + __builtin_ctz(m);
+	}
+
+	return i + __search_first_scalar(s + i, n - i, z);
+}
+
+/**
+ * \brief Lanes of 'a' where 'm' is set, and of 'b' elsewhere.
+ */
+static __inline__ __m128i
+__search_blend_sse2(__m128i m, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+static size_t
+__search_best_sse2(const int32_t * s, size_t n, int32_t z)
+{
+	int32_t bv[4];
+	int32_t bi[4];
+	__m128i none;
+	__m128i best;
+	__m128i four;
+	__m128i idx;
+	__m128i at;
+	__m128i v;
+	__m128i m;
+	__m128i k;
+	size_t b;
+	size_t i;
+	int j;
+
+	k = _mm_set1_epi32(z - 1);
+	none = _mm_set1_epi32(INT32_MAX);
+	four = _mm_set1_epi32(4);
+	best = none;
+	at = _mm_setzero_si128();
+	idx = _mm_setr_epi32(0, 1, 2, 3);
+
+	for(i = 0; i + 4 <= n && i + 4 <= INT32_MAX; i += 4)
+	{
+		v = _mm_loadu_si128((const __m128i * )(s + i));
+
+		/* Sizes that don't fit can't win */
+		v = __search_blend_sse2(_mm_cmpgt_epi32(v, k), v, none);
+
+		/* Strictly smaller only, so each lane keeps its first */
+		m = _mm_cmpgt_epi32(best, v);
+		best = __search_blend_sse2(m, v, best);
+		at = __search_blend_sse2(m, idx, at);
+		idx = _mm_add_epi32(idx, four);
+	}
+
+	_mm_storeu_si128((__m128i * )bv, best);
+	_mm_storeu_si128((__m128i * )bi, at);
+
+	b = n;
+	for(j = 0; j < 4; j++)
+	{
+		if(bv[j] == INT32_MAX)
+			continue;
+
+		if(b == n || bv[j] < s[b] || (bv[j] == s[b] && (size_t)bi[j] < b))
+			b = (size_t)bi[j];
+	}
+
+	/* The tail can only win with something strictly smaller */
+	for(; i < n; i++)
+	{
+		if(s[i] >= z && (b == n || s[i] < s[b]))
+			b = i;
+	}
+
+	return b;
+}
+
+__attribute__((target("avx2"))) static size_t
+__search_first_avx2(const int32_t * s, size_t n, int32_t z)
+{
+	__m256i k;
+	size_t i;
+	int m;
+
+	k = _mm256_set1_epi32(z - 1);
+	for(i = 0; i + 16 <= n; i += 16)
+	{
+		m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(
+			_mm256_loadu_si256((const __m256i * )(s + i)), k)));
+		m |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(
+			_mm256_loadu_si256((const __m256i * )(s + i + 8)), k)))
+			<< 8;
+		if(m)
+			return i + __builtin_ctz(m);
+	}
+
+	return i + __search_first_scalar(s + i, n - i, z);
+}
+
+__attribute__((target("avx2"))) static size_t
+__search_best_avx2(const int32_t * s, size_t n, int32_t z)
+{
+	int32_t bv[8];
+	int32_t bi[8];
+	__m256i none;
+	__m256i best;
+	__m256i eight;
+	__m256i idx;
+	__m256i at;
+	__m256i v;
+	__m256i m;
+	__m256i k;
+	size_t b;
+	size_t i;
+	int j;
+
+	k = _mm256_set1_epi32(z - 1);
+	none = _mm256_set1_epi32(INT32_MAX);
+	eight = _mm256_set1_epi32(8);
+	best = none;
+	at = _mm256_setzero_si256();
+	idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	for(i = 0; i + 8 <= n && i + 8 <= INT32_MAX; i += 8)
+	{
+		v = _mm256_loadu_si256((const __m256i * )(s + i));
+		v = _mm256_blendv_epi8(none, v, _mm256_cmpgt_epi32(v, k));
+
+		m = _mm256_cmpgt_epi32(best, v);
+		best = _mm256_blendv_epi8(best, v, m);
+		at = _mm256_blendv_epi8(at, idx, m);
+		idx = _mm256_add_epi32(idx, eight);
+	}
+
+	_mm256_storeu_si256((__m256i * )bv, best);
+	_mm256_storeu_si256((__m256i * )bi, at);
+
+	b = n;
+	for(j = 0; j < 8; j++)
+	{
+		if(bv[j] == INT32_MAX)
+			continue;
+
+		if(b == n || bv[j] < s[b] || (bv[j] == s[b] && (size_t)bi[j] < b))
+			b = (size_t)bi[j];
+	}
+
+	for(; i < n; i++)
+	{
+		if(s[i] >= z && (b == n || s[i] < s[b]))
+			b = i;
+	}
+
+	return b;
+}
+#endif
@@ -0,0 +1,399 @@
+/**
+ * \file platform/linux/src/shim.c
+ *
+ * \brief The C allocator on top of heaplib, for obj/libheaplib.so.
+ *
+ * Loaded with LD_PRELOAD, malloc, calloc, realloc, free, posix_memalign,
+ * aligned_alloc and malloc_usable_size of an unmodified program come from
+ * heaplib, along with memalign, valloc and pvalloc, which glibc needs
+ * replaced alongside them.
+ *
+ * The first allocation sets heaplib up: a large object space for requests
+ * from SHIM_LARGE_THRESHOLD bytes, and one reserved Region that grows as it
+ * is used. Another Region is reserved whenever a request finds every Region
+ * busy or full, up to NREGIONS, so threads spread across them.
+ *
+ * This file is never built into the objects in obj, which the tests link
+ * against. Build without DEBUG: debug text is printed through stdio, which
+ * allocates.
+ */
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <errno.h>
+
+#include "heaplib/heaplib.h"
+
+/* Address space reserved for each Region; pages are committed as it fills */
+#ifndef SHIM_REGION_RESERVE
+# define SHIM_REGION_RESERVE ((size_t)1 << 30)
+#endif
+
+/* Bytes each Region commits up front */
+#ifndef SHIM_REGION_COMMIT
+# define SHIM_REGION_COMMIT ((size_t)1 << 20)
+#endif
+
+/* Address space reserved for large objects */
+#ifndef SHIM_LARGE_RESERVE
+# define SHIM_LARGE_RESERVE \
+	(sizeof(size_t) > 4 ? (size_t)16 << 30 : (size_t)256 << 20)
+#endif
+
+/* Requests of at least this many bytes are given whole pages */
+#ifndef SHIM_LARGE_THRESHOLD
+# define SHIM_LARGE_THRESHOLD (256 * 1024)
+#endif
+
+/* Frees find their node directly from the pointer rather than walking the
+ * Region, as the C library's free is expected to be O(1). The price is
+ * integrity checking: only the freed node's own header is checked, and as
+ * no idle task runs here, nothing scrubs the Region either. Corruption
+ * elsewhere goes unnoticed until an allocation or coalesce runs into it.
+ */
+#define SHIM_REGION_FLAGS heaplib_flags_direct
+
+struct
+shim_t
+{
+	pthread_mutex_t lock;
+	boolean_t ready;
+	int nregions;
+};
+
+static struct shim_t shim = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * \brief Set heaplib up, once, for whichever thread allocates first.
+ *
+ * Constructors of other libraries may allocate before ours runs, so this
+ * is done on demand instead.
+ */
+static void
+__shim_start(void)
+{
+	pthread_mutex_lock(&shim.lock);
+
+	if(!shim.ready)
+	{
+		heaplib_init();
+
+		/* Without it, large requests are served by the Regions */
+		heaplib_large_init(SHIM_LARGE_RESERVE, SHIM_LARGE_THRESHOLD);
+
+		if(heaplib_region_reserve(nil, SHIM_REGION_RESERVE,
+		    SHIM_REGION_COMMIT, SHIM_REGION_FLAGS) == heaplib_error_none)
+			shim.nregions = 1;
+
+		__atomic_store_n(&shim.ready, True, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&shim.lock);
+}
+
+/**
+ * \brief Reserve another Region, unless one was added since there were 'n'.
+ *
+ * \return Whether there are more Regions to try than there were.
+ */
+static boolean_t
+__shim_grow(int n)
+{
+	boolean_t r;
+
+	pthread_mutex_lock(&shim.lock);
+
+	if(shim.nregions == n && n < NREGIONS &&
+	   heaplib_region_reserve(nil, SHIM_REGION_RESERVE, SHIM_REGION_COMMIT,
+	    SHIM_REGION_FLAGS) == heaplib_error_none)
+	{
+		__atomic_store_n(&shim.nregions, n + 1, __ATOMIC_RELEASE);
+	}
+
+	r = shim.nregions != n;
+
+	pthread_mutex_unlock(&shim.lock);
+
+	return r;
+}
+
+/**
+ * \brief Allocate 'z' bytes with flags 'f'.
+ *
+ * Busy Regions are skipped while another can still be added. Once every
+ * Region is in place, the request waits for their locks. heaplib refuses
+ * empty requests, so those take a byte to get a unique pointer.
+ */
+static void *
+__shim_alloc(size_t z, heaplib_flags_t f)
+{
+	vaddr_t v;
+	int n;
+
+	if(!__atomic_load_n(&shim.ready, __ATOMIC_ACQUIRE))
+		__shim_start();
+
+	if(z == 0)
+		z = 1;
+
+	do {
+		n = __atomic_load_n(&shim.nregions, __ATOMIC_ACQUIRE);
+		if(heaplib_calloc(&v, 1, z, f | heaplib_flags_nowait) ==
+		    heaplib_error_none)
+			return (void * )v;
+	}
+	while(__shim_grow(n));
+
+	if(heaplib_calloc(&v, 1, z, f) == heaplib_error_none)
+		return (void * )v;
+
+	errno = ENOMEM;
+	return nil;
+}
+
+/**
+ * \brief Allocate 'z' bytes aligned to 'a', a power of two.
+ *
+ * Large objects are page aligned already. Anything else asks for natural
+ * alignment, which aligns a payload to its own size, so the size is raised
+ * to a power of two of at least 'a'.
+ */
+static void *
+__shim_aligned(size_t a, size_t z)
+{
+	void * p;
+	size_t n;
+
+	if(a <= HEAPLIB_CHUNKSZ)
+		return __shim_alloc(z, 0);
+
+	if(a <= platform_page_size() && z >= SHIM_LARGE_THRESHOLD)
+	{
+		/* The large space may be full, leaving it to a Region */
+		p = __shim_alloc(z, 0);
+		if(!p || ((size_t)p & (a - 1)) == 0)
+			return p;
+
+		free(p);
+	}
+
+	for(n = a; n < z; n <<= 1)
+	{
+		if(n > ((size_t)~0 >> 1))
+		{
+			errno = ENOMEM;
+			return nil;
+		}
+	}
+
+	return __shim_alloc(n, heaplib_flags_natural);
+}
+
+/**
+ * \brief Usable bytes at 'p', or zero if heaplib didn't allocate it.
+ */
+static size_t
+__shim_usable(void * p)
+{
+	heaplib_node_t * n;
+
+	if(__heaplib_large_within((vaddr_t)p))
+		return __heaplib_large_size((vaddr_t)p);
+
+	if(__heaplib_region_index((vaddr_t)p) == NREGIONS)
+		return 0;
+
+	n = (heaplib_node_t * )((vbaddr_t)p - sizeof(heaplib_node_t));
+	if(n->magic != HEAPLIB_NODE_MAGIC || !heaplib_node_active(n))
+		return 0;
+
+	return heaplib_node_usable(n);
+}
+
+/**
+ * \brief malloc(3). Memory is cleared, as all of heaplib's is.
+ */
+void *
+malloc(size_t z)
+{
+	return __shim_alloc(z, 0);
+}
+
+/**
+ * \brief calloc(3).
+ */
+void *
+calloc(size_t x, size_t y)
+{
+	size_t z;
+
+	if(__builtin_mul_overflow(x, y, &z))
+	{
+		errno = ENOMEM;
+		return nil;
+	}
+
+	return __shim_alloc(z, 0);
+}
+
+/**
+ * \brief free(3). Pointers heaplib didn't allocate are ignored, such as
+ * those the dynamic loader allocated before the shim was bound.
+ */
+void
+free(void * p)
+{
+	vaddr_t v;
+
+	if(!p)
+		return;
+
+	v = (vaddr_t)p;
+	heaplib_free(&v, 0);
+}
+
+/**
+ * \brief realloc(3).
+ *
+ * Large objects are remapped by heaplib. Other allocations shrink in place
+ * and move when they grow.
+ */
+void *
+realloc(void * p, size_t z)
+{
+	vaddr_t v;
+	size_t o;
+	void * q;
+
+	if(!p)
+		return malloc(z);
+
+	if(z == 0)
+	{
+		free(p);
+		return nil;
+	}
+
+	if(__heaplib_large_within((vaddr_t)p) && __heaplib_large_want(z, 0))
+	{
+		v = (vaddr_t)p;
+		if(heaplib_realloc(&v, z, 0) == heaplib_error_none)
+			return (void * )v;
+
+		errno = ENOMEM;
+		return nil;
+	}
+
+	o = __shim_usable(p);
+	if(o == 0)
+	{
+		errno = EINVAL;
+		return nil;
+	}
+
+	if(z <= o && !__heaplib_large_within((vaddr_t)p))
+		return p;
+
+	q = malloc(z);
+	if(!q)
+		return nil;
+
+	memcpy(q, p, o < z ? o : z);
+	free(p);
+
+	return q;
+}
+
+/**
+ * \brief posix_memalign(3).
+ */
+int
+posix_memalign(void ** pp, size_t a, size_t z)
+{
+	void * p;
+
+	if(a < sizeof(void * ) || (a & (a - 1)) != 0)
+		return EINVAL;
+
+	p = __shim_aligned(a, z);
+	if(!p)
+		return ENOMEM;
+
+	*pp = p;
+	return 0;
+}
+
+/**
+ * \brief aligned_alloc(3).
+ */
+void *
+aligned_alloc(size_t a, size_t z)
+{
+	if(a == 0 || (a & (a - 1)) != 0)
+	{
+		errno = EINVAL;
+		return nil;
+	}
+
+	return __shim_aligned(a, z);
+}
+
+/**
+ * \brief memalign(3). Like glibc, 'a' is raised to a power of two.
+ */
+void *
+memalign(size_t a, size_t z)
+{
+	size_t n;
+
+	for(n = 1; n < a; n <<= 1)
+	{
+		if(n > ((size_t)~0 >> 1))
+		{
+			errno = EINVAL;
+			return nil;
+		}
+	}
+
+	return __shim_aligned(n, z);
+}
+
+/**
+ * \brief valloc(3).
+ */
+void *
+valloc(size_t z)
+{
+	return __shim_aligned(platform_page_size(), z);
+}
+
+/**
+ * \brief pvalloc(3).
+ */
+void *
+pvalloc(size_t z)
+{
+	size_t p;
+
+	p = platform_page_size();
+	if(z > ((size_t)~0 - p))
+	{
+		errno = ENOMEM;
+		return nil;
+	}
+
+	return __shim_aligned(p, (z + p - 1) & ~(p - 1));
+}
+
+/**
+ * \brief malloc_usable_size(3).
+ */
+size_t
+malloc_usable_size(void * p)
+{
+	if(!p)
+		return 0;
+
+	return __shim_usable(p);
+}
@@ -0,0 +1,119 @@
+/**
+ * \file platform/linux/src/task.c
+ *
+ * \brief Background tasks and sleeping for Linux.
+ */
+#include <unistd.h>
+#include <time.h>
+
+#include "platform/platform.h"
+
+struct
+platform_task_t
+{
+	void (*fn)(void * );
+	void * arg;
+};
+
+static void *
+__platform_task(void * a)
+{
+	struct platform_task_t t;
+
+	t = *(struct platform_task_t * )a;
+	free(a);
+
+	t.fn(t.arg);
+
+	return nil;
+}
+
+/**
+ * \brief Run 'fn' with 'arg' in a detached thread.
+ */
+int
+platform_task_start(void (*fn)(void * ), void * arg)
+{
+	struct platform_task_t * t;
+	pthread_t p;
+
+	t = malloc(sizeof(*t));
+	if(!t)
+		return -1;
+
+	t->fn = fn;
+	t->arg = arg;
+
+	if(pthread_create(&p, nil, __platform_task, t) != 0)
+	{
+		free(t);
+		return -1;
+	}
+
+	pthread_detach(p);
+
+	return 0;
+}
+
+void
+platform_sleep(unsigned int ms)
+{
+	usleep(ms * 1000);
+}
+
+unsigned long
+platform_time_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+int
+platform_atexit(void (*fn)(void))
+{
+	return atexit(fn);
+}
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_SMP
+/**
+ * \brief Condition variables time out against the monotonic clock.
+ */
+void
+platform_cond_init(heaplib_cond_t * c)
+{
+	pthread_condattr_t a;
+
+	pthread_condattr_init(&a);
+	pthread_condattr_setclock(&a, CLOCK_MONOTONIC);
+	pthread_cond_init(c, &a);
+	pthread_condattr_destroy(&a);
+}
+
+/**
+ * \brief Sleep on 'c', releasing 'm' meanwhile, for at most 'ms'. A
+ * timeout of ~0 sleeps until woken.
+ *
+ * \return Zero if woken, non-zero on timeout.
+ */
+int
+platform_cond_wait(heaplib_cond_t * c, heaplib_lock_t * m, unsigned int ms)
+{
+	struct timespec t;
+
+	if(ms == (unsigned int)~0)
+		return pthread_cond_wait(c, m);
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (long)(ms % 1000) * 1000000;
+	if(t.tv_nsec >= 1000000000)
+	{
+		t.tv_sec += 1;
+		t.tv_nsec -= 1000000000;
+	}
+
+	return pthread_cond_timedwait(c, m, &t);
+}
+#endif
@@ -0,0 +1,122 @@
+/**
+ * \file platform/linux/src/zero.c
+ *
+ * \brief Zeroing kernels for Linux.
+ *
+ * Small and medium buffers go to memset, which the C library already
+ * vectorizes. Buffers at or above PLATFORM_ZERO_NT_THRESHOLD are cleared
+ * with non-temporal stores instead, so clearing them doesn't evict the
+ * caller's working set from the cache. The widest kernel the CPU supports is
+ * picked once by platform_zero_init.
+ */
+#include "platform/platform.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
+
+static void __zero_memset(vaddr_t, size_t);
+#if defined(__x86_64__) || defined(__i386__)
+static void __zero_stream_sse2(vaddr_t, size_t);
+static void __zero_stream_avx2(vaddr_t, size_t);
+#endif
+
+static void (*zero_stream)(vaddr_t, size_t) = __zero_memset;
+
+/**
+ * \brief Select the non-temporal kernel for this CPU.
+ */
+void
+platform_zero_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2"))
+		zero_stream = __zero_stream_avx2;
+	else if(__builtin_cpu_supports("sse2"))
+		zero_stream = __zero_stream_sse2;
+#endif
+}
+
+/**
+ * \brief Clear 'sz' bytes at 'a'.
+ */
+void
+platform_zero(vaddr_t a, size_t sz)
+{
+	if(sz >= PLATFORM_ZERO_NT_THRESHOLD)
+		zero_stream(a, sz);
+	else
+		memset((void * )a, 0, sz);
+}
+
+static void
+__zero_memset(vaddr_t a, size_t sz)
+{
+	memset((void * )a, 0, sz);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static void
+__zero_stream_sse2(vaddr_t a, size_t sz)
+{
+	uint8_t * p;
+	uint8_t * e;
+	size_t d;
+	__m128i z;
+
+	p = (uint8_t * )a;
+	e = p + sz;
+
+	/* Streaming stores need 16 byte alignment */
+	d = (16 - ((size_t)p & 15)) & 15;
+	memset(p, 0, d);
+	p += d;
+
+	z = _mm_setzero_si128();
+	for(; p + 64 <= e; p += 64)
+	{
+		_mm_stream_si128((__m128i * )(p + 0), z);
+		_mm_stream_si128((__m128i * )(p + 16), z);
+		_mm_stream_si128((__m128i * )(p + 32), z);
+		_mm_stream_si128((__m128i * )(p + 48), z);
+	}
+
+	/* Streaming stores are weakly ordered; publish them before the
+	 * memory is handed out.
+	 */
+	_mm_sfence();
+
+	memset(p, 0, e - p);
+}
+
+__attribute__((target("avx2"))) static void
+__zero_stream_avx2(vaddr_t a, size_t sz)
+{
+	uint8_t * p;
+	uint8_t * e;
+	size_t d;
+	__m256i z;
+
+	p = (uint8_t * )a;
+	e = p + sz;
+
+	d = (32 - ((size_t)p & 31)) & 31;
+	memset(p, 0, d);
+	p += d;
+
+	z = _mm256_setzero_si256();
+	for(; p + 128 <= e; p += 128)
+	{
+		_mm256_stream_si256((__m256i * )(p + 0), z);
+		_mm256_stream_si256((__m256i * )(p + 32), z);
+		_mm256_stream_si256((__m256i * )(p + 64), z);
+		_mm256_stream_si256((__m256i * )(p + 96), z);
+	}
+
+	_mm_sfence();
+
+	memset(p, 0, e - p);
+}
+#endif
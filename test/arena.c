@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 8
+#define NREQUESTS 2000
+
+#define MEMSZ (4 * 1024 * 1024)
+#define SRAMSZ (1024 * 1024)
+
+#define ARENASZ (16 * 1024)
+
+static heaplib_region_t * sram;
+static boolean_t failed = False;
+static int requests;
+static int objects;
+
+static void * run(void * );
+
+/**
+ * \brief Every byte of 'v' must be zero.
+ */
+static boolean_t
+zero(vaddr_t v, size_t z)
+{
+	uint8_t * p;
+	size_t i;
+
+	p = (uint8_t * )v;
+	for(i = 0; i < z; i++)
+	{
+		if(p[i])
+			return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	heaplib_region_t * h;
+	heaplib_arena_t * a;
+	vaddr_t x;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_reserve(&sram, SRAMSZ, SRAMSZ, heaplib_flags_internal) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve regions\n");
+		return 1;
+	}
+
+	/* An arena hands out exactly what it was created with */
+	if(heaplib_arena_create(&a, nil, 64, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't create arena\n");
+		return 1;
+	}
+
+	for(i = 0; i < 8; i++)
+	{
+		if(heaplib_arena_calloc(a, &x, 1, 8) != heaplib_error_none)
+		{
+			PRINTF("error: arena short at %d\n", i);
+			return 1;
+		}
+	}
+
+	if(heaplib_arena_calloc(a, &x, 1, 1) != heaplib_error_again ||
+	   heaplib_arena_calloc(a, &x, (size_t)~0, 2) != heaplib_error_fatal ||
+	   heaplib_arena_rewind(a, 65) != heaplib_error_fatal)
+	{
+		PRINTF("error: full arena not reported\n");
+		return 1;
+	}
+
+	heaplib_arena_destroy(&a, 0);
+	if(a != nil || h->nodes_active != 0)
+	{
+		PRINTF("error: arena not destroyed\n");
+		return 1;
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_create(&threads[i], nil, run, nil);
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	PRINTF("stats requests=%d objects=%d\n", requests, objects);
+
+	if(failed)
+		return 1;
+
+	/* Every arena went back as a single node */
+	if(h->nodes_active != 0 || sram->nodes_active != 0)
+	{
+		PRINTF("error: leaked active=%lu/%lu\n", h->nodes_active,
+			sram->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+run(void * _x)
+{
+	heaplib_arena_t * a;
+	vaddr_t x[256];
+	size_t z[256];
+	size_t m;
+	int k;
+	int n;
+	int i;
+	int j;
+
+	USED(_x);
+
+	for(n = 0; n < NREQUESTS && !failed; n++)
+	{
+		/* Every other request lives in the chosen Region */
+		if(heaplib_arena_create(&a, (n & 1) ? sram : nil, ARENASZ,
+			heaplib_flags_wait) != heaplib_error_none)
+		{
+			PRINTF("error: OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		if((n & 1) && __heaplib_region_index((vaddr_t)a) !=
+		    __heaplib_region_index((vaddr_t)sram->addr))
+		{
+			PRINTF("error: arena outside its Region\n");
+			failed = True;
+		}
+
+		m = 0;
+		for(k = 0; k < nelem(x); k++)
+		{
+			/* Scratch space halfway through is given back */
+			if(k == nelem(x) / 2)
+				m = heaplib_arena_mark(a);
+
+			z[k] = (random() % 96) + 1;
+			if(heaplib_arena_calloc(a, &x[k], 1, z[k]) !=
+			    heaplib_error_none)
+				break;
+
+			if(!zero(x[k], z[k]))
+			{
+				PRINTF("error: arena object not zero\n");
+				failed = True;
+				break;
+			}
+
+			memset((void * )x[k], k & 0xff, z[k]);
+		}
+
+		/* Objects must not overlap */
+		for(i = 0; i < k && !failed; i++)
+		{
+			for(j = 0; j < (int)z[i]; j++)
+			{
+				if(((uint8_t * )x[i])[j] != (i & 0xff))
+				{
+					PRINTF("error: arena objects overlap\n");
+					failed = True;
+					break;
+				}
+			}
+		}
+
+		if(k > nelem(x) / 2)
+		{
+			heaplib_arena_rewind(a, m);
+
+			/* Rewound space comes back clear */
+			if(heaplib_arena_calloc(a, &x[0], 1, 64) !=
+			    heaplib_error_none || !zero(x[0], 64))
+			{
+				PRINTF("error: rewound space not clear\n");
+				failed = True;
+			}
+		}
+
+		__atomic_fetch_add(&objects, k, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&requests, 1, __ATOMIC_RELAXED);
+
+		if(heaplib_arena_destroy(&a, heaplib_flags_wait) !=
+		    heaplib_error_none)
+		{
+			PRINTF("error: arena destroy failed\n");
+			failed = True;
+		}
+	}
+
+	return nil;
+}
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (256 * 1024)
+#define ALLOCSZ 1000
+
+struct
+test_request_t
+{
+	vaddr_t v;
+	int order;
+};
+
+typedef struct test_request_t test_request_t;
+
+static int ncompleted;
+
+/**
+ * \brief Completion callback: record the memory and the order it came in.
+ */
+static void
+completed(vaddr_t v, void * ctx)
+{
+	test_request_t * r;
+
+	r = ctx;
+	r->v = v;
+	r->order = ++ncompleted;
+}
+
+/**
+ * \brief Whether request 'r' completed with clear memory of Region 'h'.
+ */
+static boolean_t
+served(test_request_t * r, heaplib_region_t * h)
+{
+	uint8_t * p;
+	int i;
+
+	if(!r->v || !heaplib_region_within(r->v, h))
+		return False;
+
+	p = (uint8_t * )r->v;
+	for(i = 0; i < ALLOCSZ; i++)
+	{
+		if(p[i])
+			return False;
+	}
+
+	return True;
+}
+
+/**
+ * \brief Take all but a sliver of the free memory of 'h'.
+ */
+static boolean_t
+fill(heaplib_region_t * h, vaddr_t * vp)
+{
+	if(heaplib_calloc(vp, 1, h->free - HEAPLIB_MIN_NODE, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't fill the Region\n");
+		return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	test_request_t r[5];
+	heaplib_region_t * h;
+	heaplib_async_t * a;
+	heaplib_async_t * c;
+	vaddr_t y;
+	int i;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	memset(&r[0], 0, sizeof r);
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	/* With memory free and nothing queued, it completes right away */
+	if(heaplib_calloc_async(&a, ALLOCSZ, 0, 0, completed, &r[0]) !=
+	    heaplib_error_none || a != nil || !served(&r[0], h))
+	{
+		PRINTF("error: request with memory free didn't complete\n");
+		return 1;
+	}
+
+	if(!fill(h, &y))
+		return 1;
+
+	/* Otherwise it is queued, higher priorities first */
+	if(heaplib_calloc_async(&a, ALLOCSZ, 0, 0, completed, &r[1]) !=
+	    heaplib_error_again || a == nil ||
+	   heaplib_calloc_async(&a, ALLOCSZ, 0, 1, completed, &r[2]) !=
+	    heaplib_error_again ||
+	   heaplib_calloc_async(&c, ALLOCSZ, 0, 0, completed, &r[3]) !=
+	    heaplib_error_again || ncompleted != 1)
+	{
+		PRINTF("error: requests not queued\n");
+		return 1;
+	}
+
+	/* A queued request can be cancelled, once */
+	if(heaplib_calloc_async_cancel(c) != heaplib_error_none ||
+	   heaplib_calloc_async_cancel(c) != heaplib_error_fatal)
+	{
+		PRINTF("error: cancel\n");
+		return 1;
+	}
+
+	/* Freeing memory completes the queue in order */
+	if(heaplib_free(&y, heaplib_flags_wait) != heaplib_error_none ||
+	   ncompleted != 3 || !served(&r[1], h) || !served(&r[2], h) ||
+	   r[2].order != 2 || r[1].order != 3 || r[3].v != nil)
+	{
+		PRINTF("error: queue not completed in order: %d\n", ncompleted);
+		return 1;
+	}
+
+	/* Including when the free is deferred behind a busy Region */
+	if(!fill(h, &y) ||
+	   heaplib_calloc_async(&a, ALLOCSZ, 0, 0, completed, &r[4]) !=
+	    heaplib_error_again)
+	{
+		PRINTF("error: request not queued\n");
+		return 1;
+	}
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+	if(heaplib_free(&y, 0) != heaplib_error_none || h->pending == nil)
+	{
+		PRINTF("error: free behind the lock didn't defer\n");
+		return 1;
+	}
+	heaplib_region_unlock(&h->lock);
+
+	heaplib_idle();
+
+	if(ncompleted != 4 || !served(&r[4], h))
+	{
+		PRINTF("error: deferred free didn't complete the queue\n");
+		return 1;
+	}
+
+	for(i = 0; i < nelem(r); i++)
+	{
+		if(r[i].v)
+			heaplib_free(&r[i].v, 0);
+	}
+
+	if(h->nodes_active != 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+/**
+ * \file test/bench.h
+ *
+ * \brief Shared timing and hardware counter helpers for heaplib benchmarks.
+ *
+ * Counters are opened through perf_event_open and inherited by every thread
+ * created afterward. If the kernel refuses the counter (paranoid settings,
+ * virtual machines without a PMU) the benchmark still reports throughput.
+ */
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+struct
+bench_counter_t
+{
+	int fd;
+	const char * name;
+};
+
+typedef struct bench_counter_t bench_counter_t;
+
+static inline double
+bench_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + ((double)t.tv_nsec / 1e9);
+}
+
+static inline void
+bench_counter_open(bench_counter_t * c, const char * name, int type, long cfg)
+{
+	struct perf_event_attr a;
+
+	memset(&a, 0, sizeof a);
+	a.size = sizeof a;
+	a.type = type;
+	a.config = cfg;
+	a.disabled = 1;
+	a.inherit = 1;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+
+	c->name = name;
+	c->fd = syscall(__NR_perf_event_open, &a, 0, -1, -1, 0);
+}
+
+static inline void
+bench_counter_start(bench_counter_t * c)
+{
+	if(c->fd < 0)
+		return;
+
+	ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static inline void
+bench_counter_report(bench_counter_t * c, double ops)
+{
+	long long v;
+
+	if(c->fd >= 0)
+		ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if(c->fd < 0 || read(c->fd, &v, sizeof v) != sizeof v)
+	{
+		printf("%-16s n/a (counter unavailable)\n", c->name);
+		return;
+	}
+
+	printf("%-16s %lld (%.3f per op)\n", c->name, v, (double)v / ops);
+}
@@ -0,0 +1,123 @@
+/**
+ * \file test/bench_hugepage.c
+ *
+ * \brief Measure TLB misses during random access into a large Region.
+ *
+ * A Region is filled with small objects linked in a random order, then the
+ * chain is walked so nearly every step lands on a different page. The walk is
+ * run once over a Region backed by small pages and once over a Region created
+ * with heaplib_flags_hugepage, and dTLB misses per step are compared.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "heaplib/heaplib.h"
+#include "bench.h"
+
+#define MEMSZ (128 * 1024 * 1024)
+#define NOBJS (16 * 1024)
+#define ALLOCSZ (8 * 1024)
+#define STEPS (16 * 1024 * 1024)
+
+struct
+object_t
+{
+	struct object_t * next;
+};
+
+typedef struct object_t object_t;
+
+static vaddr_t x[NOBJS];
+
+static void run(const char * , heaplib_flags_t);
+
+int
+main(void)
+{
+	heaplib_init();
+
+	printf("huge page size=%lu\n", (unsigned long)platform_hugepage_size());
+
+	run("small pages", 0);
+	run("huge pages", heaplib_flags_hugepage);
+
+	return 0;
+}
+
+static void
+run(const char * name, heaplib_flags_t f)
+{
+	bench_counter_t misses;
+	heaplib_region_t * h;
+	object_t * o;
+	unsigned int s;
+	double t;
+	size_t i;
+	size_t j;
+	vaddr_t v;
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, f) != heaplib_error_none)
+	{
+		printf("error: can't reserve region\n");
+		return;
+	}
+
+	printf("%s: region flags=%x\n", name, h->flags);
+
+	s = 1;
+	for(i = 0; i < NOBJS; i++)
+	{
+		if(heaplib_calloc(&x[i], 1, (rand_r(&s) % ALLOCSZ) + sizeof(*o),
+			heaplib_flags_wait) != heaplib_error_none)
+		{
+			printf("error: allocation failed at %lu\n", (unsigned long)i);
+			return;
+		}
+	}
+
+	/* Shuffle, then link the objects in shuffled order */
+	for(i = NOBJS - 1; i > 0; i--)
+	{
+		j = rand_r(&s) % (i + 1);
+		v = x[i];
+		x[i] = x[j];
+		x[j] = v;
+	}
+
+	for(i = 0; i < NOBJS; i++)
+	{
+		((object_t * )x[i])->next = (object_t * )x[(i + 1) % NOBJS];
+	}
+
+	bench_counter_open(&misses, "dTLB-misses", PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	bench_counter_start(&misses);
+
+	t = bench_now();
+	o = (object_t * )x[0];
+	for(i = 0; i < STEPS; i++)
+	{
+		o = o->next;
+	}
+	t = bench_now() - t;
+
+	printf("%s: steps=%d time=%.3fs rate=%.0f steps/s (end=%p)\n",
+		name, STEPS, t, STEPS / t, (void * )o);
+	bench_counter_report(&misses, STEPS);
+
+	if(misses.fd >= 0)
+		close(misses.fd);
+
+	/* The last free releases the Region */
+	heaplib_region_delete(h);
+	for(i = 0; i < NOBJS; i++)
+	{
+		heaplib_free(&x[i], heaplib_flags_wait);
+	}
+}
@@ -0,0 +1,153 @@
+/**
+ * \file test/bench_place.c
+ *
+ * \brief Compare the Region placement policies.
+ *
+ * Each policy gets a Region of its own and replays the same sequence of
+ * allocations and frees for each workload. Allocation time is reported per
+ * call, along with how fragmented the Region is left: the number of free
+ * nodes and the largest of them.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "heaplib/heaplib.h"
+#include "bench.h"
+
+#define MEMSZ (32 * 1024 * 1024)
+#define NLIVE 4096
+#define ROUNDS 100000
+
+struct
+policy_t
+{
+	const char * name;
+	heaplib_flags_t flags;
+	heaplib_region_t * h;
+};
+
+static struct policy_t policies[] = {
+	{ "first", 0, nil },
+	{ "next", heaplib_flags_nextfit, nil },
+	{ "best", heaplib_flags_bestfit, nil },
+	{ "exact", heaplib_flags_exactfit, nil },
+};
+
+static vaddr_t live[NLIVE];
+
+/**
+ * \brief Mostly small objects with some medium ones, all short-lived.
+ */
+static size_t
+mixed(int i)
+{
+	(void)i;
+
+	if(random() % 10 < 7)
+		return 16 + random() % 48;
+
+	return 256 + random() % 3840;
+}
+
+/**
+ * \brief Long-lived small objects pinned between transient large ones,
+ * which leaves small remainders all over the Region.
+ */
+static size_t
+pinned(int i)
+{
+	if(i % 4 == 0)
+		return 24;
+
+	return 1024 + random() % 7168;
+}
+
+static void
+run(struct policy_t * p, const char * name, size_t (*size)(int))
+{
+	heaplib_node_t * n;
+	size_t largest;
+	double tc;
+	double t;
+	int calls;
+	int r;
+	int i;
+
+	memset(live, 0, sizeof live);
+	srandom(1);
+
+	tc = 0;
+	calls = 0;
+	for(r = 0; r < ROUNDS; r++)
+	{
+		i = random() % NLIVE;
+
+		/* Every fourth slot is long-lived under the pinned workload */
+		if(live[i] && (size != pinned || i % 4 != 0 || r % 64 == 0))
+			heaplib_free(&live[i], 0);
+
+		if(live[i])
+			continue;
+
+		t = bench_now();
+		if(__heaplib_calloc_from(p->h, &live[i], size(i), 0) !=
+		    heaplib_error_none)
+		{
+			printf("%-6s %-8s out of memory after %d rounds\n",
+				p->name, name, r);
+			break;
+		}
+		tc += bench_now() - t;
+		calls++;
+	}
+
+	largest = 0;
+	for(n = p->h->free_list; n; n = heaplib_free_next(p->h, n))
+	{
+		if(heaplib_node_size(n) > largest)
+			largest = heaplib_node_size(n);
+	}
+
+	printf("%-6s %-8s calloc=%7.1f ns free nodes=%6lu largest free=%9lu "
+		"committed=%9lu\n",
+		p->name, name, tc / calls * 1e9,
+		(unsigned long)p->h->nodes_free,
+		(unsigned long)largest,
+		(unsigned long)p->h->size);
+
+	for(i = 0; i < NLIVE; i++)
+	{
+		if(live[i])
+			heaplib_free(&live[i], 0);
+	}
+}
+
+int
+main(void)
+{
+	int i;
+
+	heaplib_init();
+
+	for(i = 0; i < nelem(policies); i++)
+	{
+		if(heaplib_region_reserve(&policies[i].h, MEMSZ, MEMSZ,
+			policies[i].flags) != heaplib_error_none)
+		{
+			printf("can't reserve a Region\n");
+			return 1;
+		}
+	}
+
+	for(i = 0; i < nelem(policies); i++)
+		run(&policies[i], "mixed", mixed);
+
+	for(i = 0; i < nelem(policies); i++)
+		run(&policies[i], "pinned", pinned);
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * \file test/bench_zero.c
+ *
+ * \brief Compare plain memset against the platform zeroing kernels.
+ *
+ * For each buffer size a small hot working set is read, the buffer is
+ * cleared, and the working set is read again. The second read shows how much
+ * of the working set the clear pushed out of the cache.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "heaplib/heaplib.h"
+#include "bench.h"
+
+#define HOTSZ (1024 * 1024)
+#define ROUNDS 64
+
+static size_t sizes[] = {
+	16 * 1024,
+	256 * 1024,
+	1024 * 1024,
+	8 * 1024 * 1024,
+};
+
+static volatile uint8_t hot[HOTSZ];
+
+static size_t
+touch(void)
+{
+	size_t s;
+	size_t i;
+
+	s = 0;
+	for(i = 0; i < HOTSZ; i += 64)
+		s += hot[i];
+
+	return s;
+}
+
+static void
+run(const char * name, size_t sz, boolean_t platform)
+{
+	bench_counter_t misses;
+	uint8_t * b;
+	double tz;
+	double th;
+	double t;
+	size_t s;
+	int i;
+
+	b = aligned_alloc(4096, sz);
+	memset(b, 1, sz);
+
+	bench_counter_open(&misses, "cache-misses", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CACHE_MISSES);
+	bench_counter_start(&misses);
+
+	tz = 0;
+	th = 0;
+	s = 0;
+	for(i = 0; i < ROUNDS; i++)
+	{
+		s += touch();
+
+		t = bench_now();
+		if(platform)
+			platform_zero((vaddr_t)b, sz);
+		else
+			memset(b, 0, sz);
+		tz += bench_now() - t;
+
+		t = bench_now();
+		s += touch();
+		th += bench_now() - t;
+	}
+
+	printf("%-8s size=%8lu zero=%8.1f MB/s hot reread=%6.2f us (%lu)\n",
+		name, (unsigned long)sz,
+		((double)sz * ROUNDS) / tz / 1e6,
+		th / ROUNDS * 1e6, (unsigned long)s);
+	bench_counter_report(&misses, ROUNDS);
+
+	if(misses.fd >= 0)
+		close(misses.fd);
+
+	free(b);
+}
+
+int
+main(void)
+{
+	int i;
+
+	heaplib_init();
+
+	for(i = 0; i < HOTSZ; i++)
+		hot[i] = (uint8_t)i;
+
+	for(i = 0; i < nelem(sizes); i++)
+	{
+		run("memset", sizes[i], False);
+		run("platform", sizes[i], True);
+	}
+
+	return 0;
+}
@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 8
+#define NROUNDS 200000
+
+#define MEMSZ (4 * 1024 * 1024)
+
+/* Deferred frees must return well within this */
+#define HOLDMS 50
+
+static heaplib_region_t * h;
+static boolean_t failed = False;
+static vaddr_t woken;
+
+static void * run(void * );
+static void * sleeper(void * );
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	heaplib_node_t * b;
+	pthread_t w;
+	vaddr_t x[16];
+	vaddr_t y;
+	vaddr_t d;
+	unsigned long t;
+	size_t n;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, heaplib_flags_wiped) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(heaplib_calloc(&x[i], 1, 100, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return 1;
+		}
+
+		memset((void * )x[i], 0xa5, 100);
+	}
+
+	heaplib_retain(x[0]);
+
+	/* Stand in for a long coalesce in another thread */
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+
+	n = h->nodes_active;
+	t = platform_time_ms();
+
+	/* Frees return straight away, leaving the nodes for the lock holder */
+	d = x[1];
+	for(i = 1; i < nelem(x); i++)
+	{
+		if(heaplib_free(&x[i], 0) != heaplib_error_none || x[i] != nil)
+		{
+			PRINTF("error: deferred free failed\n");
+			return 1;
+		}
+	}
+
+	/* A shared node still can't be freed, nor a node freed twice */
+	y = x[0];
+	if(heaplib_free(&y, heaplib_flags_nowait) != heaplib_error_again ||
+	   y != x[0])
+	{
+		PRINTF("error: shared node deferred\n");
+		return 1;
+	}
+
+	if(heaplib_free(&d, 0) != heaplib_error_fatal)
+	{
+		PRINTF("error: pending node freed twice\n");
+		return 1;
+	}
+
+	if(platform_time_ms() - t >= HOLDMS || h->nodes_active != n)
+	{
+		PRINTF("error: frees waited or didn't defer\n");
+		return 1;
+	}
+
+	/* A stale pointer into the shared node doesn't cost the others */
+	b = (heaplib_node_t * )((vbaddr_t)x[0] + 16 - sizeof(heaplib_node_t));
+	*(heaplib_node_t ** )&b->payload[0] = h->pending;
+	h->pending = b;
+
+	heaplib_region_unlock(&h->lock);
+
+	/* The next lock holder frees them */
+	if(heaplib_calloc(&y, 1, 100, 0) != heaplib_error_none ||
+	   h->nodes_active != 2 || h->pending != nil)
+	{
+		PRINTF("error: pending frees not drained: active=%lu\n",
+			h->nodes_active);
+		return 1;
+	}
+
+	heaplib_free(&y, 0);
+	y = x[0];
+	heaplib_release(&y, 0);
+	heaplib_release(&x[0], 0);
+
+	/* Fill the Region so a request has to sleep for memory */
+	if(heaplib_calloc(&y, 1, h->free - HEAPLIB_MIN_NODE, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't fill the Region\n");
+		return 1;
+	}
+
+	pthread_create(&w, nil, sleeper, nil);
+	while(__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST) == 0)
+		usleep(1000);
+
+	/* A free deferred behind the lock still wakes it */
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+	if(heaplib_free(&y, 0) != heaplib_error_none || h->pending == nil)
+	{
+		PRINTF("error: free behind the lock didn't defer\n");
+		return 1;
+	}
+	heaplib_region_unlock(&h->lock);
+
+	t = platform_time_ms();
+	while(!__atomic_load_n(&woken, __ATOMIC_ACQUIRE) &&
+	      platform_time_ms() - t < 5000)
+		usleep(1000);
+
+	if(!woken)
+	{
+		PRINTF("error: sleeper not woken by a deferred free\n");
+		return 1;
+	}
+
+	pthread_join(w, nil);
+	heaplib_free(&woken, 0);
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_create(&threads[i], nil, run, nil);
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	/* Background maintenance drains what the last frees left */
+	heaplib_idle();
+
+	if(failed)
+		return 1;
+
+	if(h->nodes_active != 0 || h->pending != nil)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+sleeper(void * _x)
+{
+	vaddr_t v;
+
+	USED(_x);
+
+	if(heaplib_calloc(&v, 1, 1000, heaplib_flags_waitmem) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: sleeper failed\n");
+		failed = True;
+		return nil;
+	}
+
+	__atomic_store_n(&woken, v, __ATOMIC_RELEASE);
+
+	return nil;
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[32];
+	size_t z[32];
+	uint8_t * p;
+	size_t j;
+	int n;
+	int i;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			/* Nobody else may have written to it */
+			p = (uint8_t * )x[i];
+			for(j = 0; j < z[i]; j++)
+			{
+				if(p[j] != (i & 0xff))
+				{
+					PRINTF("error: object corrupt\n");
+					failed = True;
+					break;
+				}
+			}
+
+			if(heaplib_free(&x[i], heaplib_flags_nowait) !=
+			    heaplib_error_none)
+			{
+				PRINTF("error: free failed\n");
+				failed = True;
+			}
+
+			continue;
+		}
+
+		z[i] = (random() % 512) + 1;
+		if(heaplib_calloc(&x[i], 1, z[i], heaplib_flags_wait) !=
+		    heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		memset((void * )x[i], i & 0xff, z[i]);
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], heaplib_flags_nowait);
+	}
+
+	return nil;
+}
@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define RESERVESZ (4 * 1024 * 1024)
+#define COMMITSZ (64 * 1024)
+#define EXTENDSZ (256 * 1024)
+
+#define ALLOCSZ 1000
+#define NOBJECTS ((RESERVESZ / ALLOCSZ) + 1)
+
+static vaddr_t x[NOBJECTS];
+static int nx;
+
+/**
+ * \brief Whether every object still holds the byte it was filled with.
+ */
+static boolean_t
+intact(void)
+{
+	uint8_t * p;
+	int i;
+	int j;
+
+	for(i = 0; i < nx; i++)
+	{
+		p = (uint8_t * )x[i];
+		for(j = 0; j < ALLOCSZ; j++)
+		{
+			if(p[j] != (i & 0xff))
+			{
+				PRINTF("error: object %d corrupt at %d\n", i, j);
+				return False;
+			}
+		}
+	}
+
+	return True;
+}
+
+/**
+ * \brief Allocate and fill objects until 'h' has committed more than 'z'
+ * bytes, or until it is full if 'z' is nil.
+ */
+static boolean_t
+fill(heaplib_region_t * h, size_t z)
+{
+	while(nx < NOBJECTS && (z == 0 || h->size <= z))
+	{
+		if(heaplib_calloc(&x[nx], 1, ALLOCSZ, 0) != heaplib_error_none)
+			return z == 0;
+
+		if(!heaplib_region_within(x[nx], h))
+		{
+			PRINTF("error: object outside the Region\n");
+			return False;
+		}
+
+		memset((void * )x[nx], nx & 0xff, ALLOCSZ);
+		nx++;
+	}
+
+	return z != 0;
+}
+
+int
+main(void)
+{
+	heaplib_region_t * h;
+	size_t z;
+	int i;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, RESERVESZ, COMMITSZ, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	if(h->size != COMMITSZ || h->reserved != RESERVESZ)
+	{
+		PRINTF("error: committed %lu of %lu\n", h->size, h->reserved);
+		return 1;
+	}
+
+	/* Allocations grow the Region once the committed part is full */
+	if(!fill(h, COMMITSZ) || !intact())
+	{
+		PRINTF("error: Region didn't grow on demand\n");
+		return 1;
+	}
+
+	/* Explicitly, by at least the amount asked for */
+	z = h->size;
+	if(heaplib_region_extend(h, EXTENDSZ) != heaplib_error_none ||
+	   h->size < z + EXTENDSZ || h->size > h->reserved || !intact())
+	{
+		PRINTF("error: extend from %lu to %lu\n", z, h->size);
+		return 1;
+	}
+
+	/* Until the whole reservation is committed */
+	if(!fill(h, 0) || !intact())
+	{
+		PRINTF("error: can't fill the Region\n");
+		return 1;
+	}
+
+	if(h->size != h->reserved ||
+	   heaplib_region_extend(h, EXTENDSZ) == heaplib_error_none)
+	{
+		PRINTF("error: grew past the reservation: %lu\n", h->size);
+		return 1;
+	}
+
+	for(i = 0; i < nx; i++)
+		heaplib_free(&x[i], 0);
+
+	if(h->nodes_active != 0 || h->free == 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
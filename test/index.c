@@ -0,0 +1,252 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (4 * 1024 * 1024)
+
+#define NOBJECTS 1024
+#define NROUNDS 200000
+#define CHECKEVERY 997
+
+/* Enough small objects that freeing every other overflows the index */
+#define NSMALL (3 * PLATFORM_INDEX_MAX)
+
+static vaddr_t x[NOBJECTS];
+static vaddr_t small[NSMALL];
+
+/**
+ * \brief Compare the search kernels with the obvious loops.
+ */
+static boolean_t
+searches(void)
+{
+	int32_t s[259];
+	size_t first;
+	size_t best;
+	size_t n;
+	int32_t z;
+	size_t i;
+	int k;
+
+	for(k = 0; k < 10000; k++)
+	{
+		n = random() % nelem(s);
+		for(i = 0; i < n; i++)
+		{
+			s[i] = random() % 4096;
+			if(random() % 8 == 0)
+				s[i] = 0;
+			else if(random() % 64 == 0)
+				s[i] = HEAPLIB_INDEX_SIZE_MAX;
+		}
+
+		z = (random() % 4096) + 1;
+		if(k % 100 == 0)
+			z = HEAPLIB_INDEX_SIZE_MAX;
+
+		first = n;
+		best = n;
+		for(i = 0; i < n; i++)
+		{
+			if(s[i] < z)
+				continue;
+
+			if(first == n)
+				first = i;
+
+			if(best == n || s[i] < s[best])
+				best = i;
+		}
+
+		if(platform_search_first(s, n, z) != first ||
+		   platform_search_best(s, n, z) != best)
+		{
+			PRINTF("error: search of %lu sizes for %d: first=%lu/%lu "
+				"best=%lu/%lu\n", n, z,
+				platform_search_first(s, n, z), first,
+				platform_search_best(s, n, z), best);
+			return False;
+		}
+	}
+
+	return True;
+}
+
+/**
+ * \brief Whether the index of 'h' matches its free list.
+ */
+static boolean_t
+check(heaplib_region_t * h)
+{
+	boolean_t b;
+
+	heaplib_region_lock_flags(&h->lock, heaplib_flags_wait);
+	b = __heaplib_index_check(h);
+	heaplib_region_unlock(&h->lock);
+
+	return b;
+}
+
+/**
+ * \brief Allocate and free at random in 'h', with natural requests mixed in
+ * so nodes are split both ways, checking the index as it goes.
+ */
+static boolean_t
+churn(heaplib_region_t * h)
+{
+	heaplib_flags_t f;
+	size_t z;
+	int n;
+	int i;
+
+	memset(x, 0, sizeof x);
+
+	for(n = 0; n < NROUNDS; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			heaplib_free(&x[i], 0);
+		}
+		else
+		{
+			f = 0;
+			z = (random() % 2048) + 1;
+			if(random() % 8 == 0)
+			{
+				f = heaplib_flags_natural;
+				z = (size_t)64 << (random() % 5);
+			}
+
+			if(__heaplib_calloc_from(h, &x[i], z, f) !=
+			    heaplib_error_none)
+			{
+				PRINTF("error: OOM after %d rounds\n", n);
+				return False;
+			}
+
+			if(f && ((size_t)x[i] & (z - 1)))
+			{
+				PRINTF("error: natural allocation unaligned\n");
+				return False;
+			}
+		}
+
+		if(n % CHECKEVERY == 0 && !check(h))
+			return False;
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], 0);
+	}
+
+	if(!check(h) || h->nodes_active != 0 || h->nodes_free != 1)
+	{
+		PRINTF("error: free=%lu active=%lu after churn\n", h->nodes_free,
+			h->nodes_active);
+		return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	heaplib_region_t * first;
+	heaplib_region_t * best;
+	vaddr_t v[4];
+	vaddr_t y;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(!searches())
+		return 1;
+
+	if(heaplib_region_reserve(&first, MEMSZ, MEMSZ, 0) !=
+	    heaplib_error_none ||
+	   heaplib_region_reserve(&best, MEMSZ, MEMSZ, heaplib_flags_bestfit) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	if(!first->index->valid || !churn(first) || !churn(best))
+		return 1;
+
+	/* Best fit takes the smallest hole, not the first or the lowest */
+	for(i = 0; i < nelem(v); i++)
+	{
+		__heaplib_calloc_from(best, &v[i], (i % 2) ? 64 : 512 - i * 64, 0);
+		__heaplib_calloc_from(best, &y, 64, 0);
+	}
+
+	y = v[2];
+	heaplib_free(&v[0], 0);
+	heaplib_free(&v[2], 0);
+	if(__heaplib_calloc_from(best, &v[2], 384, 0) != heaplib_error_none ||
+	   v[2] != y || !check(best))
+	{
+		PRINTF("error: best fit didn't take the smallest node\n");
+		return 1;
+	}
+
+	/* Overflowing the index falls back on the free list */
+	for(i = 0; i < NSMALL; i++)
+	{
+		if(__heaplib_calloc_from(first, &small[i], 64, 0) !=
+		    heaplib_error_none)
+		{
+			PRINTF("error: OOM filling\n");
+			return 1;
+		}
+	}
+
+	for(i = 0; i < NSMALL; i += 2)
+		heaplib_free(&small[i], 0);
+
+	if(first->index->valid || first->nodes_free <= PLATFORM_INDEX_MAX)
+	{
+		PRINTF("error: index didn't overflow free=%lu\n",
+			first->nodes_free);
+		return 1;
+	}
+
+	if(__heaplib_calloc_from(first, &y, 64, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't allocate with the index overflowed\n");
+		return 1;
+	}
+
+	heaplib_free(&y, 0);
+	for(i = 1; i < NSMALL; i += 2)
+		heaplib_free(&small[i], 0);
+
+	/* Once the free list fits again the index is rebuilt */
+	if(__heaplib_calloc_from(first, &y, 64, 0) != heaplib_error_none ||
+	   !first->index->valid || !check(first))
+	{
+		PRINTF("error: index not rebuilt free=%lu\n", first->nodes_free);
+		return 1;
+	}
+
+	heaplib_free(&y, 0);
+
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (1024 * 1024)
+
+#define LARGESZ (64 * 1024 * 1024)
+#define THRESHOLD (64 * 1024)
+
+#define SPANSZ (256 * 1024)
+
+/**
+ * \brief How many of the pages of 'z' bytes at 'v' are resident.
+ */
+static size_t
+resident(vaddr_t v, size_t z)
+{
+	unsigned char m[1024];
+	size_t n;
+	size_t i;
+	size_t r;
+
+	n = z / platform_page_size();
+	if(n > sizeof m || mincore((void * )v, z, m) != 0)
+		return (size_t)~0;
+
+	r = 0;
+	for(i = 0; i < n; i++)
+		r += m[i] & 1;
+
+	return r;
+}
+
+/**
+ * \brief Whether 'z' bytes at 'v' from 'o' on hold the pattern for 'c'.
+ */
+static boolean_t
+holds(vaddr_t v, size_t o, size_t z, uint8_t c)
+{
+	uint8_t * p;
+	size_t i;
+
+	p = (uint8_t * )v;
+	for(i = o; i < z; i++)
+	{
+		if(p[i] != (uint8_t)(c + i))
+			return False;
+	}
+
+	return True;
+}
+
+static void
+fill(vaddr_t v, size_t z, uint8_t c)
+{
+	uint8_t * p;
+	size_t i;
+
+	p = (uint8_t * )v;
+	for(i = 0; i < z; i++)
+		p[i] = (uint8_t)(c + i);
+}
+
+/**
+ * \brief Whether 'z' bytes at 'v' from 'o' on are all zero.
+ */
+static boolean_t
+clear(vaddr_t v, size_t o, size_t z)
+{
+	uint8_t * p;
+	size_t i;
+
+	p = (uint8_t * )v;
+	for(i = o; i < z; i++)
+	{
+		if(p[i])
+			return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	vaddr_t a;
+	vaddr_t b;
+	vaddr_t c;
+	vaddr_t o;
+	vaddr_t f;
+	vaddr_t s;
+	size_t p;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	p = platform_page_size();
+
+	if(heaplib_region_reserve(nil, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_large_init(LARGESZ, THRESHOLD) != heaplib_error_none)
+	{
+		PRINTF("error: can't set up\n");
+		return 1;
+	}
+
+	/* Below the threshold stays in the Regions */
+	if(heaplib_calloc(&s, 1, THRESHOLD / 2, 0) != heaplib_error_none ||
+	   __heaplib_large_within(s))
+	{
+		PRINTF("error: small request given pages\n");
+		return 1;
+	}
+
+	/* Large requests get whole, clear, page aligned spans */
+	if(heaplib_calloc(&a, 1, SPANSZ - 100, 0) != heaplib_error_none ||
+	   !__heaplib_large_within(a) || ((size_t)a & (p - 1)) != 0 ||
+	   __heaplib_large_size(a) != SPANSZ || !clear(a, 0, SPANSZ))
+	{
+		PRINTF("error: large span at %p\n", a);
+		return 1;
+	}
+
+	/* A neighbour above keeps it from growing in place */
+	if(heaplib_calloc(&b, 1, SPANSZ, 0) != heaplib_error_none ||
+	   ((size_t)b & (p - 1)) != 0 || b != (vaddr_t)((vbaddr_t)a + SPANSZ))
+	{
+		PRINTF("error: second span at %p\n", b);
+		return 1;
+	}
+
+	f = a;
+	fill(a, SPANSZ, 1);
+	fill(b, SPANSZ, 2);
+
+	if(resident(a, SPANSZ) != SPANSZ / p)
+	{
+		PRINTF("error: touched span not resident\n");
+		return 1;
+	}
+
+	/* So it is remapped, keeping its contents, and the rest is clear */
+	o = a;
+	if(heaplib_realloc(&a, 4 * SPANSZ, 0) != heaplib_error_none ||
+	   a == o || ((size_t)a & (p - 1)) != 0 ||
+	   __heaplib_large_size(a) != 4 * SPANSZ ||
+	   !holds(a, 0, SPANSZ, 1) || !clear(a, SPANSZ, 4 * SPANSZ) ||
+	   !holds(b, 0, SPANSZ, 2))
+	{
+		PRINTF("error: large realloc moved %p to %p\n", o, a);
+		return 1;
+	}
+
+	/* The old pages went with it, and the old span is free */
+	if(resident(o, SPANSZ) != 0 || __heaplib_large_size(o) != 0)
+	{
+		PRINTF("error: old span left behind\n");
+		return 1;
+	}
+
+	/* Shrinking stays put and gives the tail back */
+	o = a;
+	if(heaplib_realloc(&a, SPANSZ, 0) != heaplib_error_none || a != o ||
+	   !holds(a, 0, SPANSZ, 1) || __heaplib_large_size(a) != SPANSZ ||
+	   resident((vaddr_t)((vbaddr_t)a + SPANSZ), SPANSZ) != 0)
+	{
+		PRINTF("error: large shrink\n");
+		return 1;
+	}
+
+	/* Freed spans are decommitted, and come back clear */
+	c = b;
+	if(heaplib_free(&b, 0) != heaplib_error_none || resident(c, SPANSZ) != 0)
+	{
+		PRINTF("error: freed span still resident\n");
+		return 1;
+	}
+
+	o = a;
+	if(heaplib_realloc(&a, 2 * SPANSZ, 0) != heaplib_error_none || a != o ||
+	   !holds(a, 0, SPANSZ, 1) || !clear(a, SPANSZ, 2 * SPANSZ))
+	{
+		PRINTF("error: grow in place\n");
+		return 1;
+	}
+
+	if(heaplib_free(&a, 0) != heaplib_error_none ||
+	   resident(o, 2 * SPANSZ) != 0 || __heaplib_large_size(o) != 0)
+	{
+		PRINTF("error: freed span still resident\n");
+		return 1;
+	}
+
+	/* Freed pages are handed out again, lowest first */
+	if(heaplib_calloc(&a, 1, SPANSZ, 0) != heaplib_error_none || a != f ||
+	   !clear(a, 0, SPANSZ))
+	{
+		PRINTF("error: freed span not reused\n");
+		return 1;
+	}
+
+	heaplib_free(&a, 0);
+	heaplib_free(&s, 0);
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "heaplib/heaplib.h"
+
+/* Linked against obj/libheaplib.so by name, with obj as its run path, so the
+ * C allocator here is the shim wherever this is run from
+ */
+
+#define NTHREADS 8
+#define NROUNDS 50000
+
+static boolean_t failed = False;
+
+static void * run(void * );
+
+/**
+ * \brief Did heaplib allocate 'p'?
+ */
+static boolean_t
+owned(void * p)
+{
+	return __heaplib_large_within((vaddr_t)p) ||
+		__heaplib_region_index((vaddr_t)p) != NREGIONS;
+}
+
+/**
+ * \brief Check an aligned allocation of 'z' bytes at 'p'.
+ */
+static boolean_t
+aligned(void * p, size_t a, size_t z)
+{
+	if(!p || ((size_t)p & (a - 1)) != 0 || !owned(p) ||
+	   malloc_usable_size(p) < z)
+	{
+		PRINTF("error: %lu bytes aligned to %lu at %p\n", z, a, p);
+		return False;
+	}
+
+	memset(p, 0xa5, z);
+	free(p);
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	uint8_t * p;
+	uint8_t * q;
+	volatile size_t z;
+	void * v;
+	char * s;
+	size_t i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	/* Allocations made inside libc come from heaplib too */
+	s = strdup("heaplib");
+	if(!s || !owned(s) || strcmp(s, "heaplib") != 0)
+	{
+		PRINTF("error: strdup didn't use the shim\n");
+		return 1;
+	}
+	free(s);
+
+	p = malloc(0);
+	if(!p || !owned(p))
+	{
+		PRINTF("error: malloc(0) failed\n");
+		return 1;
+	}
+	free(p);
+	free(nil);
+
+	errno = 0;
+	z = (size_t)1 << (sizeof(size_t) * 4);
+	if(calloc(z, z) || errno != ENOMEM)
+	{
+		PRINTF("error: calloc overflow accepted\n");
+		return 1;
+	}
+
+	/* Growing keeps the contents; shrinking stays in place */
+	p = malloc(100);
+	for(i = 0; i < 100; i++)
+		p[i] = (uint8_t)i;
+
+	q = realloc(p, 5000);
+	for(i = 0; q && i < 100; i++)
+	{
+		if(q[i] != (uint8_t)i)
+			break;
+	}
+
+	if(!q || i != 100 || malloc_usable_size(q) < 5000)
+	{
+		PRINTF("error: realloc lost data\n");
+		return 1;
+	}
+
+	p = q;
+	q = realloc(q, 10);
+	if(q != p)
+	{
+		PRINTF("error: realloc lost data\n");
+		return 1;
+	}
+
+	/* Large objects are remapped as they grow */
+	q = realloc(q, 4 * 1024 * 1024);
+	if(!q || !__heaplib_large_within((vaddr_t)q) || q[99] != 99)
+	{
+		PRINTF("error: realloc to a large object failed\n");
+		return 1;
+	}
+
+	q[4 * 1024 * 1024 - 1] = 1;
+	q = realloc(q, 16 * 1024 * 1024);
+	if(!q || q[99] != 99 || q[4 * 1024 * 1024 - 1] != 1 ||
+	   malloc_usable_size(q) < 16 * 1024 * 1024)
+	{
+		PRINTF("error: large realloc lost data\n");
+		return 1;
+	}
+
+	if(realloc(q, 0) != nil)
+	{
+		PRINTF("error: realloc to nothing returned memory\n");
+		return 1;
+	}
+
+	if(!aligned(aligned_alloc(64, 100), 64, 100) ||
+	   !aligned(aligned_alloc(4096, 5000), 4096, 5000) ||
+	   !aligned(memalign(48, 200), 64, 200) ||
+	   !aligned(valloc(300), 4096, 300) ||
+	   !aligned(pvalloc(300), 4096, 4096) ||
+	   !aligned(aligned_alloc(4096, 1024 * 1024), 4096, 1024 * 1024))
+		return 1;
+
+	if(posix_memalign(&v, 3, 100) != EINVAL ||
+	   posix_memalign(&v, 256, 1000) != 0 ||
+	   !aligned(v, 256, 1000))
+	{
+		PRINTF("error: posix_memalign\n");
+		return 1;
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], nil, run, nil);
+
+	for(i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], nil);
+
+	return failed ? 1 : 0;
+}
+
+static void *
+run(void * _x)
+{
+	uint8_t * x[256];
+	size_t z[256];
+	size_t j;
+	int n;
+	int i;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			for(j = 0; j < z[i]; j++)
+			{
+				if(x[i][j] != (i & 0xff))
+				{
+					PRINTF("error: object corrupt\n");
+					failed = True;
+					break;
+				}
+			}
+
+			if(random() % 4 == 0)
+			{
+				/* Resized objects keep their contents */
+				j = (random() % 8192) + 1;
+				x[i] = realloc(x[i], j);
+				if(!x[i] || malloc_usable_size(x[i]) < j)
+				{
+					PRINTF("error: realloc to %lu failed\n", j);
+					failed = True;
+					break;
+				}
+
+				if(j > z[i])
+					memset(x[i] + z[i], i & 0xff, j - z[i]);
+				z[i] = j;
+				continue;
+			}
+
+			free(x[i]);
+			x[i] = nil;
+			continue;
+		}
+
+		z[i] = random() % 64 == 0 ? (random() % (512 * 1024)) + 1 :
+			(random() % 1024) + 1;
+		x[i] = malloc(z[i]);
+		if(!x[i] || !owned(x[i]) || malloc_usable_size(x[i]) < z[i])
+		{
+			PRINTF("error: malloc of %lu failed\n", z[i]);
+			failed = True;
+			break;
+		}
+
+		memset(x[i], i & 0xff, z[i]);
+	}
+
+	for(i = 0; i < nelem(x); i++)
+		free(x[i]);
+
+	return nil;
+}
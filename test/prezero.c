@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (4 * 1024 * 1024)
+
+#define ALLOCSZ 3000
+#define NOBJECTS 1024
+
+/* Idle passes allowed to clear the whole Region */
+#define NPASSES ((MEMSZ / HEAPLIB_PREZERO_BUDGET) + 2)
+
+static vaddr_t x[NOBJECTS];
+
+/**
+ * \brief Count the free nodes of 'h' not known to be zero. Those that are
+ * must really be.
+ */
+static int
+dirty(heaplib_region_t * h)
+{
+	heaplib_node_t * n;
+	size_t i;
+	int d;
+
+	d = 0;
+	for(n = h->free_list; n; n = heaplib_free_next(h, n))
+	{
+		if(!heaplib_node_zero(n))
+		{
+			d++;
+			continue;
+		}
+
+		for(i = HEAPLIB_LINK_BYTES; i < heaplib_node_size(n); i++)
+		{
+			if(n->payload[i])
+			{
+				PRINTF("error: known-zero node %p isn't\n", n);
+				return -1;
+			}
+		}
+	}
+
+	return d;
+}
+
+int
+main(void)
+{
+	heaplib_region_t * h;
+	uint8_t * m;
+	uint8_t * p;
+	int i;
+	int j;
+	int d;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	/* Memory that isn't clear to begin with */
+	m = malloc(MEMSZ);
+	memset(m, 0xa5, MEMSZ);
+	if(heaplib_region_add((vaddr_t)m, MEMSZ, heaplib_flags_prezero) !=
+	    heaplib_error_none ||
+	   heaplib_ptr2region((vaddr_t)(m + MEMSZ / 2), &h, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't add\n");
+		return 1;
+	}
+	heaplib_region_unlock(&h->lock);
+
+	for(i = 0; i < NOBJECTS; i++)
+	{
+		if(heaplib_calloc(&x[i], 1, ALLOCSZ, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return 1;
+		}
+
+		memset((void * )x[i], 0xa5, ALLOCSZ);
+	}
+
+	for(i = 0; i < NOBJECTS; i += 2)
+		heaplib_free(&x[i], 0);
+
+	if(dirty(h) <= 0)
+	{
+		PRINTF("error: freed memory already known-zero\n");
+		return 1;
+	}
+
+	/* Idle passes clear the free memory a budget at a time */
+	for(i = 0; i < NPASSES && (d = dirty(h)) > 0; i++)
+		heaplib_idle();
+
+	if(d != 0)
+	{
+		PRINTF("error: %d free nodes still dirty after %d passes\n", d, i);
+		return 1;
+	}
+
+	/* And allocations from it come back clear */
+	for(i = 0; i < NOBJECTS; i += 2)
+	{
+		if(heaplib_calloc(&x[i], 1, ALLOCSZ, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return 1;
+		}
+
+		p = (uint8_t * )x[i];
+		for(j = 0; j < ALLOCSZ; j++)
+		{
+			if(p[j])
+			{
+				PRINTF("error: prezeroed memory not clear\n");
+				return 1;
+			}
+		}
+	}
+
+	for(i = 0; i < NOBJECTS; i++)
+		heaplib_free(&x[i], 0);
+
+	if(h->nodes_active != 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
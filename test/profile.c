@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (1024 * 1024)
+
+#define NOBJECTS 8192
+#define NROUNDS 200000
+
+static vaddr_t x[NOBJECTS];
+static size_t z[NOBJECTS];
+
+/**
+ * \brief Allocate and free at random from Region 'h', checking contents
+ * and granularity, until everything is freed again.
+ */
+static boolean_t
+churn(heaplib_region_t * h)
+{
+	uint8_t * p;
+	size_t j;
+	int n;
+	int i;
+
+	for(n = 0; n < NROUNDS; n++)
+	{
+		i = random() % 256;
+		if(x[i])
+		{
+			p = (uint8_t * )x[i];
+			for(j = 0; j < z[i]; j++)
+			{
+				if(p[j] != (i & 0xff))
+				{
+					PRINTF("error: object corrupt\n");
+					return False;
+				}
+			}
+
+			if(heaplib_free(&x[i], 0) != heaplib_error_none)
+			{
+				PRINTF("error: free failed\n");
+				return False;
+			}
+
+			continue;
+		}
+
+		z[i] = (random() % 512) + 1;
+		if(heaplib_calloc(&x[i], 1, z[i], 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM at %lu bytes\n", z[i]);
+			return False;
+		}
+
+		if(((size_t)x[i] & (HEAPLIB_CHUNKSZ - 1)) != 0)
+		{
+			PRINTF("error: %p isn't aligned to a chunk\n", x[i]);
+			return False;
+		}
+
+		memset((void * )x[i], i & 0xff, z[i]);
+	}
+
+	for(i = 0; i < 256; i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], 0);
+	}
+
+	if(h->nodes_active != 0)
+	{
+		PRINTF("error: %lu nodes still active\n", h->nodes_active);
+		return False;
+	}
+
+	return True;
+}
+
+/**
+ * \brief Check whatever heap/include/heaplib/config.h left in the build.
+ */
+int
+main(void)
+{
+	heaplib_region_t * h;
+	heaplib_region_t * g;
+	heaplib_error_t e;
+	vaddr_t v;
+	int n;
+	int i;
+
+	PRINTF("main!\n");
+	PRINTF("profile: regions=%d lock=%d chunk=%lu natural=%d\n",
+		NREGIONS, HEAPLIB_LOCK, HEAPLIB_CHUNKSZ, HEAPLIB_NATURAL);
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	if(!churn(h))
+		return 1;
+
+	/* Natural requests are aligned to their size, or refused outright */
+	e = heaplib_calloc(&v, 1, 256, heaplib_flags_natural);
+#if HEAPLIB_NATURAL
+	if(e != heaplib_error_none || ((size_t)v & 255) != 0)
+	{
+		PRINTF("error: natural request failed\n");
+		return 1;
+	}
+	heaplib_free(&v, 0);
+#else
+	if(e != heaplib_error_fatal)
+	{
+		PRINTF("error: natural request without natural alignment\n");
+		return 1;
+	}
+#endif
+
+	/* Fill the Region; waiting for memory gives up once the time is up,
+	 * and at once if nothing else could free any.
+	 */
+	for(n = 0; n < NOBJECTS; n++)
+	{
+		if(heaplib_calloc(&x[n], 1, 256, 0) != heaplib_error_none)
+			break;
+	}
+
+	if(n == NOBJECTS ||
+	   heaplib_calloc_timeout(&v, 1, 256, heaplib_flags_waitmem, 10) ==
+	    heaplib_error_none)
+	{
+		PRINTF("error: a full Region still gave memory\n");
+		return 1;
+	}
+
+	for(i = 0; i < n; i++)
+		heaplib_free(&x[i], 0);
+
+#if HEAPLIB_LOCK == HEAPLIB_LOCK_NONE
+	if(heaplib_idle_start(1) != heaplib_error_fatal)
+	{
+		PRINTF("error: background task in a build without locks\n");
+		return 1;
+	}
+#endif
+
+	/* Exactly as many Regions fit as were configured */
+	for(n = 1; n <= NREGIONS; n++)
+	{
+		if(heaplib_region_reserve(&g, MEMSZ, MEMSZ, 0) != heaplib_error_none)
+			break;
+	}
+
+	if(n != NREGIONS)
+	{
+		PRINTF("error: %d Regions fit, not %d\n", n, NREGIONS);
+		return 1;
+	}
+
+	if(!churn(h))
+		return 1;
+
+	heaplib_idle();
+
+	return 0;
+}
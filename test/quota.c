@@ -0,0 +1,417 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 8
+#define NROUNDS 20000
+
+#define MEMSZ (4 * 1024 * 1024)
+#define SRAMSZ (256 * 1024)
+
+/* Large objects come straight from pages */
+#define LARGESZ (16 * 1024 * 1024)
+#define LARGEOBJ (128 * 1024)
+
+/* A runaway worker may only hold this much of the internal Region */
+#define QUOTA (64 * 1024)
+
+/* Objects handed from the throttled producer to the consumer */
+#define NHANDOFF 4000
+
+static boolean_t failed = False;
+
+static void * run(void * );
+static void * runaway(void * );
+static void * foreign(void * );
+#ifndef HEAPLIB_COMPACT
+static void * producer(void * );
+static void * consumer(void * );
+
+static pthread_mutex_t handoff_lock;
+static vaddr_t handoff[16];
+static volatile int handed;
+#endif
+
+static task_t main_task;
+
+static vaddr_t large_x[2];
+static vaddr_t runaway_x[256];
+static int runaway_n;
+
+/**
+ * \brief Check what task 't' holds.
+ */
+static boolean_t
+check(const char * what, task_t t, size_t objects, size_t minbytes)
+{
+	heaplib_task_usage_t u;
+	size_t z;
+	int i;
+
+	if(heaplib_task_usage(t, &u) != heaplib_error_none)
+	{
+		PRINTF("error: %s: no usage\n", what);
+		return False;
+	}
+
+	PRINTF("%s: bytes=%lu objects=%lu peak=%lu used=%lu quota=%lu\n", what,
+		u.bytes, u.objects, u.peak, u.used, u.quota);
+
+	z = 0;
+	for(i = 0; i <= NREGIONS; i++)
+		z += u.regions[i];
+
+	if(u.objects != objects || u.bytes < minbytes || z != u.bytes ||
+	   u.peak < u.bytes)
+	{
+		PRINTF("error: %s: objects=%lu expected=%lu bytes=%lu min=%lu "
+			"regions=%lu\n", what, u.objects, objects, u.bytes,
+			minbytes, z);
+		return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	pthread_t p;
+#ifndef HEAPLIB_COMPACT
+	pthread_t c;
+#endif
+	heaplib_region_t * h;
+	vaddr_t x;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	main_task = pthread_self();
+
+	if(heaplib_large_init(LARGESZ, LARGEOBJ) != heaplib_error_none ||
+	   heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_add(calloc(1, SRAMSZ), SRAMSZ,
+		heaplib_flags_internal) != heaplib_error_none)
+	{
+		PRINTF("error: can't add regions\n");
+		return 1;
+	}
+
+	/* Allocations are owned by the task that made them */
+	if(heaplib_calloc(&x, 1, 100, 0) != heaplib_error_none ||
+	   !check("main", pthread_self(), 1, 100))
+	{
+		return 1;
+	}
+
+	heaplib_free(&x, 0);
+	if(!check("main freed", pthread_self(), 0, 0))
+		return 1;
+
+	/* Large objects too, wherever they are freed or resized */
+	if(heaplib_calloc(&large_x[0], 1, LARGEOBJ, 0) != heaplib_error_none ||
+	   heaplib_calloc(&large_x[1], 1, LARGEOBJ, 0) != heaplib_error_none ||
+	   !check("main large", pthread_self(), 2, 2 * LARGEOBJ))
+	{
+		return 1;
+	}
+
+	pthread_create(&p, nil, foreign, nil);
+	pthread_join(p, nil);
+
+	if(failed || !check("main large freed", pthread_self(), 0, 0))
+		return 1;
+
+	/* Every worker must end up holding nothing */
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_create(&threads[i], nil, run, nil);
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	if(failed)
+		return 1;
+
+	/* A runaway worker is stopped at its quota, and the internal Region
+	 * still has room for everyone else while it holds all it can.
+	 */
+	pthread_create(&p, nil, runaway, nil);
+	pthread_join(p, nil);
+
+	if(failed)
+		return 1;
+
+	if(heaplib_calloc(&x, 1, QUOTA, heaplib_flags_internal) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: internal Region exhausted\n");
+		return 1;
+	}
+
+	heaplib_free(&x, 0);
+
+	/* Frees by another task are credited to the owner */
+	for(i = 0; i < runaway_n; i++)
+		heaplib_free(&runaway_x[i], 0);
+
+#ifndef HEAPLIB_COMPACT
+	if(!check("runaway freed", p, 0, 0))
+		return 1;
+
+	/* A throttled producer waits for its consumer to free. Compact nodes
+	 * don't record their owner, so frees from the consumer can't be
+	 * credited to the producer there.
+	 */
+	pthread_mutex_init(&handoff_lock, nil);
+
+	pthread_create(&p, nil, producer, nil);
+	pthread_create(&c, nil, consumer, nil);
+	pthread_join(p, nil);
+	pthread_join(c, nil);
+#endif
+
+	return failed ? 1 : 0;
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[32];
+	heaplib_flags_t f;
+	int live;
+	int n;
+	int i;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	live = 0;
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			heaplib_free(&x[i], heaplib_flags_wait);
+			live--;
+			continue;
+		}
+
+		f = (random() & 3) ? 0 : heaplib_flags_internal;
+		if(heaplib_calloc(&x[i], 1, (random() % 1024) + 1,
+			heaplib_flags_wait | f) != heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		live++;
+	}
+
+	if(!check("worker", pthread_self(), live, live))
+		failed = True;
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], heaplib_flags_wait);
+	}
+
+	if(!check("worker done", pthread_self(), 0, 0))
+		failed = True;
+
+	return nil;
+}
+
+/**
+ * \brief Resize and free a large object another task allocated.
+ */
+static void *
+foreign(void * _x)
+{
+	USED(_x);
+
+	/* A free is credited to the owner */
+	if(heaplib_free(&large_x[0], 0) != heaplib_error_none ||
+	   !check("owner after free", main_task, 1, LARGEOBJ))
+	{
+		failed = True;
+		return nil;
+	}
+
+	/* A resize, in place or not, makes it this task's */
+	if(heaplib_realloc(&large_x[1], 2 * LARGEOBJ, 0) != heaplib_error_none ||
+	   !check("foreign resized", pthread_self(), 1, 2 * LARGEOBJ) ||
+	   !check("owner after resize", main_task, 0, 0))
+	{
+		failed = True;
+		return nil;
+	}
+
+	heaplib_free(&large_x[1], 0);
+	if(!check("foreign freed", pthread_self(), 0, 0))
+		failed = True;
+
+	return nil;
+}
+
+static void *
+runaway(void * _x)
+{
+	heaplib_task_usage_t u;
+	vaddr_t * x;
+	int n;
+	int i;
+
+	USED(_x);
+
+	x = runaway_x;
+	heaplib_task_quota(pthread_self(), QUOTA, heaplib_flags_internal,
+		heaplib_quota_fail);
+
+	/* Memory outside the internal Region doesn't count */
+	for(n = 0; n < nelem(runaway_x); n++)
+	{
+		if(heaplib_calloc(&x[n], 1, 1024, 0) != heaplib_error_none)
+		{
+			PRINTF("error: quota applied outside its Regions\n");
+			failed = True;
+			break;
+		}
+	}
+
+	for(i = 0; i < n; i++)
+		heaplib_free(&x[i], 0);
+
+	for(n = 0; n < nelem(runaway_x); n++)
+	{
+		if(heaplib_calloc(&x[n], 1, 1024, heaplib_flags_internal) !=
+		    heaplib_error_none)
+			break;
+	}
+
+	heaplib_task_usage(pthread_self(), &u);
+	PRINTF("runaway: allocated=%d used=%lu quota=%lu\n", n, u.used, u.quota);
+
+	if(n == nelem(runaway_x) || u.used > QUOTA || u.used + 2048 < QUOTA ||
+	   x[n] != nil)
+	{
+		PRINTF("error: runaway not stopped at its quota\n");
+		failed = True;
+	}
+
+	/* Left for main to free while this task is gone */
+	runaway_n = n;
+
+	return nil;
+}
+
+#ifndef HEAPLIB_COMPACT
+static void *
+producer(void * _x)
+{
+	heaplib_task_usage_t u;
+	vaddr_t x;
+	int n;
+	int i;
+
+	USED(_x);
+
+	heaplib_task_quota(pthread_self(), QUOTA / 4, 0, heaplib_quota_throttle);
+
+	for(n = 0; n < NHANDOFF && !failed; n++)
+	{
+		if(heaplib_calloc_timeout(&x, 1, 1024, 0, 5000) !=
+		    heaplib_error_none)
+		{
+			PRINTF("error: producer starved\n");
+			failed = True;
+			break;
+		}
+
+		heaplib_task_usage(pthread_self(), &u);
+		if(u.used > QUOTA / 4)
+		{
+			PRINTF("error: producer over quota: %lu\n", u.used);
+			failed = True;
+			break;
+		}
+
+		/* Wait for a slot; the consumer frees as it goes */
+		while(!failed)
+		{
+			pthread_mutex_lock(&handoff_lock);
+			for(i = 0; i < nelem(handoff); i++)
+			{
+				if(!handoff[i])
+				{
+					handoff[i] = x;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&handoff_lock);
+
+			if(i < nelem(handoff))
+				break;
+
+			usleep(100);
+		}
+	}
+
+	return nil;
+}
+
+static void *
+consumer(void * _x)
+{
+	vaddr_t x;
+	int i;
+
+	USED(_x);
+
+	while(handed < NHANDOFF && !failed)
+	{
+		/* Hold on to objects a while, so the producer hits its quota */
+		usleep(random() % 200);
+
+		x = nil;
+		pthread_mutex_lock(&handoff_lock);
+		for(i = 0; i < nelem(handoff); i++)
+		{
+			if(handoff[i])
+			{
+				x = handoff[i];
+				handoff[i] = nil;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&handoff_lock);
+
+		if(x)
+		{
+			heaplib_free(&x, heaplib_flags_wait);
+			handed++;
+		}
+	}
+
+	return nil;
+}
+#endif
@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NCONSUMERS 4
+#define NBUFFERS 20000
+
+#define MEMSZ (4 * 1024 * 1024)
+#define LARGESZ (64 * 1024 * 1024)
+
+/* Each consumer has a ring of buffers shared with every other consumer */
+#define RINGSZ 64
+
+struct
+ring_t
+{
+	pthread_mutex_t lock;
+	vaddr_t slot[RINGSZ];
+	int head;
+	int tail;
+};
+
+static struct ring_t rings[NCONSUMERS];
+static boolean_t failed = False;
+static int consumed;
+
+static void * consumer(void * );
+
+/**
+ * \brief Sharing rules that hold for both Region nodes and large objects.
+ */
+static boolean_t
+check_rules(const char * what, size_t z)
+{
+	vaddr_t x;
+	vaddr_t y;
+	int i;
+
+	if(heaplib_calloc(&x, 1, z, 0) != heaplib_error_none ||
+	   heaplib_refs(x) != 1)
+	{
+		PRINTF("error: %s: new allocation not singly held\n", what);
+		return False;
+	}
+
+	if(heaplib_retain(x) != heaplib_error_none || heaplib_refs(x) != 2)
+	{
+		PRINTF("error: %s: retain\n", what);
+		return False;
+	}
+
+	/* Shared allocations can't be freed or resized out from under the
+	 * other holders.
+	 */
+	y = x;
+	if(heaplib_free(&y, 0) != heaplib_error_again || y != x ||
+	   heaplib_realloc(&y, z * 2, 0) != heaplib_error_again || y != x)
+	{
+		PRINTF("error: %s: shared allocation freed or resized\n", what);
+		return False;
+	}
+
+	/* The count saturates rather than wrapping */
+	for(i = 2; i < HEAPLIB_REFS_MAX; i++)
+		heaplib_retain(x);
+
+	if(heaplib_refs(x) != HEAPLIB_REFS_MAX ||
+	   heaplib_retain(x) != heaplib_error_again)
+	{
+		PRINTF("error: %s: count didn't saturate: %d\n", what,
+			heaplib_refs(x));
+		return False;
+	}
+
+	for(i = HEAPLIB_REFS_MAX; i > 1; i--)
+	{
+		y = x;
+		if(heaplib_release(&y, 0) != heaplib_error_none || y != nil)
+		{
+			PRINTF("error: %s: release\n", what);
+			return False;
+		}
+	}
+
+	if(heaplib_refs(x) != 1)
+	{
+		PRINTF("error: %s: count=%d after releases\n", what,
+			heaplib_refs(x));
+		return False;
+	}
+
+	/* The last release frees it */
+	y = x;
+	if(heaplib_release(&y, 0) != heaplib_error_none || heaplib_refs(x) != -1)
+	{
+		PRINTF("error: %s: last release didn't free\n", what);
+		return False;
+	}
+
+	/* And releasing it again is caught */
+	y = x;
+	if(heaplib_release(&y, 0) != heaplib_error_fatal || y != nil)
+	{
+		PRINTF("error: %s: double release not caught\n", what);
+		return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NCONSUMERS];
+	heaplib_task_usage_t u;
+	heaplib_region_t * h;
+	vaddr_t x;
+	size_t z;
+	int n;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_large_init(LARGESZ, 256 * 1024) != heaplib_error_none ||
+	   heaplib_region_reserve(&h, MEMSZ, MEMSZ, heaplib_flags_wiped) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	if(!check_rules("node", 100) || !check_rules("large", 512 * 1024))
+		return 1;
+
+	for(i = 0; i < NCONSUMERS; i++)
+	{
+		pthread_mutex_init(&rings[i].lock, nil);
+		pthread_create(&threads[i], nil, consumer, &rings[i]);
+	}
+
+	/* Fan every buffer out to all consumers without copying it */
+	for(n = 0; n < NBUFFERS && !failed; n++)
+	{
+		z = (random() % 2048) + 1;
+		if(heaplib_calloc(&x, 1, z, heaplib_flags_wait) !=
+		    heaplib_error_none)
+		{
+			PRINTF("error: OOM in producer\n");
+			failed = True;
+			break;
+		}
+
+		memset((void * )x, n & 0xff, z);
+		*(uint32_t * )x = (uint32_t)z;
+
+		for(i = 1; i < NCONSUMERS; i++)
+			heaplib_retain(x);
+
+		for(i = 0; i < NCONSUMERS; i++)
+		{
+			while(!failed)
+			{
+				pthread_mutex_lock(&rings[i].lock);
+				if(rings[i].head - rings[i].tail < RINGSZ)
+				{
+					rings[i].slot[rings[i].head % RINGSZ] = x;
+					rings[i].head++;
+					pthread_mutex_unlock(&rings[i].lock);
+					break;
+				}
+				pthread_mutex_unlock(&rings[i].lock);
+
+				usleep(10);
+			}
+		}
+	}
+
+	for(i = 0; i < NCONSUMERS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	PRINTF("stats buffers=%d consumed=%d\n", n, consumed);
+
+	if(failed || consumed != NBUFFERS * NCONSUMERS)
+		return 1;
+
+	if(h->nodes_active != 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+#ifndef HEAPLIB_COMPACT
+	/* Consumers freed every buffer on the producer's behalf */
+	heaplib_task_usage(pthread_self(), &u);
+	if(u.objects != 0)
+	{
+		PRINTF("error: producer still holds %lu\n", u.objects);
+		return 1;
+	}
+#else
+	USED(u);
+#endif
+
+	return 0;
+}
+
+static void *
+consumer(void * _x)
+{
+	struct ring_t * r;
+	uint32_t z;
+	uint8_t * p;
+	vaddr_t x;
+	uint32_t i;
+	int n;
+
+	r = _x;
+
+	for(n = 0; n < NBUFFERS && !failed; )
+	{
+		pthread_mutex_lock(&r->lock);
+		x = nil;
+		if(r->tail < r->head)
+		{
+			x = r->slot[r->tail % RINGSZ];
+			r->tail++;
+		}
+		pthread_mutex_unlock(&r->lock);
+
+		if(!x)
+		{
+			usleep(10);
+			continue;
+		}
+
+		/* Every consumer sees the producer's bytes */
+		p = (uint8_t * )x;
+		z = *(uint32_t * )x;
+		for(i = sizeof(uint32_t); i < z; i++)
+		{
+			if(p[i] != (n & 0xff))
+			{
+				PRINTF("error: buffer %d corrupt at %u\n", n, i);
+				failed = True;
+				break;
+			}
+		}
+
+		if(heaplib_release(&x, heaplib_flags_wait) != heaplib_error_none)
+		{
+			PRINTF("error: release failed\n");
+			failed = True;
+		}
+
+		__atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+		n++;
+	}
+
+	return nil;
+}
@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (1024 * 1024)
+
+#define SMALLMAX 256
+#define LARGEMIN 4096
+
+#define NOBJECTS 65536
+
+static vaddr_t x[NOBJECTS];
+static int nx;
+
+/**
+ * \brief The Region holding 'v'.
+ */
+static heaplib_region_t *
+where(vaddr_t v)
+{
+	return __heaplib_region_at(__heaplib_region_index(v));
+}
+
+/**
+ * \brief Allocate 'z' bytes with flags 'f' and check they landed in 'h'.
+ */
+static boolean_t
+expect(const char * what, size_t z, heaplib_flags_t f, heaplib_region_t * h)
+{
+	if(heaplib_calloc(&x[nx], 1, z, f) != heaplib_error_none)
+	{
+		PRINTF("error: %s: no memory for %lu\n", what, z);
+		return False;
+	}
+
+	if(where(x[nx]) != h)
+	{
+		PRINTF("error: %s: %lu bytes landed in the wrong Region\n", what,
+			z);
+		return False;
+	}
+
+	nx++;
+	return True;
+}
+
+int
+main(void)
+{
+	heaplib_region_t * small;
+	heaplib_region_t * large;
+	heaplib_region_t * sram;
+	heaplib_region_t * old;
+	heaplib_region_t * h;
+	heaplib_error_t e;
+	vaddr_t v;
+	int n;
+	int i;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&small, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_reserve(&large, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_reserve(&sram, MEMSZ, MEMSZ, heaplib_flags_internal) !=
+	    heaplib_error_none ||
+	   heaplib_region_reserve(&old, MEMSZ, MEMSZ, heaplib_flags_largereq) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve regions\n");
+		return 1;
+	}
+
+	/* Every Region is visited, whatever order their addresses are in */
+	n = 0;
+	e = heaplib_region_find_first(&h, 0);
+	while(e == heaplib_error_none)
+	{
+		n++;
+		e = heaplib_region_find_next(&h, 0);
+	}
+
+	if(n != 4)
+	{
+		PRINTF("error: find_next visited %d Regions\n", n);
+		return 1;
+	}
+
+	if(heaplib_region_route(small, 0, SMALLMAX) != heaplib_error_none ||
+	   heaplib_region_route(large, LARGEMIN, 0) != heaplib_error_none ||
+	   heaplib_region_route(large, LARGEMIN, LARGEMIN) != heaplib_error_fatal)
+	{
+		PRINTF("error: can't route\n");
+		return 1;
+	}
+
+	/* Sizes go to the Regions set aside for them, and sizes nobody took go
+	 * to the Region taking any size.
+	 */
+	if(!expect("small", 64, 0, small) ||
+	   !expect("band edge", SMALLMAX - HEAPLIB_CHUNKSZ, 0, small) ||
+	   !expect("large", LARGEMIN, 0, large) ||
+	   !expect("large band", 32 * 1024, 0, large) ||
+	   !expect("middle", 1024, 0, sram) ||
+	   !expect("flags", 64, heaplib_flags_internal, sram))
+	{
+		return 1;
+	}
+
+	/* Small objects spill over to the Region taking any size */
+	while(nx < NOBJECTS)
+	{
+		if(heaplib_calloc(&x[nx], 1, 64, 0) != heaplib_error_none)
+		{
+			PRINTF("error: no room for small objects\n");
+			return 1;
+		}
+
+		h = where(x[nx++]);
+		if(h == sram)
+			break;
+
+		if(h != small)
+		{
+			PRINTF("error: small object spilled to the wrong Region\n");
+			return 1;
+		}
+	}
+
+	/* A largereq Region only takes requests of a sixteenth of its size and
+	 * up, so once the general Region is full, medium requests fail.
+	 */
+	while(nx < NOBJECTS)
+	{
+		if(heaplib_calloc(&x[nx], 1, 1024, 0) != heaplib_error_none)
+			break;
+
+		if(where(x[nx++]) != sram)
+		{
+			PRINTF("error: medium object outside the general Region\n");
+			return 1;
+		}
+	}
+
+	if(nx == NOBJECTS)
+		return 1;
+
+	/* Dedicated Regions are tried in the order they were added, so narrow
+	 * the first before the largereq Region can be seen taking its share.
+	 */
+	if(!expect("first dedicated", MEMSZ / 16, 0, large) ||
+	   heaplib_region_route(large, LARGEMIN, MEMSZ / 16) !=
+	    heaplib_error_none ||
+	   !expect("largereq", MEMSZ / 16, 0, old))
+	{
+		return 1;
+	}
+
+	/* Routing from 0 to 0 takes any size again */
+	if(heaplib_region_route(old, 0, 0) != heaplib_error_none ||
+	   !expect("rerouted", 1024, 0, old))
+	{
+		return 1;
+	}
+
+	PRINTF("stats objects=%d\n", nx);
+
+	for(i = 0; i < nx; i++)
+		heaplib_free(&x[i], 0);
+
+	if(small->nodes_active || large->nodes_active || sram->nodes_active ||
+	   old->nodes_active)
+	{
+		PRINTF("error: leaked\n");
+		return 1;
+	}
+
+	v = nil;
+	if(heaplib_calloc(&v, 1, 64, 0) != heaplib_error_none || where(v) != small)
+	{
+		PRINTF("error: freed Region not reused\n");
+		return 1;
+	}
+
+	heaplib_free(&v, 0);
+
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 4
+#define NROUNDS 200000
+
+#define MEMSZ (4 * 1024 * 1024)
+
+/* Nodes checked per call; small, so passes are cut into by the threads */
+#define BUDGET 64
+
+static heaplib_region_t * h;
+static boolean_t failed = False;
+static boolean_t done = False;
+
+static void * run(void * );
+static void * scrub(void * );
+
+/**
+ * \brief Scrub 'r' until a whole pass is checked, or corruption is found.
+ */
+static heaplib_error_t
+pass(heaplib_region_t * r)
+{
+	heaplib_error_t e;
+	size_t p;
+
+	p = r->scrub.passes;
+	do {
+		e = heaplib_region_scrub(r, BUDGET);
+	}
+	while(e == heaplib_error_none && r->scrub.passes == p);
+
+	return e;
+}
+
+/**
+ * \brief The header of the node holding 'v'.
+ */
+static heaplib_node_t *
+node(vaddr_t v)
+{
+	return (heaplib_node_t * )((vbaddr_t)v - sizeof(heaplib_node_t));
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS + 1];
+	heaplib_region_t * g;
+	heaplib_node_t * t;
+	vaddr_t x[3];
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, heaplib_flags_scrub) !=
+	    heaplib_error_none ||
+	   heaplib_region_reserve(&g, MEMSZ, MEMSZ, heaplib_flags_scrub) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	/* A busy, healthy Region is never reported */
+	for(i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], nil, run, nil);
+	pthread_create(&threads[i], nil, scrub, nil);
+
+	for(i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], nil);
+
+	done = True;
+	pthread_join(threads[i], nil);
+
+	heaplib_idle();
+
+	if(failed || pass(h) != heaplib_error_none || h->scrub.corrupt ||
+	   h->nodes_active != 0)
+	{
+		PRINTF("error: healthy Region reported corrupt\n");
+		return 1;
+	}
+
+	/* Frees in a scrubbed Region check the node they're given */
+	for(i = 0; i < nelem(x); i++)
+		__heaplib_calloc_from(h, &x[i], 100, 0);
+
+	x[2] = (vaddr_t)((vbaddr_t)x[1] + 16);
+	if(heaplib_free(&x[2], 0) != heaplib_error_fatal)
+	{
+		PRINTF("error: freed a pointer into a payload\n");
+		return 1;
+	}
+
+	/* An overrun into the next header is found */
+	node(x[1])->magic ^= 1;
+	if(pass(h) != heaplib_error_fatal || h->scrub.corrupt != 1 ||
+	   (h->flags & heaplib_flags_restrict) == 0)
+	{
+		PRINTF("error: bad magic not found\n");
+		return 1;
+	}
+
+	/* So is a broken free list */
+	__heaplib_calloc_from(g, &x[0], 100, 0);
+	__heaplib_calloc_from(g, &x[1], 100, 0);
+	__heaplib_calloc_from(g, &x[2], 100, 0);
+	heaplib_free(&x[1], 0);
+	if(pass(g) != heaplib_error_none)
+	{
+		PRINTF("error: free node reported corrupt\n");
+		return 1;
+	}
+
+	t = heaplib_free_next(g, g->free_list);
+	heaplib_free_set_next(g, g->free_list, nil);
+	if(pass(g) != heaplib_error_fatal)
+	{
+		PRINTF("error: broken free list not found\n");
+		return 1;
+	}
+
+	/* And counters that don't match the nodes */
+	heaplib_free_set_next(g, g->free_list, t);
+	g->flags &= ~heaplib_flags_restrict;
+	g->scrub.corrupt = 0;
+	heaplib_free(&x[0], 0);
+	heaplib_free(&x[2], 0);
+	if(pass(g) != heaplib_error_none)
+	{
+		PRINTF("error: repaired Region reported corrupt\n");
+		return 1;
+	}
+
+	g->nodes_active++;
+	if(pass(g) != heaplib_error_fatal || g->scrub.corrupt != 1)
+	{
+		PRINTF("error: bad counters not found\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[64];
+	size_t z[64];
+	uint8_t * p;
+	size_t j;
+	int n;
+	int i;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			p = (uint8_t * )x[i];
+			for(j = 0; j < z[i]; j++)
+			{
+				if(p[j] != (i & 0xff))
+				{
+					PRINTF("error: object corrupt\n");
+					failed = True;
+					break;
+				}
+			}
+
+			if(heaplib_free(&x[i], heaplib_flags_nowait) !=
+			    heaplib_error_none)
+			{
+				PRINTF("error: free failed\n");
+				failed = True;
+			}
+
+			continue;
+		}
+
+		z[i] = (random() % 1024) + 1;
+		if(__heaplib_calloc_from(h, &x[i], z[i], heaplib_flags_wait) !=
+		    heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		memset((void * )x[i], i & 0xff, z[i]);
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], 0);
+	}
+
+	return nil;
+}
+
+static void *
+scrub(void * _x)
+{
+	USED(_x);
+
+	while(!done && !failed)
+	{
+		if(heaplib_region_scrub(h, BUDGET) != heaplib_error_none)
+		{
+			PRINTF("error: scrub found corruption under load\n");
+			failed = True;
+		}
+	}
+
+	return nil;
+}
@@ -0,0 +1,262 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 8
+#define NROUNDS 40000
+
+#define MEMSZ (4 * 1024 * 1024)
+#define SNAPSZ (1024 * 1024)
+
+/* Snapshots are appended here for tools/heapsnap, next to this binary */
+#define SNAPFILE "snapshots.bin"
+
+static pthread_mutex_t stats;
+int allocs;
+int frees;
+int snaps;
+
+static volatile int running;
+static boolean_t failed = False;
+
+static uint8_t snap[SNAPSZ];
+static char snappath[4096];
+
+static void * run(void * );
+
+/**
+ * \brief Every node must follow the one before it and the last must end the
+ * Region.
+ */
+static boolean_t
+validate(uint8_t * b, size_t z)
+{
+	heaplib_snapshot_region_t r;
+	heaplib_snapshot_node_t o;
+	heaplib_snapshot_t s;
+	uint64_t x;
+	uint64_t i;
+	uint8_t * p;
+	int k;
+
+	memcpy(&s, b, sizeof(s));
+	if(s.magic != HEAPLIB_SNAPSHOT_MAGIC || s.length != z || s.nregions != 2)
+	{
+		PRINTF("error: bad snapshot header length=%lu z=%lu regions=%d\n",
+			s.length, z, s.nregions);
+		return False;
+	}
+
+	p = b + sizeof(s);
+	for(k = 0; k < s.nregions; k++)
+	{
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+
+		x = 0;
+		for(i = 0; i < r.nnodes; i++)
+		{
+			memcpy(&o, p, sizeof(o));
+			p += sizeof(o);
+
+			if(o.offset != x)
+			{
+				PRINTF("error: region %d node %lu at %lu expected %lu\n",
+					r.index, i, o.offset, x);
+				return False;
+			}
+
+			x += r.header + (o.size & ~(uint64_t)HEAPLIB_NODE_BITS) +
+				r.footer;
+		}
+
+		if(x != r.size)
+		{
+			PRINTF("error: region %d nodes end at %lu size=%lu\n",
+				r.index, x, r.size);
+			return False;
+		}
+	}
+
+	return p == b + z;
+}
+
+/**
+ * \brief Open SNAPFILE in the directory this binary is in, wherever it is
+ * run from.
+ */
+static FILE *
+open_snapfile(void)
+{
+	ssize_t n;
+	char * d;
+
+	n = readlink("/proc/self/exe", snappath,
+		sizeof snappath - sizeof SNAPFILE);
+	if(n <= 0 || (size_t)n >= sizeof snappath - sizeof SNAPFILE)
+		return nil;
+
+	snappath[n] = '\0';
+	d = strrchr(snappath, '/');
+	strcpy(d ? d + 1 : snappath, SNAPFILE);
+
+	return fopen(snappath, "wb");
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	heaplib_region_t * h;
+	size_t z;
+	FILE * f;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_reserve(&h, MEMSZ, MEMSZ / 4, heaplib_flags_wiped) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve regions\n");
+		return 1;
+	}
+
+	f = open_snapfile();
+	if(!f)
+	{
+		PRINTF("error: can't open %s\n", snappath);
+		return 1;
+	}
+
+	/* A buffer that is too small reports the size it needs */
+	if(heaplib_snapshot(snap, sizeof(heaplib_snapshot_t), &z) !=
+	    heaplib_error_again || z <= sizeof(heaplib_snapshot_t))
+	{
+		PRINTF("error: short snapshot buffer not reported\n");
+		return 1;
+	}
+
+	pthread_mutex_init(&stats, nil);
+
+	running = NTHREADS;
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_create(&threads[i], nil, run, nil);
+	}
+
+	while(running && !failed)
+	{
+		if(heaplib_snapshot(snap, sizeof(snap), &z) != heaplib_error_none)
+		{
+			PRINTF("error: snapshot needs %lu bytes\n", z);
+			failed = True;
+			break;
+		}
+
+		if(!validate(snap, z))
+		{
+			failed = True;
+			break;
+		}
+
+		fwrite(snap, 1, z, f);
+		snaps++;
+
+		usleep(20 * 1000);
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	/* One last snapshot of the idle heap */
+	if(heaplib_snapshot(snap, sizeof(snap), &z) != heaplib_error_none ||
+	   !validate(snap, z))
+	{
+		failed = True;
+	}
+	else
+	{
+		fwrite(snap, 1, z, f);
+		snaps++;
+	}
+
+	fclose(f);
+
+	PRINTF("stats allocs=%d frees=%d snapshots=%d\n", allocs, frees, snaps);
+
+	return failed ? 1 : 0;
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[64];
+	heaplib_flags_t f;
+	int n;
+	int i;
+	int k;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			heaplib_free(&x[i], heaplib_flags_wait);
+
+			pthread_mutex_lock(&stats);
+			frees++;
+			pthread_mutex_unlock(&stats);
+			continue;
+		}
+
+		k = 4 + random() % 10;
+		f = (random() & 3) ? 0 : heaplib_flags_wiped;
+		if(heaplib_calloc(&x[i], 1, (random() % (1 << k)) + 1,
+			heaplib_flags_wait | f) != heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		pthread_mutex_lock(&stats);
+		allocs++;
+		pthread_mutex_unlock(&stats);
+	}
+
+	/* Leave some of the heap in use for the last snapshot */
+	for(i = 0; i < nelem(x) / 2; i++)
+	{
+		if(x[i])
+		{
+			heaplib_free(&x[i], heaplib_flags_wait);
+
+			pthread_mutex_lock(&stats);
+			frees++;
+			pthread_mutex_unlock(&stats);
+		}
+	}
+
+	__atomic_fetch_sub(&running, 1, __ATOMIC_RELAXED);
+
+	return nil;
+}
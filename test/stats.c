@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 8
+#define NROUNDS 20000
+
+#define MEMSZ (4 * 1024 * 1024)
+
+static pthread_mutex_t stats;
+int allocs;
+int frees;
+
+static boolean_t failed = False;
+
+static void * run(void * );
+
+#ifdef HEAPLIB_STATS
+/**
+ * \brief Check one summary is ordered and, if 'n' isn't ~0, holds 'n'.
+ */
+static boolean_t
+check(const char * what, heaplib_stat_op_t op, int r, int c, uint64_t n)
+{
+	heaplib_stats_t s;
+
+	if(heaplib_stats_query(&s, op, r, c) != heaplib_error_none)
+	{
+		PRINTF("error: %s: query failed\n", what);
+		return False;
+	}
+
+	PRINTF("%s: n=%lu p50=%lu p99=%lu p99.9=%lu max=%lu\n", what,
+		s.count, s.p50, s.p99, s.p999, s.max);
+
+	if(n != (uint64_t)~0 && s.count != n)
+	{
+		PRINTF("error: %s: count=%lu expected=%lu\n", what, s.count, n);
+		return False;
+	}
+
+	if(s.p50 > s.p99 || s.p99 > s.p999 || s.p999 > s.max)
+	{
+		PRINTF("error: %s: percentiles out of order\n", what);
+		return False;
+	}
+
+	return True;
+}
+
+/**
+ * \brief The per-Region and per-class breakdowns must add up to the total.
+ */
+static boolean_t
+check_sums(const char * what, heaplib_stat_op_t op, boolean_t sized)
+{
+	heaplib_stats_t s;
+	heaplib_stats_t t;
+	uint64_t n;
+	int i;
+
+	heaplib_stats_query(&t, op, -1, -1);
+
+	n = 0;
+	for(i = 0; i <= NREGIONS; i++)
+	{
+		heaplib_stats_query(&s, op, i, -1);
+		n += s.count;
+	}
+
+	if(n != t.count)
+	{
+		PRINTF("error: %s: regions sum=%lu total=%lu\n", what, n, t.count);
+		return False;
+	}
+
+	if(!sized)
+		return heaplib_stats_query(&s, op, -1, 0) != heaplib_error_none;
+
+	n = 0;
+	for(i = 0; i < HEAPLIB_STATS_CLASSES; i++)
+	{
+		heaplib_stats_query(&s, op, -1, i);
+		n += s.count;
+	}
+
+	if(n != t.count)
+	{
+		PRINTF("error: %s: classes sum=%lu total=%lu\n", what, n, t.count);
+		return False;
+	}
+
+	return True;
+}
+#endif
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	heaplib_region_t * h;
+	heaplib_region_t * w;
+	heaplib_stats_t s;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	/* Two Regions, so the per-Region breakdown has something to split */
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none ||
+	   heaplib_region_reserve(&w, MEMSZ, MEMSZ, heaplib_flags_wiped) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve regions\n");
+		return 1;
+	}
+
+	pthread_mutex_init(&stats, nil);
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_create(&threads[i], nil, run, nil);
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+	}
+
+	PRINTF("stats allocs=%d frees=%d\n", allocs, frees);
+
+	if(failed)
+		return 1;
+
+#ifndef HEAPLIB_STATS
+	/* Nothing is recorded unless the statistics are built in */
+	if(heaplib_stats_query(&s, heaplib_stat_calloc, -1, -1) !=
+	    heaplib_error_fatal)
+	{
+		PRINTF("error: query succeeded without HEAPLIB_STATS\n");
+		return 1;
+	}
+
+	return 0;
+#else
+	USED(s);
+
+	if(!check("calloc", heaplib_stat_calloc, -1, -1, allocs) ||
+	   !check("free", heaplib_stat_free, -1, -1, frees) ||
+	   !check("coalesce", heaplib_stat_coalesce, -1, -1, ~0) ||
+	   !check("lock", heaplib_stat_lock, -1, -1, ~0) ||
+	   !check("calloc region 0", heaplib_stat_calloc, 0, -1, ~0) ||
+	   !check("calloc region 1", heaplib_stat_calloc, 1, -1, ~0) ||
+	   !check("free size 3", heaplib_stat_free, -1, 3, ~0) ||
+	   !check_sums("calloc", heaplib_stat_calloc, True) ||
+	   !check_sums("free", heaplib_stat_free, True) ||
+	   !check_sums("lock", heaplib_stat_lock, False))
+	{
+		return 1;
+	}
+
+	/* Every allocation takes the Master lock at least once */
+	heaplib_stats_query(&s, heaplib_stat_lock, NREGIONS, -1);
+	if(s.count < (uint64_t)allocs)
+	{
+		PRINTF("error: master lock count=%lu\n", s.count);
+		return 1;
+	}
+
+	/* The full report is printed at exit */
+	return 0;
+#endif
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[32];
+	heaplib_flags_t f;
+	int n;
+	int i;
+	int k;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			heaplib_free(&x[i], heaplib_flags_wait);
+
+			pthread_mutex_lock(&stats);
+			frees++;
+			pthread_mutex_unlock(&stats);
+			continue;
+		}
+
+		/* Spread sizes across classes and requests across Regions */
+		k = 4 + random() % 11;
+		f = (random() & 1) ? heaplib_flags_wiped : 0;
+		if(heaplib_calloc(&x[i], 1, (random() % (1 << k)) + 1,
+			heaplib_flags_wait | f) != heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		pthread_mutex_lock(&stats);
+		allocs++;
+		pthread_mutex_unlock(&stats);
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+		{
+			heaplib_free(&x[i], heaplib_flags_wait);
+
+			pthread_mutex_lock(&stats);
+			frees++;
+			pthread_mutex_unlock(&stats);
+		}
+	}
+
+	return nil;
+}
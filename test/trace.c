@@ -0,0 +1,273 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 4
+#define NROUNDS 100000
+
+#define MEMSZ (4 * 1024 * 1024)
+#define TRACESZ (4 * 1024 * 1024)
+
+/* Traces are written here for tools/heaptrace */
+#define TRACEFILE "obj/trace.bin"
+
+static heaplib_region_t * h;
+static boolean_t failed = False;
+
+static uint8_t trace[TRACESZ];
+
+static void * run(void * );
+
+/**
+ * \brief Every thread's events must be in time order, and the main
+ * thread's last events must be the allocations and frees of 'x'.
+ */
+static boolean_t
+validate(uint8_t * b, size_t z, vaddr_t * x, int nx)
+{
+	heaplib_trace_event_t e;
+	heaplib_trace_thread_t r;
+	heaplib_trace_t t;
+	uint64_t last;
+	uint64_t i;
+	uint8_t * p;
+	int found;
+	int k;
+	int j;
+
+	memcpy(&t, b, sizeof(t));
+	if(t.magic != HEAPLIB_TRACE_MAGIC || t.length != z ||
+	   t.nthreads != NTHREADS + 1 || t.hz != PLATFORM_CLOCK_HZ)
+	{
+		PRINTF("error: bad trace header length=%lu z=%lu threads=%d\n",
+			t.length, z, t.nthreads);
+		return False;
+	}
+
+	found = 0;
+	p = b + sizeof(t);
+	for(k = 0; k < t.nthreads; k++)
+	{
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+
+		if(r.nevents == 0 || r.nevents > HEAPLIB_TRACE_EVENTS)
+		{
+			PRINTF("error: thread %d has %lu events\n", k, r.nevents);
+			return False;
+		}
+
+		last = 0;
+		for(i = 0; i < r.nevents; i++)
+		{
+			memcpy(&e, p + i * sizeof(e), sizeof(e));
+			if(e.time < last || e.op >= heaplib_trace_nops ||
+			   e.region > NREGIONS)
+			{
+				PRINTF("error: thread %d event %lu is bad\n", k, i);
+				return False;
+			}
+
+			last = e.time;
+		}
+
+		if(r.task == (uint64_t)(uintptr_t)pthread_self())
+		{
+			found = 1;
+
+			/* Each pointer was allocated, then freed in order,
+			 * among the splits and coalesces that took.
+			 */
+			j = 2 * nx;
+			for(i = r.nevents; i-- > 0 && j > 0; )
+			{
+				memcpy(&e, p + i * sizeof(e), sizeof(e));
+				if(e.op != heaplib_trace_calloc &&
+				   e.op != heaplib_trace_free)
+					continue;
+
+				j--;
+				if(e.op != (j < nx ? heaplib_trace_calloc :
+				    heaplib_trace_free) ||
+				   e.node != (uint64_t)(uintptr_t)x[j % nx] ||
+				   e.region != 0)
+				{
+					PRINTF("error: main event %d is %d for %lx\n",
+						j, e.op, e.node);
+					return False;
+				}
+			}
+
+			if(j != 0)
+			{
+				PRINTF("error: main thread events missing\n");
+				return False;
+			}
+		}
+
+		p += r.nevents * sizeof(e);
+	}
+
+	if(!found)
+	{
+		PRINTF("error: main thread isn't in the trace\n");
+		return False;
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	vaddr_t x[8];
+	vaddr_t y[8];
+	heaplib_error_t e;
+	heaplib_trace_t t;
+	size_t z;
+	FILE * f;
+	int i;
+
+	PRINTF("main!\n");
+
+	srandom(time(nil) ^ getpid());
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	e = heaplib_trace_read(trace, sizeof(trace), &z);
+#ifndef HEAPLIB_TRACE
+	if(e != heaplib_error_fatal)
+	{
+		PRINTF("error: trace read without HEAPLIB_TRACE\n");
+		return 1;
+	}
+
+	return 0;
+#endif
+
+	/* So far only the main thread has traced, adding the Region */
+	memcpy(&t, trace, sizeof(t));
+	if(e != heaplib_error_none || t.nthreads != 1 || t.length != z)
+	{
+		PRINTF("error: first trace has %d threads\n", t.nthreads);
+		return 1;
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], nil, run, nil);
+
+	for(i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], nil);
+
+	if(failed)
+		return 1;
+
+	/* The main thread's own events come last in its ring */
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(heaplib_calloc(&x[i], 1, 100, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return 1;
+		}
+
+		y[i] = x[i];
+	}
+
+	for(i = 0; i < nelem(x); i++)
+		heaplib_free(&x[i], heaplib_flags_wait);
+
+	/* Too small a buffer says how much is needed */
+	if(heaplib_trace_read(trace, sizeof(heaplib_trace_t), &z) !=
+	    heaplib_error_again || z <= sizeof(heaplib_trace_t))
+	{
+		PRINTF("error: short buffer accepted\n");
+		return 1;
+	}
+
+	if(heaplib_trace_read(trace, sizeof(trace), &z) != heaplib_error_none ||
+	   !validate(trace, z, y, nelem(y)))
+	{
+		PRINTF("error: trace is invalid\n");
+		return 1;
+	}
+
+	f = fopen(TRACEFILE, "wb");
+	if(f)
+	{
+		fwrite(trace, 1, z, f);
+		fclose(f);
+	}
+
+	return 0;
+}
+
+static void *
+run(void * _x)
+{
+	vaddr_t x[64];
+	size_t z[64];
+	uint8_t * p;
+	size_t j;
+	int n;
+	int i;
+
+	USED(_x);
+
+	memset(&x[0], 0, sizeof x);
+
+	for(n = 0; n < NROUNDS && !failed; n++)
+	{
+		i = random() % nelem(x);
+		if(x[i])
+		{
+			p = (uint8_t * )x[i];
+			for(j = 0; j < z[i]; j++)
+			{
+				if(p[j] != (i & 0xff))
+				{
+					PRINTF("error: object corrupt\n");
+					failed = True;
+					break;
+				}
+			}
+
+			heaplib_free(&x[i], heaplib_flags_nowait);
+			continue;
+		}
+
+		z[i] = (random() % 1024) + 1;
+		if(heaplib_calloc(&x[i], 1, z[i], heaplib_flags_wait) !=
+		    heaplib_error_none)
+		{
+			PRINTF("OOM in thread: %ld\n", pthread_self());
+			failed = True;
+			break;
+		}
+
+		memset((void * )x[i], i & 0xff, z[i]);
+	}
+
+	for(i = 0; i < nelem(x); i++)
+	{
+		if(x[i])
+			heaplib_free(&x[i], 0);
+	}
+
+	return nil;
+}
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+#include "heaplib/heaplib.h"
+
+#define MEMSZ (8 * 1024 * 1024)
+
+#define ADDSZ (256 * 1024)
+
+#define ALLOCSZ (12 * 1024)
+#define NOBJECTS 512
+
+static vaddr_t x[NOBJECTS];
+
+/**
+ * \brief How many of the pages of Region 'h' are resident.
+ */
+static size_t
+resident(heaplib_region_t * h)
+{
+	static unsigned char m[MEMSZ / 4096];
+	size_t n;
+	size_t i;
+	size_t r;
+
+	n = h->size / platform_page_size();
+	if(n > sizeof m || mincore((void * )h->addr, h->size, m) != 0)
+		return (size_t)~0;
+
+	r = 0;
+	for(i = 0; i < n; i++)
+		r += m[i] & 1;
+
+	return r;
+}
+
+/**
+ * \brief Whether every free node of 'h' that covers a whole page is marked
+ * known-zero.
+ */
+static boolean_t
+trimmed(heaplib_region_t * h)
+{
+	heaplib_node_t * n;
+	size_t p;
+
+	p = platform_page_size();
+	for(n = h->free_list; n; n = heaplib_free_next(h, n))
+	{
+		if(heaplib_node_size(n) >= 2 * p && !heaplib_node_zero(n))
+		{
+			PRINTF("error: free node %p of %lu bytes not trimmed\n", n,
+				heaplib_node_size(n));
+			return False;
+		}
+	}
+
+	return True;
+}
+
+/**
+ * \brief Fill the Region with objects that touch every page.
+ */
+static boolean_t
+fill(void)
+{
+	int i;
+
+	for(i = 0; i < NOBJECTS; i++)
+	{
+		if(heaplib_calloc(&x[i], 1, ALLOCSZ, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return False;
+		}
+
+		memset((void * )x[i], 0xa5, ALLOCSZ);
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	heaplib_region_t * h;
+	uint8_t * m;
+	uint8_t * p;
+	size_t r;
+	size_t t;
+	int i;
+	int j;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, heaplib_flags_trim) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	if(!fill())
+		return 1;
+
+	r = resident(h);
+
+	/* Free every other object, so the free nodes are apart */
+	for(i = 0; i < NOBJECTS; i += 2)
+		heaplib_free(&x[i], 0);
+
+	if(resident(h) != r || h->untrimmed < HEAPLIB_TRIM_THRESHOLD)
+	{
+		PRINTF("error: freeing alone changed residency\n");
+		return 1;
+	}
+
+	/* The idle pass trims, as enough has been freed */
+	heaplib_idle();
+
+	if(h->untrimmed != 0 || !trimmed(h) ||
+	   resident(h) > r - ((NOBJECTS / 2) * (ALLOCSZ / 4096 - 2)))
+	{
+		PRINTF("error: idle trim: %lu of %lu pages left\n", resident(h), r);
+		return 1;
+	}
+
+	/* The trimmed memory comes back clear */
+	for(i = 0; i < NOBJECTS; i += 2)
+	{
+		if(heaplib_calloc(&x[i], 1, ALLOCSZ, 0) != heaplib_error_none)
+		{
+			PRINTF("error: OOM\n");
+			return 1;
+		}
+
+		p = (uint8_t * )x[i];
+		for(j = 0; j < ALLOCSZ; j++)
+		{
+			if(p[j])
+			{
+				PRINTF("error: trimmed memory not clear\n");
+				return 1;
+			}
+		}
+	}
+
+	/* Trimming on demand works without the flag's threshold too */
+	r = resident(h);
+	for(i = 0; i < NOBJECTS; i++)
+		heaplib_free(&x[i], 0);
+
+	t = heaplib_region_trim(h);
+	if(t < (NOBJECTS - 2) * ALLOCSZ || !trimmed(h) ||
+	   resident(h) > r - (t / platform_page_size()))
+	{
+		PRINTF("error: trimmed %lu, %lu of %lu pages left\n", t,
+			resident(h), r);
+		return 1;
+	}
+
+	if(h->nodes_active != 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	/* Added memory may not read back as zero once released, so it is
+	 * left alone unless the caller says it is anonymous.
+	 */
+	m = calloc(1, ADDSZ);
+	if(!m || heaplib_region_add((vaddr_t)m, ADDSZ, heaplib_flags_trim) !=
+	    heaplib_error_none ||
+	   heaplib_ptr2region((vaddr_t)(m + ADDSZ / 2), &h, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't add\n");
+		return 1;
+	}
+	heaplib_region_unlock(&h->lock);
+
+	t = heaplib_region_trim(h);
+	if(t != 0 || heaplib_node_zero(h->free_list))
+	{
+		PRINTF("error: added memory trimmed %lu\n", t);
+		return 1;
+	}
+
+	m = mmap(nil, ADDSZ, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(m == MAP_FAILED ||
+	   heaplib_region_add((vaddr_t)m, ADDSZ, heaplib_flags_anonymous) !=
+	    heaplib_error_none ||
+	   heaplib_ptr2region((vaddr_t)(m + ADDSZ / 2), &h, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't add\n");
+		return 1;
+	}
+	heaplib_region_unlock(&h->lock);
+
+	t = heaplib_region_trim(h);
+	if(t < ADDSZ / 2 || !trimmed(h))
+	{
+		PRINTF("error: anonymous memory trimmed %lu\n", t);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "heaplib/heaplib.h"
+
+#define NTHREADS 4
+
+#define MEMSZ (256 * 1024)
+#define ALLOCSZ 1000
+
+/* How long the timeout path waits, and the most a wakeup may take */
+#define TIMEOUT 50
+#define WAKEMS 2000
+
+static vaddr_t woken[NTHREADS];
+static int nwoken;
+
+static void * sleeper(void * );
+
+/**
+ * \brief Wait up to 'ms' for 'n' sleepers to be woken with memory.
+ */
+static boolean_t
+wait_woken(int n, unsigned long ms)
+{
+	unsigned long t;
+
+	t = platform_time_ms();
+	while(__atomic_load_n(&nwoken, __ATOMIC_ACQUIRE) < n)
+	{
+		if(platform_time_ms() - t >= ms)
+			return False;
+
+		usleep(1000);
+	}
+
+	return True;
+}
+
+int
+main(void)
+{
+	pthread_t threads[NTHREADS];
+	heaplib_region_t * h;
+	unsigned long t;
+	vaddr_t y;
+	vaddr_t v;
+	int i;
+
+	PRINTF("main!\n");
+
+	heaplib_init();
+
+	if(heaplib_region_reserve(&h, MEMSZ, MEMSZ, 0) != heaplib_error_none)
+	{
+		PRINTF("error: can't reserve\n");
+		return 1;
+	}
+
+	/* Leave less than a request free */
+	if(heaplib_calloc(&y, 1, h->free - HEAPLIB_MIN_NODE, 0) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: can't fill the Region\n");
+		return 1;
+	}
+
+	/* Without the flag, a full heap fails straight away */
+	if(heaplib_calloc(&v, 1, ALLOCSZ, 0) == heaplib_error_none)
+	{
+		PRINTF("error: full Region gave memory\n");
+		return 1;
+	}
+
+	/* With it, the request sleeps until it times out */
+	t = platform_time_ms();
+	if(heaplib_calloc_timeout(&v, 1, ALLOCSZ, heaplib_flags_waitmem,
+	    TIMEOUT) != heaplib_error_again)
+	{
+		PRINTF("error: timed wait didn't time out\n");
+		return 1;
+	}
+
+	t = platform_time_ms() - t;
+	if(t < TIMEOUT || t >= WAKEMS || h->waiters != 0)
+	{
+		PRINTF("error: timed wait took %lu ms\n", t);
+		return 1;
+	}
+
+	/* Sleepers with no timeout stay asleep while nothing is freed */
+	for(i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], nil, sleeper, nil);
+
+	while(h->waiters < NTHREADS)
+		usleep(1000);
+
+	if(wait_woken(1, TIMEOUT))
+	{
+		PRINTF("error: sleeper woke with nothing freed\n");
+		return 1;
+	}
+
+	/* And all wake once there is room for them */
+	if(heaplib_free(&y, heaplib_flags_wait) != heaplib_error_none ||
+	   !wait_woken(NTHREADS, WAKEMS))
+	{
+		PRINTF("error: %d of %d sleepers woken by a free\n", nwoken,
+			NTHREADS);
+		return 1;
+	}
+
+	for(i = 0; i < NTHREADS; i++)
+	{
+		pthread_join(threads[i], nil);
+		heaplib_free(&woken[i], 0);
+	}
+
+	if(h->nodes_active != 0 || h->waiters != 0)
+	{
+		PRINTF("error: leaked active=%lu\n", h->nodes_active);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+sleeper(void * _x)
+{
+	vaddr_t v;
+
+	USED(_x);
+
+	if(heaplib_calloc(&v, 1, ALLOCSZ, heaplib_flags_waitmem) !=
+	    heaplib_error_none)
+	{
+		PRINTF("error: sleeper failed\n");
+		return nil;
+	}
+
+	woken[__atomic_fetch_add(&nwoken, 1, __ATOMIC_ACQ_REL)] = v;
+
+	return nil;
+}
@@ -0,0 +1,426 @@
+/**
+ * \file tools/heapsnap.c
+ *
+ * \brief Render heap snapshots taken with heaplib_snapshot.
+ *
+ * Reads one or more files, each holding any number of snapshots written back
+ * to back, and prints:
+ *
+ * - a timeline of total free bytes and the largest free block per snapshot,
+ * - a fragmentation map of each Region,
+ * - a histogram of free block sizes.
+ *
+ * The map and histogram are drawn for the last snapshot, or for every
+ * snapshot with -a. Snapshots must come from a host of the same byte order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heaplib/heaplib.h"
+
+#define MAPCOLS 64
+#define HISTBUCKETS 48
+#define BARWIDTH 40
+
+struct
+snapshot_t
+{
+	uint8_t * base;
+	heaplib_snapshot_t h;
+};
+
+typedef struct snapshot_t snapshot_t;
+
+static int maprows = 16;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: heapsnap [-a] [-r rows] file ...\n");
+	exit(1);
+}
+
+/**
+ * \brief Read a whole file into memory.
+ */
+static uint8_t *
+slurp(const char * path, size_t * zp)
+{
+	uint8_t * b;
+	size_t n;
+	size_t z;
+	FILE * f;
+
+	f = fopen(path, "rb");
+	if(!f)
+	{
+		perror(path);
+		return nil;
+	}
+
+	z = 0;
+	n = 1 << 20;
+	b = malloc(n);
+	while(b)
+	{
+		z += fread(b + z, 1, n - z, f);
+		if(z < n)
+			break;
+
+		n *= 2;
+		b = realloc(b, n);
+	}
+
+	fclose(f);
+	*zp = z;
+
+	return b;
+}
+
+/**
+ * \brief The byte length of a node record including its metadata.
+ */
+static uint64_t
+node_span(heaplib_snapshot_region_t * r, heaplib_snapshot_node_t * o)
+{
+	return r->header + (o->size & ~(uint64_t)HEAPLIB_NODE_BITS) + r->footer;
+}
+
+/**
+ * \brief Visit every Region in a snapshot. Records are copied out, since
+ * they are packed and may be unaligned.
+ */
+static void
+each_region(
+	snapshot_t * s,
+	void (*fn)(heaplib_snapshot_region_t *, heaplib_snapshot_node_t *, void * ),
+	void * arg)
+{
+	heaplib_snapshot_region_t r;
+	heaplib_snapshot_node_t * o;
+	uint8_t * p;
+	uint64_t i;
+	int k;
+
+	p = s->base + sizeof(heaplib_snapshot_t);
+	for(k = 0; k < s->h.nregions; k++)
+	{
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+
+		o = malloc((r.nnodes ? r.nnodes : 1) * sizeof(*o));
+		for(i = 0; i < r.nnodes; i++)
+		{
+			memcpy(&o[i], p, sizeof(*o));
+			p += sizeof(*o);
+		}
+
+		fn(&r, o, arg);
+		free(o);
+	}
+}
+
+struct
+totals_t
+{
+	uint64_t free;
+	uint64_t largest;
+	uint64_t nfree;
+	uint64_t nactive;
+	uint64_t size;
+};
+
+static void
+sum_region(heaplib_snapshot_region_t * r, heaplib_snapshot_node_t * o, void * a)
+{
+	struct totals_t * t;
+	uint64_t z;
+	uint64_t i;
+
+	t = a;
+	t->size += r->size;
+	for(i = 0; i < r->nnodes; i++)
+	{
+		z = o[i].size & ~(uint64_t)HEAPLIB_NODE_BITS;
+		if(o[i].size & HEAPLIB_NODE_ACTIVE)
+		{
+			t->nactive++;
+			continue;
+		}
+
+		t->nfree++;
+		t->free += z;
+		if(z > t->largest)
+			t->largest = z;
+	}
+}
+
+/**
+ * \brief One line per snapshot: free bytes, the largest free block and how
+ * much of the free memory lies outside it.
+ */
+static void
+timeline(snapshot_t * s, int n)
+{
+	struct totals_t t;
+	uint64_t w;
+	uint64_t m;
+	int b;
+	int i;
+
+	printf("timeline (ms, committed, active, free nodes, free bytes, "
+		"largest free, fragmentation)\n");
+
+	m = 1;
+	for(i = 0; i < n; i++)
+	{
+		memset(&t, 0, sizeof(t));
+		each_region(&s[i], sum_region, &t);
+		if(t.largest > m)
+			m = t.largest;
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		memset(&t, 0, sizeof(t));
+		each_region(&s[i], sum_region, &t);
+
+		printf("%10lu %10lu %7lu %7lu %10lu %10lu %5.1f%% |",
+			(unsigned long)(s[i].h.time - s[0].h.time),
+			(unsigned long)t.size,
+			(unsigned long)t.nactive,
+			(unsigned long)t.nfree,
+			(unsigned long)t.free,
+			(unsigned long)t.largest,
+			t.free ? 100.0 * (double)(t.free - t.largest) / t.free : 0.0);
+
+		w = t.largest * BARWIDTH / m;
+		for(b = 0; b < (int)w; b++)
+			putchar('=');
+		putchar('\n');
+	}
+}
+
+/**
+ * \brief Draw a Region as a grid of cells, each showing how much of the
+ * memory it covers is free: '#' none, '+' under half, '-' half or more,
+ * '.' all of it.
+ */
+static void
+map_region(heaplib_snapshot_region_t * r, heaplib_snapshot_node_t * o, void * a)
+{
+	uint64_t * f;
+	uint64_t c;
+	uint64_t n;
+	uint64_t i;
+	uint64_t x;
+	uint64_t y;
+	uint64_t e;
+	uint64_t q;
+
+	(void)a;
+
+	n = (uint64_t)maprows * MAPCOLS;
+	c = (r->size + n - 1) / n;
+	if(c == 0)
+		return;
+
+	f = calloc(n, sizeof(*f));
+
+	for(i = 0; i < r->nnodes; i++)
+	{
+		if(o[i].size & HEAPLIB_NODE_ACTIVE)
+			continue;
+
+		/* Spread the free node over the cells it overlaps */
+		x = o[i].offset;
+		e = x + node_span(r, &o[i]);
+		if(e > r->size)
+			e = r->size;
+		while(x < e)
+		{
+			y = (x / c + 1) * c;
+			if(y > e)
+				y = e;
+			f[x / c] += y - x;
+			x = y;
+		}
+	}
+
+	printf("region %u: addr=%#lx committed=%lu reserved=%lu free=%lu "
+		"nodes=%lu, %lu bytes per cell\n",
+		r->index,
+		(unsigned long)r->addr,
+		(unsigned long)r->size,
+		(unsigned long)r->reserved,
+		(unsigned long)r->free,
+		(unsigned long)r->nnodes,
+		(unsigned long)c);
+
+	for(i = 0; i < n && i * c < r->size; i++)
+	{
+		/* The last cell may be short */
+		q = (i + 1) * c <= r->size ? c : r->size - i * c;
+
+		if(f[i] == 0)
+			putchar('#');
+		else if(f[i] >= q)
+			putchar('.');
+		else if(f[i] * 2 < q)
+			putchar('+');
+		else
+			putchar('-');
+
+		if((i + 1) % MAPCOLS == 0)
+			putchar('\n');
+	}
+
+	if(i % MAPCOLS)
+		putchar('\n');
+
+	free(f);
+}
+
+/**
+ * \brief Free blocks by power of two of their payload size.
+ */
+static void
+hist_region(heaplib_snapshot_region_t * r, heaplib_snapshot_node_t * o, void * a)
+{
+	uint64_t * h;
+	uint64_t z;
+	uint64_t i;
+	int b;
+
+	h = a;
+	for(i = 0; i < r->nnodes; i++)
+	{
+		if(o[i].size & HEAPLIB_NODE_ACTIVE)
+			continue;
+
+		z = o[i].size & ~(uint64_t)HEAPLIB_NODE_BITS;
+		b = z ? 63 - __builtin_clzll(z) : 0;
+		h[b * 2] += 1;
+		h[b * 2 + 1] += z;
+	}
+}
+
+static void
+histogram(snapshot_t * s)
+{
+	uint64_t h[HISTBUCKETS * 2];
+	uint64_t m;
+	int b;
+	int i;
+
+	memset(h, 0, sizeof(h));
+	each_region(s, hist_region, h);
+
+	m = 1;
+	for(b = 0; b < HISTBUCKETS; b++)
+	{
+		if(h[b * 2 + 1] > m)
+			m = h[b * 2 + 1];
+	}
+
+	printf("free blocks by size (size from, count, bytes)\n");
+	for(b = 0; b < HISTBUCKETS; b++)
+	{
+		if(h[b * 2] == 0)
+			continue;
+
+		printf("%12lu %8lu %12lu |",
+			(unsigned long)1 << b,
+			(unsigned long)h[b * 2],
+			(unsigned long)h[b * 2 + 1]);
+		for(i = 0; i < (int)(h[b * 2 + 1] * BARWIDTH / m); i++)
+			putchar('*');
+		putchar('\n');
+	}
+}
+
+static void
+detail(snapshot_t * s, int i, uint64_t t)
+{
+	printf("\nsnapshot %d at %lu ms\n", i, (unsigned long)(s->h.time - t));
+	each_region(s, map_region, nil);
+	histogram(s);
+}
+
+int
+main(int argc, char * argv[])
+{
+	snapshot_t * s;
+	uint8_t * b;
+	size_t off;
+	size_t z;
+	int all;
+	int n;
+	int c;
+	int i;
+
+	all = 0;
+	while((c = getopt(argc, argv, "ar:")) != -1)
+	{
+		switch(c)
+		{
+		case 'a':
+			all = 1;
+			break;
+		case 'r':
+			maprows = atoi(optarg);
+			if(maprows <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if(optind >= argc)
+		usage();
+
+	s = nil;
+	n = 0;
+	for(i = optind; i < argc; i++)
+	{
+		b = slurp(argv[i], &z);
+		if(!b)
+			return 1;
+
+		for(off = 0; off + sizeof(heaplib_snapshot_t) <= z; )
+		{
+			s = realloc(s, (n + 1) * sizeof(*s));
+			s[n].base = b + off;
+			memcpy(&s[n].h, b + off, sizeof(s[n].h));
+
+			if(s[n].h.magic != HEAPLIB_SNAPSHOT_MAGIC ||
+			   s[n].h.version != HEAPLIB_SNAPSHOT_VERSION ||
+			   s[n].h.length < sizeof(heaplib_snapshot_t) ||
+			   off + s[n].h.length > z)
+			{
+				fprintf(stderr, "%s: bad snapshot at offset %lu\n",
+					argv[i], (unsigned long)off);
+				return 1;
+			}
+
+			off += s[n].h.length;
+			n++;
+		}
+	}
+
+	if(n == 0)
+	{
+		fprintf(stderr, "no snapshots\n");
+		return 1;
+	}
+
+	timeline(s, n);
+
+	for(i = all ? 0 : n - 1; i < n; i++)
+		detail(&s[i], i, s[0].h.time);
+
+	return 0;
+}
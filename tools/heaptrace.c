@@ -0,0 +1,274 @@
+/**
+ * \file tools/heaptrace.c
+ *
+ * \brief Decode event traces taken with heaplib_trace_read.
+ *
+ * Reads one or more files, each holding any number of traces written back
+ * to back. The events of every thread in a trace are merged in time order
+ * and printed one per line, or with -s only counted per event and thread.
+ * Traces must come from a host of the same byte order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heaplib/heaplib.h"
+
+static const char * names[heaplib_trace_nops] = {
+	[heaplib_trace_calloc] = "calloc",
+	[heaplib_trace_free] = "free",
+	[heaplib_trace_defer] = "defer",
+	[heaplib_trace_drain] = "drain",
+	[heaplib_trace_coalesce] = "coalesce",
+	[heaplib_trace_split] = "split",
+	[heaplib_trace_expand] = "expand",
+	[heaplib_trace_natural] = "natural",
+	[heaplib_trace_extend] = "extend",
+	[heaplib_trace_add] = "add",
+	[heaplib_trace_bad_pointer] = "bad-pointer",
+	[heaplib_trace_bad_magic] = "bad-magic",
+	[heaplib_trace_bad_list] = "bad-list",
+	[heaplib_trace_shared] = "shared",
+	[heaplib_trace_double_free] = "double-free",
+	[heaplib_trace_lock_failed] = "lock-failed",
+	[heaplib_trace_region_failed] = "region-failed",
+	[heaplib_trace_queue_full] = "queue-full",
+};
+
+struct
+event_t
+{
+	heaplib_trace_event_t e;
+	int thread;
+};
+
+typedef struct event_t event_t;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: heaptrace [-s] [-r region] file ...\n");
+	exit(1);
+}
+
+/**
+ * \brief Read a whole file into memory.
+ */
+static uint8_t *
+slurp(const char * path, size_t * zp)
+{
+	uint8_t * b;
+	size_t n;
+	size_t z;
+	FILE * f;
+
+	f = fopen(path, "rb");
+	if(!f)
+	{
+		perror(path);
+		return nil;
+	}
+
+	z = 0;
+	n = 1 << 20;
+	b = malloc(n);
+	while(b)
+	{
+		z += fread(b + z, 1, n - z, f);
+		if(z < n)
+			break;
+
+		n *= 2;
+		b = realloc(b, n);
+	}
+
+	fclose(f);
+	*zp = z;
+
+	return b;
+}
+
+static int
+by_time(const void * a, const void * b)
+{
+	const event_t * x = a;
+	const event_t * y = b;
+
+	if(x->e.time != y->e.time)
+		return x->e.time < y->e.time ? -1 : 1;
+
+	return x->thread - y->thread;
+}
+
+static const char *
+name(unsigned int op)
+{
+	return op < heaplib_trace_nops && names[op] ? names[op] : "unknown";
+}
+
+/**
+ * \brief Print the trace at 'p', whose header is 't'. Records are copied
+ * out, since they are packed and may be unaligned.
+ *
+ * \return Whether the trace was well formed.
+ */
+static boolean_t
+decode(uint8_t * p, heaplib_trace_t * t, int region, int summary)
+{
+	heaplib_trace_thread_t r;
+	uint64_t counts[heaplib_trace_nops + 1];
+	uint8_t * end;
+	event_t * v;
+	uint64_t i;
+	size_t n;
+	int k;
+
+	end = p + t->length;
+	p += sizeof(*t);
+
+	printf("trace: %d threads, %lu ticks per second\n", t->nthreads,
+		(unsigned long)t->hz);
+
+	v = nil;
+	n = 0;
+	for(k = 0; k < t->nthreads; k++)
+	{
+		if(p + sizeof(r) > end)
+			return False;
+
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+
+		if(r.nevents > (uint64_t)(end - p) / sizeof(heaplib_trace_event_t))
+			return False;
+
+		printf("thread %d: task %#lx, %lu events, %lu lost\n", k,
+			(unsigned long)r.task,
+			(unsigned long)r.nevents,
+			(unsigned long)r.lost);
+
+		v = realloc(v, (n + r.nevents + 1) * sizeof(*v));
+		for(i = 0; i < r.nevents; i++)
+		{
+			memcpy(&v[n].e, p, sizeof(v[n].e));
+			p += sizeof(v[n].e);
+
+			if(region >= 0 && v[n].e.region != region)
+				continue;
+
+			v[n].thread = k;
+			n++;
+		}
+	}
+
+	qsort(v, n, sizeof(*v), by_time);
+
+	if(summary)
+	{
+		memset(counts, 0, sizeof(counts));
+		for(i = 0; i < n; i++)
+		{
+			if(v[i].e.op < heaplib_trace_nops)
+				counts[v[i].e.op]++;
+			else
+				counts[heaplib_trace_nops]++;
+		}
+
+		for(k = 0; k <= heaplib_trace_nops; k++)
+		{
+			if(counts[k])
+				printf("%14s %10lu\n", name(k),
+					(unsigned long)counts[k]);
+		}
+
+		free(v);
+		return True;
+	}
+
+	printf("(ticks, thread, region, event, size, node)\n");
+	for(i = 0; i < n; i++)
+	{
+		printf("%14lu %3d %3d %-14s %12lu %#18lx\n",
+			(unsigned long)(v[i].e.time - v[0].e.time),
+			v[i].thread,
+			v[i].e.region,
+			name(v[i].e.op),
+			(unsigned long)v[i].e.size,
+			(unsigned long)v[i].e.node);
+	}
+
+	free(v);
+	return True;
+}
+
+int
+main(int argc, char * argv[])
+{
+	heaplib_trace_t t;
+	uint8_t * b;
+	size_t off;
+	size_t z;
+	int summary;
+	int region;
+	int n;
+	int c;
+	int i;
+
+	summary = 0;
+	region = -1;
+	while((c = getopt(argc, argv, "sr:")) != -1)
+	{
+		switch(c)
+		{
+		case 's':
+			summary = 1;
+			break;
+		case 'r':
+			region = atoi(optarg);
+			if(region < 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if(optind >= argc)
+		usage();
+
+	n = 0;
+	for(i = optind; i < argc; i++)
+	{
+		b = slurp(argv[i], &z);
+		if(!b)
+			return 1;
+
+		for(off = 0; off + sizeof(t) <= z; off += t.length)
+		{
+			memcpy(&t, b + off, sizeof(t));
+
+			if(t.magic != HEAPLIB_TRACE_MAGIC ||
+			   t.version != HEAPLIB_TRACE_VERSION ||
+			   t.length < sizeof(t) || off + t.length > z ||
+			   !decode(b + off, &t, region, summary))
+			{
+				fprintf(stderr, "%s: bad trace at offset %lu\n",
+					argv[i], (unsigned long)off);
+				return 1;
+			}
+
+			n++;
+		}
+
+		free(b);
+	}
+
+	if(n == 0)
+	{
+		fprintf(stderr, "no traces\n");
+		return 1;
+	}
+
+	return 0;
+}